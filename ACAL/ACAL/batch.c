@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "llsim.h"
+#include "image.h"
+
+/*
+ * batch regression runner
+ *
+ * a manifest lists one program per line, optionally followed by a
+ * directory of golden outputs. paths are relative to the manifest, '#'
+ * starts a comment:
+ *
+ *	example.bin		example_traces
+ *	mult.bin		mult_traces
+ *
+ * every program runs in a forked child inside outdir/<name>, with the
+ * program linked in under its own file name so the outputs look exactly
+ * like a run from the program's directory. up to jobs children run at a
+ * time. after the simulation the child compares its outputs against every
+ * *.txt golden file (a leading "<name>_" is dropped from golden names) and
+ * writes the verdict to compare.txt.
+ */
+#define BATCH_EXIT_MISMATCH	3
+
+typedef struct batch_job_s {
+	char *program;		// absolute path
+	char *name;		// program file name without .bin
+	char *golden;		// absolute path, NULL when there is none
+	pid_t pid;
+	struct timespec start;
+	double wall, cpu;
+	int status;
+} batch_job_t;
+
+static double batch_elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static char *batch_strdup(char *s)
+{
+	char *p;
+
+	p = llsim_malloc(strlen(s) + 1);
+	strcpy(p, s);
+	return p;
+}
+
+/*
+ * absolute path of a manifest entry, relative paths start at dir
+ */
+static char *batch_path(char *manifest, int line, char *dir, char *name)
+{
+	char path[PATH_MAX], abs[PATH_MAX];
+
+	if (name[0] == '/')
+		snprintf(path, sizeof(path), "%s", name);
+	else
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (realpath(path, abs) == NULL) {
+		printf("%s:%d: couldn't find %s\n", manifest, line, path);
+		exit(1);
+	}
+	return batch_strdup(abs);
+}
+
+static batch_job_t *batch_read_manifest(char *manifest, int *nr_jobs)
+{
+	char buf[1024], dir[PATH_MAX], *p, *program, *golden;
+	batch_job_t *jobs = NULL;
+	int line, nr, size, i;
+	FILE *fp;
+
+	fp = fopen(manifest, "r");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", manifest);
+		exit(1);
+	}
+	snprintf(dir, sizeof(dir), "%s", manifest);
+	p = strrchr(dir, '/');
+	if (p)
+		*p = 0;
+	else
+		strcpy(dir, ".");
+
+	nr = size = 0;
+	for (line = 1; fgets(buf, sizeof(buf), fp); line++) {
+		p = strchr(buf, '#');
+		if (p)
+			*p = 0;
+		program = strtok(buf, " \t\r\n");
+		if (program == NULL)
+			continue;
+		golden = strtok(NULL, " \t\r\n");
+
+		if (nr == size) {
+			size = size ? size * 2 : 16;
+			jobs = realloc(jobs, size * sizeof(batch_job_t));
+			llsim_assert(jobs != NULL, "out of memory");
+		}
+		memset(&jobs[nr], 0, sizeof(batch_job_t));
+		jobs[nr].program = batch_path(manifest, line, dir, program);
+		if (golden)
+			jobs[nr].golden = batch_path(manifest, line, dir, golden);
+		p = strrchr(jobs[nr].program, '/') + 1;
+		jobs[nr].name = batch_strdup(p);
+		p = strrchr(jobs[nr].name, '.');
+		if (p && strcmp(p, ".bin") == 0)
+			*p = 0;
+		for (i = 0; i < nr; i++) {
+			if (strcmp(jobs[i].name, jobs[nr].name) == 0) {
+				printf("%s:%d: program name %s used twice\n", manifest, line, jobs[nr].name);
+				exit(1);
+			}
+		}
+		nr++;
+	}
+	fclose(fp);
+	*nr_jobs = nr;
+	return jobs;
+}
+
+static char *batch_read_file(char *path, long *len)
+{
+	char *buf;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return NULL;
+	fseek(fp, 0, SEEK_END);
+	*len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buf = llsim_malloc(*len + 1);
+	if (fread(buf, 1, *len, fp) != *len)
+		*len = -1;
+	fclose(fp);
+	return buf;
+}
+
+/*
+ * returns 0 when both files are identical, otherwise the first differing
+ * line
+ */
+static long batch_compare_text(char *out, char *golden)
+{
+	char *a, *b;
+	long alen, blen, i, line;
+
+	a = batch_read_file(out, &alen);
+	b = batch_read_file(golden, &blen);
+	line = 0;
+	if (a == NULL || b == NULL || alen < 0 || blen < 0) {
+		line = 1;
+		goto out;
+	}
+	for (i = 0; i < alen && i < blen && a[i] == b[i]; i++)
+		;
+	if (i < alen || i < blen) {
+		line = 1;
+		while (i-- > 0)
+			if (b[i] == '\n')
+				line++;
+	}
+out:
+	free(a);
+	free(b);
+	return line;
+}
+
+/*
+ * compares a memory dump written in a compact format against a text
+ * golden, returns 0 or the first differing line (= address + 1)
+ */
+static long batch_compare_image(char *out, char *golden)
+{
+	image_t *a, *b;
+	long line;
+	int i;
+
+	b = image_open(golden, INT_MAX);
+	a = image_open(out, b->nr_words);
+	for (i = 0; i < a->nr_words && i < b->nr_words; i++)
+		if (a->words[i] != b->words[i])
+			break;
+	line = (i < a->nr_words || i < b->nr_words) ? i + 1 : 0;
+	image_close(a);
+	image_close(b);
+	return line;
+}
+
+static int batch_compare(batch_job_t *job)
+{
+	char golden[PATH_MAX], out[PATH_MAX], *name;
+	struct dirent *de;
+	int failed, i, len;
+	long line;
+	FILE *report;
+	DIR *dir;
+
+	report = fopen("compare.txt", "w");
+	if (report == NULL) {
+		printf("couldn't open file compare.txt\n");
+		exit(1);
+	}
+	dir = opendir(job->golden);
+	if (dir == NULL) {
+		fprintf(report, "couldn't open golden directory %s\n", job->golden);
+		fclose(report);
+		return 1;
+	}
+
+	failed = 0;
+	len = strlen(job->name);
+	while ((de = readdir(dir)) != NULL) {
+		name = de->d_name;
+		if (strlen(name) < 5 || strcmp(name + strlen(name) - 4, ".txt"))
+			continue;
+		snprintf(golden, sizeof(golden), "%s/%s", job->golden, name);
+		if (strncmp(name, job->name, len) == 0 && name[len] == '_')
+			name += len + 1;
+
+		// memory dumps may have been written in a compact format
+		snprintf(out, sizeof(out), "%s", name);
+		for (i = 0; access(out, R_OK) && i < IMAGE_NR_FORMATS; i++)
+			snprintf(out, sizeof(out), "%.*s.%s", (int) strlen(name) - 4, name, llsim_dump_ext[i]);
+		if (access(out, R_OK)) {
+			fprintf(report, "missing %s\n", name);
+			failed++;
+			continue;
+		}
+
+		if (strcmp(out, name) == 0)
+			line = batch_compare_text(out, golden);
+		else
+			line = batch_compare_image(out, golden);
+		if (line) {
+			fprintf(report, "%s differs from %s at line %ld\n", out, golden, line);
+			failed++;
+		} else {
+			fprintf(report, "ok %s\n", out);
+		}
+	}
+	closedir(dir);
+	fclose(report);
+	return failed;
+}
+
+static void batch_run_job(batch_job_t *job, char *outdir)
+{
+	char dir[2 * PATH_MAX], *base;
+
+	snprintf(dir, sizeof(dir), "%s/%s", outdir, job->name);
+	if ((mkdir(dir, 0777) && errno != EEXIST) || chdir(dir)) {
+		printf("couldn't create directory %s\n", dir);
+		exit(1);
+	}
+	if (freopen("stdout.txt", "w", stdout) == NULL)
+		exit(1);
+	dup2(fileno(stdout), 2);
+
+	base = strrchr(job->program, '/') + 1;
+	unlink(base);
+	if (symlink(job->program, base)) {
+		printf("couldn't link %s\n", job->program);
+		exit(1);
+	}
+	llsim_simulate(base);
+	fflush(stdout);
+	if (job->golden && batch_compare(job))
+		exit(BATCH_EXIT_MISMATCH);
+	exit(0);
+}
+
+static void batch_report(batch_job_t *job, char *outdir, int done, int nr)
+{
+	char path[2 * PATH_MAX], buf[1024], *verdict;
+	FILE *fp;
+
+	if (WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0)
+		verdict = job->golden ? "PASS" : "DONE";
+	else if (WIFEXITED(job->status) && WEXITSTATUS(job->status) == BATCH_EXIT_MISMATCH)
+		verdict = "FAIL";
+	else
+		verdict = "ERROR";
+	printf("[%d/%d] %-5s %-20s wall %8.3fs cpu %8.3fs\n", done, nr, verdict, job->name, job->wall, job->cpu);
+
+	if (WIFSIGNALED(job->status))
+		printf("      killed by signal %d\n", WTERMSIG(job->status));
+	else if (strcmp(verdict, "ERROR") == 0)
+		printf("      exit status %d, see %s/%s/stdout.txt\n", WEXITSTATUS(job->status), outdir, job->name);
+	if (strcmp(verdict, "FAIL"))
+		return;
+	snprintf(path, sizeof(path), "%s/%s/compare.txt", outdir, job->name);
+	fp = fopen(path, "r");
+	while (fp && fgets(buf, sizeof(buf), fp))
+		if (strncmp(buf, "ok ", 3))
+			printf("      %s", buf);
+	if (fp)
+		fclose(fp);
+}
+
+/*
+ * runs all programs of the manifest, jobs at a time (0: one per cpu).
+ * returns the number of programs that failed.
+ */
+int llsim_batch(char *manifest, char *outdir, int jobs)
+{
+	char abs_outdir[PATH_MAX];
+	struct timespec start;
+	struct rusage ru;
+	batch_job_t *job_vec;
+	int nr, next, running, done, failed, status, i;
+	double cpu;
+	pid_t pid;
+
+	job_vec = batch_read_manifest(manifest, &nr);
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs <= 0)
+		jobs = 1;
+	if ((mkdir(outdir, 0777) && errno != EEXIST) || realpath(outdir, abs_outdir) == NULL) {
+		printf("couldn't create directory %s\n", outdir);
+		exit(1);
+	}
+	printf("llsim: batch of %d programs, %d jobs, output in %s\n", nr, jobs, abs_outdir);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = running = done = failed = 0;
+	cpu = 0;
+	while (done < nr) {
+		while (running < jobs && next < nr) {
+			clock_gettime(CLOCK_MONOTONIC, &job_vec[next].start);
+			fflush(stdout);
+			pid = fork();
+			if (pid < 0) {
+				printf("llsim: fork failed\n");
+				exit(1);
+			}
+			if (pid == 0)
+				batch_run_job(&job_vec[next], abs_outdir);
+			job_vec[next].pid = pid;
+			next++;
+			running++;
+		}
+
+		pid = wait4(-1, &status, 0, &ru);
+		if (pid < 0) {
+			printf("llsim: wait failed\n");
+			exit(1);
+		}
+		for (i = 0; i < next; i++)
+			if (job_vec[i].pid == pid)
+				break;
+		if (i == next)
+			continue;
+		job_vec[i].status = status;
+		job_vec[i].wall = batch_elapsed(&job_vec[i].start);
+		job_vec[i].cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+				 ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+		cpu += job_vec[i].cpu;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+		running--;
+		done++;
+		batch_report(&job_vec[i], abs_outdir, done, nr);
+	}
+
+	printf("llsim: %d passed, %d failed, wall %.3fs, cpu %.3fs\n",
+	       nr - failed, failed, batch_elapsed(&start), cpu);
+	return failed;
+}
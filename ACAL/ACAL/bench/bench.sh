@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# simulator benchmark suite, run by make bench from ACAL/ACAL
+#
+# runs every program on the multicycle core (ACAL) and the pipelined one
+# (ACAL_lab5), with traces and without (-n), REPEAT times each keeping the
+# fastest run, and compares the simulated clocks and the host clock rate
+# with bench/baseline.txt. the clocks must not change, a change makes the
+# suite fail. BENCH_SAVE=1 writes the results as the new baseline.
+#
+REPEAT=${REPEAT:-3}
+TOP=$PWD
+OUT=bench/out
+BASELINE=bench/baseline.txt
+RESULTS=$OUT/results.txt
+
+CORES="acal:$TOP/llsim lab5:$TOP/../../ACAL_lab5/ACAL_lab5/llsim"
+PROGRAMS="example.bin mult.bin mult_table.bin hw2_dma_submission_files/dma.bin
+	bench/memcpy.bin bench/bsort.bin bench/matmul.bin bench/checksum.bin"
+
+rm -rf $OUT
+mkdir -p $OUT
+: > $RESULTS
+
+for core in $CORES; do
+	name=${core%%:*}
+	sim=${core#*:}
+	for prog in $PROGRAMS; do
+		for trace in on off; do
+			flags="-q -T"
+			[ $trace = off ] && flags="$flags -n"
+			dir=$OUT/$name/$(basename $prog .bin)-$trace
+			mkdir -p $dir
+			best=
+			i=0
+			while [ $i -lt $REPEAT ]; do
+				# llsim: host: <clocks> clocks in <seconds> s, <rate> kHz|MHz
+				line=$(cd $dir && $sim $flags $TOP/$prog | grep "^llsim: host: .* clocks in")
+				if [ -z "$line" ]; then
+					echo "bench: $name $prog failed"
+					exit 1
+				fi
+				best=$(echo "$line $best" | awk '{
+					khz = $9 == "MHz" ? $8 * 1000 : $8
+					if ($11 == "" || khz > $11)
+						print $3, khz
+					else
+						print $10, $11
+				}')
+				i=$((i + 1))
+			done
+			echo "$name $(basename $prog .bin) $trace $best" >> $RESULTS
+		done
+	done
+done
+
+if [ "$BENCH_SAVE" = 1 ]; then
+	{
+		echo "# core program trace clocks khz, see bench.sh. host clock rates are"
+		echo "# only comparable on the machine that wrote them"
+		cat $RESULTS
+	} > $BASELINE
+	echo "bench: baseline written to $BASELINE"
+	exit 0
+fi
+
+# joins the results with the baseline on core, program and trace
+awk -v baseline=$BASELINE '
+BEGIN {
+	while ((getline line < baseline) > 0) {
+		if (line ~ /^#/)
+			continue
+		split(line, f, " ")
+		key = f[1] " " f[2] " " f[3]
+		base_clocks[key] = f[4]
+		base_khz[key] = f[5]
+	}
+	printf("%-5s %-11s %-5s %10s %9s %11s %11s %8s\n", "core", "program", "trace",
+	       "clocks", "seconds", "khz", "base khz", "speedup")
+	status = 0
+}
+{
+	key = $1 " " $2 " " $3
+	seconds = $5 > 0 ? $4 / $5 / 1000 : 0
+	printf("%-5s %-11s %-5s %10d %9.4f %11.1f", $1, $2, $3, $4, seconds, $5)
+	if (!(key in base_clocks)) {
+		printf(" %11s %8s\n", "-", "-")
+		next
+	}
+	printf(" %11.1f %7.2fx", base_khz[key], base_khz[key] > 0 ? $5 / base_khz[key] : 0)
+	if ($4 != base_clocks[key]) {
+		printf("  CLOCKS CHANGED, were %d", base_clocks[key])
+		status = 1
+	}
+	printf("\n")
+}
+END {
+	exit status
+}' $RESULTS
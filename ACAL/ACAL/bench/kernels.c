@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * benchmark kernels
+ *
+ * writes the larger guest programs of the benchmark suite (see bench.sh)
+ * into the given directory: memcpy.bin, bsort.bin, matmul.bin and
+ * checksum.bin. they are assembled the way dma_test_iss.c assembles the
+ * DMA test, one asm_cmd() per instruction, with their data in the same
+ * image. they only use the instructions both cores run, no DMA.
+ *
+ * R0 is 0, R1 the immediate and a taken jump writes R7, so a kernel has
+ * R2..R6 and spills the rest to memory.
+ */
+#define MEM_SIZE	(1 << 16)
+
+#define ADD 0
+#define SUB 1
+#define LSF 2
+#define RSF 3
+#define AND 4
+#define OR  5
+#define XOR 6
+#define LHI 7
+#define LD 8
+#define ST 9
+#define JLT 16
+#define JLE 17
+#define JEQ 18
+#define JNE 19
+#define JIN 20
+#define HLT 24
+
+static int mem[MEM_SIZE];
+static int pc;
+static int last_addr;
+
+static void asm_cmd(int opcode, int dst, int src0, int src1, int immediate)
+{
+	mem[pc++] = (opcode << 25) | (dst << 22) | (src0 << 19) | (src1 << 16) | (immediate & 0xffff);
+}
+
+/*
+ * sets the target of the forward jump at addr
+ */
+static void patch(int addr, int target)
+{
+	mem[addr] = (mem[addr] & ~0xffff) | (target & 0xffff);
+}
+
+static void start(void)
+{
+	memset(mem, 0, sizeof(mem));
+	pc = 0;
+	last_addr = 0;
+}
+
+static void data(int addr, int val)
+{
+	mem[addr] = val;
+	if (addr + 1 > last_addr)
+		last_addr = addr + 1;
+}
+
+/*
+ * deterministic data, the same on every host
+ */
+static unsigned int seed;
+
+static int random_word(int mask)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & mask;
+}
+
+static void write_program(char *dir, char *name)
+{
+	char path[1024];
+	FILE *fp;
+	int addr;
+
+	if (pc > last_addr)
+		last_addr = pc;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", path);
+		exit(1);
+	}
+	for (addr = 0; addr < last_addr; addr++)
+		fprintf(fp, "%08x\n", mem[addr]);
+	fclose(fp);
+}
+
+/*
+ * copies 4096 words from 4096 to 12288
+ */
+#define MEMCPY_SRC	4096
+#define MEMCPY_DST	12288
+#define MEMCPY_N	4096
+
+static void memcpy_program(char *dir)
+{
+	int i;
+
+	start();
+	asm_cmd(ADD, 2, 1, 0, MEMCPY_SRC);		// 0: R2 = source
+	asm_cmd(ADD, 3, 1, 0, MEMCPY_DST);		// 1: R3 = destination
+	asm_cmd(ADD, 4, 1, 0, MEMCPY_SRC + MEMCPY_N);	// 2: R4 = end of source
+	asm_cmd(LD, 5, 0, 2, 0);			// 3: R5 = Mem[R2]
+	asm_cmd(ST, 0, 5, 3, 0);			// 4: Mem[R3] = R5
+	asm_cmd(ADD, 2, 2, 1, 1);			// 5: R2++
+	asm_cmd(ADD, 3, 3, 1, 1);			// 6: R3++
+	asm_cmd(JLT, 0, 2, 4, 3);			// 7: if R2 < R4 goto 3
+	asm_cmd(HLT, 0, 0, 0, 0);			// 8: halt
+
+	seed = 1;
+	for (i = 0; i < MEMCPY_N; i++)
+		data(MEMCPY_SRC + i, random_word(0xffff));
+	write_program(dir, "memcpy.bin");
+}
+
+/*
+ * sorts 80 words at 4096 in place, ascending
+ */
+#define BSORT_BASE	4096
+#define BSORT_N		80
+
+static void bsort_program(char *dir)
+{
+	int i;
+
+	start();
+	asm_cmd(ADD, 2, 1, 0, BSORT_BASE + BSORT_N - 1);	// 0: R2 = last unsorted
+	asm_cmd(ADD, 3, 1, 0, BSORT_BASE);		// 1: outer: R3 = first
+	asm_cmd(LD, 4, 0, 3, 0);			// 2: inner: R4 = Mem[R3]
+	asm_cmd(ADD, 6, 3, 1, 1);			// 3: R6 = R3 + 1
+	asm_cmd(LD, 5, 0, 6, 0);			// 4: R5 = Mem[R6]
+	asm_cmd(JLE, 0, 4, 5, 8);			// 5: in order, no swap
+	asm_cmd(ST, 0, 5, 3, 0);			// 6: Mem[R3] = R5
+	asm_cmd(ST, 0, 4, 6, 0);			// 7: Mem[R6] = R4
+	asm_cmd(ADD, 3, 3, 1, 1);			// 8: R3++
+	asm_cmd(JLT, 0, 3, 2, 2);			// 9: if R3 < R2 goto inner
+	asm_cmd(SUB, 2, 2, 1, 1);			// 10: R2--
+	asm_cmd(ADD, 6, 1, 0, BSORT_BASE);		// 11: R6 = first
+	asm_cmd(JLT, 0, 6, 2, 1);			// 12: if R6 < R2 goto outer
+	asm_cmd(HLT, 0, 0, 0, 0);			// 13: halt
+
+	seed = 2;
+	for (i = 0; i < BSORT_N; i++)
+		data(BSORT_BASE + i, random_word(0x7fff) - 0x4000);
+	write_program(dir, "bsort.bin");
+}
+
+/*
+ * C = A * B of 10x10 matrices at 4096, 4352 and 4608. there is no
+ * multiply, every product is added to the sum by shift and add. the row
+ * and column pointers live in memory. loaded registers aren't used right
+ * away, the pipelined core misses some of those hazards.
+ */
+#define MATMUL_N	10
+#define MATMUL_A	4096
+#define MATMUL_B	4352
+#define MATMUL_C	4608
+#define MATMUL_ROW	4000		// A + i * n
+#define MATMUL_COL	4001		// B + j
+#define MATMUL_OUT	4002		// next word of C
+#define MATMUL_KEND	4003		// end of row i of A
+
+static void matmul_program(char *dir)
+{
+	int row, col, k, mul, skip, done, i;
+
+	start();
+	asm_cmd(ADD, 2, 1, 0, MATMUL_A);		// row = A
+	asm_cmd(ST, 0, 2, 1, MATMUL_ROW);
+	asm_cmd(ADD, 2, 1, 0, MATMUL_C);		// out = C
+	asm_cmd(ST, 0, 2, 1, MATMUL_OUT);
+	row = pc;
+	asm_cmd(ADD, 2, 1, 0, MATMUL_B);		// col = B
+	asm_cmd(ST, 0, 2, 1, MATMUL_COL);
+	col = pc;
+	asm_cmd(LD, 2, 0, 1, MATMUL_ROW);		// R2 = &A[i][0]
+	asm_cmd(LD, 3, 0, 1, MATMUL_COL);		// R3 = &B[0][j]
+	asm_cmd(ADD, 5, 2, 1, MATMUL_N);		// kend = R2 + n
+	asm_cmd(ST, 0, 5, 1, MATMUL_KEND);
+	asm_cmd(ADD, 4, 0, 0, 0);			// R4 = sum = 0
+	k = pc;
+	asm_cmd(LD, 6, 0, 3, 0);			// R6 = B[k][j]
+	asm_cmd(LD, 5, 0, 2, 0);			// R5 = A[i][k]
+	mul = pc;
+	done = pc;
+	asm_cmd(JEQ, 0, 6, 0, 0);			// multiplier done
+	asm_cmd(AND, 7, 6, 1, 1);			// R7 = R6 & 1
+	skip = pc;
+	asm_cmd(JEQ, 0, 7, 0, 0);			// even, don't add
+	asm_cmd(ADD, 4, 4, 5, 0);			// sum += R5
+	patch(skip, pc);
+	asm_cmd(LSF, 5, 5, 1, 1);			// R5 <<= 1
+	asm_cmd(RSF, 6, 6, 1, 1);			// R6 >>= 1
+	asm_cmd(JEQ, 0, 0, 0, mul);
+	patch(done, pc);
+	asm_cmd(LD, 5, 0, 1, MATMUL_KEND);
+	asm_cmd(ADD, 2, 2, 1, 1);			// next k in A's row
+	asm_cmd(ADD, 3, 3, 1, MATMUL_N);		// next k in B's column
+	asm_cmd(JLT, 0, 2, 5, k);
+	asm_cmd(LD, 5, 0, 1, MATMUL_OUT);		// C[i][j] = sum
+	asm_cmd(LD, 6, 0, 1, MATMUL_COL);
+	asm_cmd(ST, 0, 4, 5, 0);
+	asm_cmd(ADD, 5, 5, 1, 1);
+	asm_cmd(ST, 0, 5, 1, MATMUL_OUT);
+	asm_cmd(ADD, 6, 6, 1, 1);			// next column
+	asm_cmd(ST, 0, 6, 1, MATMUL_COL);
+	asm_cmd(ADD, 5, 1, 0, MATMUL_B + MATMUL_N);
+	asm_cmd(JLT, 0, 6, 5, col);
+	asm_cmd(LD, 5, 0, 1, MATMUL_ROW);		// next row
+	asm_cmd(ADD, 6, 1, 0, MATMUL_A + MATMUL_N * MATMUL_N);
+	asm_cmd(ADD, 5, 5, 1, MATMUL_N);
+	asm_cmd(ST, 0, 5, 1, MATMUL_ROW);
+	asm_cmd(JLT, 0, 5, 6, row);
+	asm_cmd(HLT, 0, 0, 0, 0);
+
+	seed = 3;
+	for (i = 0; i < MATMUL_N * MATMUL_N; i++) {
+		data(MATMUL_A + i, random_word(0xf));
+		data(MATMUL_B + i, random_word(0xf));
+	}
+	write_program(dir, "matmul.bin");
+}
+
+/*
+ * fletcher style sums of 4096 words at 4096, stored at 4000 and 4001
+ */
+#define CHECKSUM_BASE	4096
+#define CHECKSUM_N	4096
+#define CHECKSUM_OUT	4000
+
+static void checksum_program(char *dir)
+{
+	int i;
+
+	start();
+	asm_cmd(ADD, 2, 1, 0, CHECKSUM_BASE);		// 0: R2 = data
+	asm_cmd(ADD, 3, 1, 0, CHECKSUM_BASE + CHECKSUM_N);	// 1: R3 = end of data
+	asm_cmd(ADD, 4, 0, 0, 0);			// 2: R4 = sum1 = 0
+	asm_cmd(ADD, 5, 0, 0, 0);			// 3: R5 = sum2 = 0
+	asm_cmd(LD, 6, 0, 2, 0);			// 4: R6 = Mem[R2]
+	asm_cmd(XOR, 6, 6, 2, 0);			// 5: R6 ^= R2, position dependent
+	asm_cmd(ADD, 4, 4, 6, 0);			// 6: sum1 += R6
+	asm_cmd(ADD, 5, 5, 4, 0);			// 7: sum2 += sum1
+	asm_cmd(ADD, 2, 2, 1, 1);			// 8: R2++
+	asm_cmd(JLT, 0, 2, 3, 4);			// 9: if R2 < R3 goto 4
+	asm_cmd(ST, 0, 4, 1, CHECKSUM_OUT);		// 10: Mem[4000] = sum1
+	asm_cmd(ST, 0, 5, 1, CHECKSUM_OUT + 1);		// 11: Mem[4001] = sum2
+	asm_cmd(HLT, 0, 0, 0, 0);			// 12: halt
+
+	seed = 4;
+	for (i = 0; i < CHECKSUM_N; i++)
+		data(CHECKSUM_BASE + i, random_word(0xffff));
+	write_program(dir, "checksum.bin");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		printf("usage: %s directory\n", argv[0]);
+		exit(1);
+	}
+	memcpy_program(argv[1]);
+	bsort_program(argv[1]);
+	matmul_program(argv[1]);
+	checksum_program(argv[1]);
+	return 0;
+}
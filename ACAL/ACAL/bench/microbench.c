@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "llsim.h"
+
+/*
+ * microbenchmarks of the llsim primitives (make microbench)
+ *
+ * times the bit helpers of llsim.h, generic_extract_bits() and
+ * generic_inject_bits() at several widths and bit offsets, the llsim_mem_*
+ * accessors of narrow and wide memories, and llsim_run_clock() with n
+ * dummy units. every result is the best ns per operation of a few runs of
+ * at least 10ms each, written as JSON to stdout or the -o file. "loop" is
+ * the cost of the benchmark loop itself.
+ *
+ * the bit range arguments are variables, as in the generic code paths. the
+ * results include the loop, each operation depends on the one before.
+ *
+ * this binary is linked with llsim.c built without its main() and provides
+ * sp_init() itself: the design is nr_dummies dummy units.
+ */
+#define BENCH_MIN_NS	10000000LL
+#define BENCH_RUNS	5
+#define BENCH_MAX_UNITS	16
+
+static int nr_dummies;
+static volatile int sink;
+
+static i64 bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * a dummy unit counts in its registers and reads its memory every clock
+ */
+typedef struct dummy_regs_s {
+	int count;
+	int data[15];
+} dummy_regs_t;
+
+typedef struct dummy_s {
+	dummy_regs_t *old, *new;
+	llsim_memory_t *mem;
+} dummy_t;
+
+static void dummy_run(llsim_unit_t *unit)
+{
+	dummy_t *d = (dummy_t *) unit->private;
+
+	d->new->count = d->old->count + 1;
+	d->new->data[d->old->count & 15] = llsim_mem_extract_dataout(d->mem, 31, 0);
+	llsim_mem_read(d->mem, d->old->count & 1023);
+}
+
+static void dummy_destroy(llsim_unit_t *unit)
+{
+	free(unit->private);
+}
+
+void sp_init(char *program_name)
+{
+	llsim_unit_registers_t *ur;
+	llsim_unit_t *unit;
+	dummy_t *d;
+	char name[32];
+	int i;
+
+	for (i = 0; i < nr_dummies; i++) {
+		snprintf(name, sizeof(name), "dummy%d", i);
+		unit = llsim_register_unit(name, dummy_run);
+		unit->destroy = dummy_destroy;
+		ur = llsim_allocate_registers(unit, "regs", sizeof(dummy_regs_t));
+		d = (dummy_t *) llsim_malloc(sizeof(dummy_t));
+		d->old = ur->old;
+		d->new = ur->new;
+		d->mem = llsim_allocate_memory(unit, "mem", 32, 1024, 0);
+		unit->private = d;
+	}
+}
+
+/*
+ * a benchmark does n operations with arguments a and b
+ */
+typedef int (*bench_fn_t) (int n, int a, int b);
+
+static double bench_run(bench_fn_t fn, int a, int b)
+{
+	double ns, best = 0;
+	i64 t;
+	int n, run;
+
+	// enough operations for BENCH_MIN_NS
+	for (n = 1024; ; n *= 2) {
+		t = bench_ns();
+		sink = fn(n, a, b);
+		t = bench_ns() - t;
+		if (t >= BENCH_MIN_NS || n >= (1 << 30))
+			break;
+	}
+	for (run = 0; run < BENCH_RUNS; run++) {
+		t = bench_ns();
+		sink = fn(n, a, b);
+		ns = (double) (bench_ns() - t) / n;
+		if (run == 0 || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+static __attribute__((noinline)) int bench_loop(int n, int a, int b)
+{
+	int i, v = 0;
+
+	for (i = 0; i < n; i++)
+		v = (v + i) ^ a;
+	return v;
+}
+
+static __attribute__((noinline)) int bench_sbs(int n, int msb, int lsb)
+{
+	int i, v = 0;
+
+	for (i = 0; i < n; i++)
+		v = sbs(v + i, msb, lsb);
+	return v;
+}
+
+static __attribute__((noinline)) int bench_rbs(int n, int msb, int lsb)
+{
+	int i, v = 0;
+
+	for (i = 0; i < n; i++)
+		v = rbs(v, v + i, msb, lsb);
+	return v;
+}
+
+static __attribute__((noinline)) int bench_lrbs(int n, int msb, int lsb)
+{
+	i64 v = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		v = lrbs(v, (int) v + i, msb, lsb);
+	return (int) v;
+}
+
+static unsigned int bench_words[4];
+
+static __attribute__((noinline)) int bench_extract(int n, int msb, int lsb)
+{
+	int i, v = 0;
+
+	for (i = 0; i < n; i++) {
+		bench_words[0] += v;
+		v = generic_extract_bits((char *) bench_words, msb, lsb);
+	}
+	return v;
+}
+
+static __attribute__((noinline)) int bench_inject(int n, int msb, int lsb)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		generic_inject_bits((char *) bench_words, bench_words[1] + i, msb, lsb);
+	return bench_words[1];
+}
+
+/*
+ * memories of the llsim_mem_* benchmarks, bits wide
+ */
+static llsim_memory_t *bench_mems[2];
+
+static llsim_memory_t *bench_mem(int bits)
+{
+	return bench_mems[bits > 32];
+}
+
+static __attribute__((noinline)) int bench_mem_extract(int n, int bits, int lsb)
+{
+	llsim_memory_t *mem = bench_mem(bits);
+	int i, v = 0;
+
+	for (i = 0; i < n; i++)
+		v = llsim_mem_extract(mem, (v + i) & 1023, lsb + 31, lsb);
+	return v;
+}
+
+static __attribute__((noinline)) int bench_mem_inject(int n, int bits, int lsb)
+{
+	llsim_memory_t *mem = bench_mem(bits);
+	int i;
+
+	for (i = 0; i < n; i++)
+		llsim_mem_inject(mem, i & 1023, i, lsb + 31, lsb);
+	return mem->data[0];
+}
+
+static __attribute__((noinline)) int bench_mem_datain(int n, int bits, int lsb)
+{
+	llsim_memory_t *mem = bench_mem(bits);
+	int i;
+
+	for (i = 0; i < n; i++)
+		llsim_mem_set_datain(mem, i, lsb + 31, lsb);
+	return mem->datain[0];
+}
+
+static __attribute__((noinline)) int bench_mem_dataout(int n, int bits, int lsb)
+{
+	llsim_memory_t *mem = bench_mem(bits);
+	int i, v = 0;
+
+	for (i = 0; i < n; i++) {
+		mem->dataout[0] += v;
+		v = llsim_mem_extract_dataout(mem, lsb + 31, lsb);
+	}
+	return v;
+}
+
+static __attribute__((noinline)) int bench_mem_read(int n, int bits, int lsb)
+{
+	llsim_memory_t *mem = bench_mem(bits);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		mem->read = 0;
+		llsim_mem_read(mem, i & 1023);
+	}
+	return mem->read_addr;
+}
+
+static __attribute__((noinline)) int bench_run_clock(int n, int a, int b)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		llsim_run_clock();
+		llsim->clock++;
+	}
+	return llsim->clock;
+}
+
+typedef struct bench_out_s {
+	FILE *fp;
+	int nr_results;
+} bench_out_t;
+
+static void bench_result(bench_out_t *out, char *name, char *args, double ns)
+{
+	fprintf(out->fp, "%s\n\t\t{\"name\": \"%s\"%s%s, \"ns_per_op\": %.3f}", out->nr_results ? "," : "",
+		name, *args ? ", " : "", args, ns);
+	out->nr_results++;
+}
+
+/*
+ * bit range cases: width and lsb
+ */
+static int bit_cases[][2] = {{1, 0}, {8, 0}, {8, 12}, {16, 0}, {16, 8}, {32, 0}};
+static int word_cases[][2] = {{8, 0}, {8, 4}, {16, 24}, {32, 0}, {32, 16}, {32, 40}};
+
+#define NR_CASES(cases)	((int) (sizeof(cases) / sizeof(cases[0])))
+
+static void bench_bits(bench_out_t *out, char *name, bench_fn_t fn, int (*cases)[2], int nr_cases)
+{
+	char args[64];
+	int width, lsb, i;
+
+	for (i = 0; i < nr_cases; i++) {
+		width = cases[i][0];
+		lsb = cases[i][1];
+		snprintf(args, sizeof(args), "\"width\": %d, \"lsb\": %d", width, lsb);
+		bench_result(out, name, args, bench_run(fn, lsb + width - 1, lsb));
+	}
+}
+
+static void bench_mems_all(bench_out_t *out, char *name, bench_fn_t fn)
+{
+	char args[64];
+
+	// a whole narrow entry, aligned and crossing words of a wide one
+	snprintf(args, sizeof(args), "\"bits\": 32, \"lsb\": 0");
+	bench_result(out, name, args, bench_run(fn, 32, 0));
+	snprintf(args, sizeof(args), "\"bits\": 128, \"lsb\": 32");
+	bench_result(out, name, args, bench_run(fn, 128, 32));
+	snprintf(args, sizeof(args), "\"bits\": 128, \"lsb\": 48");
+	bench_result(out, name, args, bench_run(fn, 128, 48));
+}
+
+static void usage(char *prog)
+{
+	printf("usage: %s [-o file] [-u n,...]\n", prog);
+	printf("  -o file  write the results to file instead of stdout\n");
+	printf("  -u list  numbers of dummy units for llsim_run_clock (default 1,4,16,64, at most 16 numbers)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int units[BENCH_MAX_UNITS] = {1, 4, 16, 64}, nr_units = 4, opt, i;
+	char *name, args[64];
+	bench_out_t out;
+	llsim_unit_t *unit;
+	llsim_t *sim;
+
+	memset(&out, 0, sizeof(out));
+	out.fp = stdout;
+	while ((opt = getopt(argc, argv, "o:u:")) != -1) {
+		switch (opt) {
+		case 'o':
+			out.fp = fopen(optarg, "w");
+			if (out.fp == NULL) {
+				printf("couldn't open file %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'u':
+			nr_units = 0;
+			for (name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+				if (nr_units == BENCH_MAX_UNITS || atoi(name) <= 0)
+					usage(argv[0]);
+				units[nr_units++] = atoi(name);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+	llsim_log_mask = 0;
+
+	fprintf(out.fp, "{\n\t\"benchmarks\": [");
+	bench_result(&out, "loop", "", bench_run(bench_loop, 0, 0));
+	bench_bits(&out, "sbs", bench_sbs, bit_cases, NR_CASES(bit_cases));
+	bench_bits(&out, "rbs", bench_rbs, bit_cases, NR_CASES(bit_cases));
+	// lrbs only takes fields below bit 32, it masks with bitmask()
+	bench_bits(&out, "lrbs", bench_lrbs, bit_cases, NR_CASES(bit_cases));
+	bench_bits(&out, "generic_extract_bits", bench_extract, word_cases, NR_CASES(word_cases));
+	bench_bits(&out, "generic_inject_bits", bench_inject, word_cases, NR_CASES(word_cases));
+
+	// an instance without dummies holding the memories
+	nr_dummies = 0;
+	sim = llsim_create("microbench", NULL);
+	unit = llsim_register_unit("bench", NULL);
+	bench_mems[0] = llsim_allocate_memory(unit, "mem32", 32, 1024, 0);
+	bench_mems[1] = llsim_allocate_memory(unit, "mem128", 128, 1024, 0);
+	bench_mems_all(&out, "llsim_mem_extract", bench_mem_extract);
+	bench_mems_all(&out, "llsim_mem_inject", bench_mem_inject);
+	bench_mems_all(&out, "llsim_mem_set_datain", bench_mem_datain);
+	bench_mems_all(&out, "llsim_mem_extract_dataout", bench_mem_dataout);
+	bench_result(&out, "llsim_mem_read", "\"bits\": 32", bench_run(bench_mem_read, 32, 0));
+	llsim_destroy(sim);
+
+	for (i = 0; i < nr_units; i++) {
+		nr_dummies = units[i];
+		sim = llsim_create("microbench", NULL);
+		snprintf(args, sizeof(args), "\"units\": %d", nr_dummies);
+		bench_result(&out, "llsim_run_clock", args, bench_run(bench_run_clock, 0, 0));
+		llsim_destroy(sim);
+	}
+
+	fprintf(out.fp, "\n\t]\n}\n");
+	if (out.fp != stdout)
+		fclose(out.fp);
+	return 0;
+}
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "llsim.h"
+
+/*
+ * caches
+ *
+ * a cache models the timing of a set associative cache in front of a
+ * slower backing memory. it only keeps tags, the data stays in the unit's
+ * memory, so a program computes the same results with or without caches
+ * and only takes more clocks.
+ *
+ * the unit asks llsim_cache_access() before every access of the memory.
+ * on a hit the access goes ahead in the same clock. on a miss the cache
+ * starts filling the line and the unit has to stall and ask again every
+ * clock with the same address until the line arrived, latency clocks
+ * later (twice that when a dirty line has to be written back first). the
+ * cache is blocking, one miss at a time.
+ *
+ * write through caches don't allocate on writes and never stall them, the
+ * backing memory is assumed to have a write buffer.
+ *
+ * caches belong to a unit like its memories and are run by it, they
+ * aren't units of their own: a miss has to stall the unit in the clock it
+ * happens. a unit stalled on a fill can have its clocks up to
+ * llsim_cache_ready() skipped, see llsim_skip_idle().
+ */
+
+/*
+ * parses "size=n,ways=n,line=n,policy=lru|fifo|random,write=wb|wt,latency=n",
+ * sizes in words. returns -1 on errors.
+ */
+int llsim_cache_parse(llsim_cache_config_t *cfg, char *spec)
+{
+	char key[32], val[32];
+	int n;
+
+	cfg->size = 0;
+	cfg->ways = 1;
+	cfg->line = 4;
+	cfg->policy = LLSIM_CACHE_LRU;
+	cfg->write_back = 1;
+	cfg->latency = 10;
+
+	while (*spec) {
+		if (sscanf(spec, "%31[^=]=%31[^,]%n", key, val, &n) != 2)
+			return -1;
+		spec += n;
+		if (*spec == ',')
+			spec++;
+		if (strcmp(key, "size") == 0)
+			cfg->size = atoi(val);
+		else if (strcmp(key, "ways") == 0)
+			cfg->ways = atoi(val);
+		else if (strcmp(key, "line") == 0)
+			cfg->line = atoi(val);
+		else if (strcmp(key, "latency") == 0)
+			cfg->latency = atoi(val);
+		else if (strcmp(key, "policy") == 0 && strcmp(val, "lru") == 0)
+			cfg->policy = LLSIM_CACHE_LRU;
+		else if (strcmp(key, "policy") == 0 && strcmp(val, "fifo") == 0)
+			cfg->policy = LLSIM_CACHE_FIFO;
+		else if (strcmp(key, "policy") == 0 && strcmp(val, "random") == 0)
+			cfg->policy = LLSIM_CACHE_RANDOM;
+		else if (strcmp(key, "write") == 0 && strcmp(val, "wb") == 0)
+			cfg->write_back = 1;
+		else if (strcmp(key, "write") == 0 && strcmp(val, "wt") == 0)
+			cfg->write_back = 0;
+		else
+			return -1;
+	}
+
+	// sets and lines are powers of 2, a set holds at least one line
+	if (cfg->size <= 0 || cfg->ways <= 0 || cfg->line <= 0 || cfg->latency < 0)
+		return -1;
+	if ((cfg->line & (cfg->line - 1)) || cfg->size % (cfg->ways * cfg->line))
+		return -1;
+	n = cfg->size / (cfg->ways * cfg->line);
+	if (n & (n - 1))
+		return -1;
+	return 0;
+}
+
+llsim_cache_t *llsim_allocate_cache(llsim_unit_t *unit, char *name, llsim_cache_config_t *cfg)
+{
+	llsim_cache_t *cache, **pp;
+	char state[256];
+	int nr_lines, i;
+
+	cache = (llsim_cache_t *) llsim_malloc(sizeof(llsim_cache_t));
+	cache->name = (char *) llsim_malloc(strlen(name)+1);
+	strcpy(cache->name, name);
+	cache->cfg = *cfg;
+	nr_lines = cfg->size / cfg->line;
+	cache->nr_sets = nr_lines / cfg->ways;
+	llsim_assert(cache->nr_sets > 0 && (cache->nr_sets & (cache->nr_sets - 1)) == 0,
+		     "ERROR: cache %s of %d sets not supported", name, cache->nr_sets);
+	while ((1 << cache->line_shift) < cfg->line)
+		cache->line_shift++;
+	llsim_assert((1 << cache->line_shift) == cfg->line, "ERROR: cache %s line of %d words not supported", name, cfg->line);
+
+	cache->tags = (int *) llsim_malloc(nr_lines * sizeof(int));
+	cache->dirty = (unsigned char *) llsim_malloc(nr_lines);
+	cache->stamps = (int *) llsim_malloc(nr_lines * sizeof(int));
+	for (i = 0; i < nr_lines; i++)
+		cache->tags[i] = -1;
+	cache->random = 1;
+	cache->fill_line = -1;
+
+	for (pp = &unit->caches; *pp; pp = &(*pp)->next)
+		;
+	*pp = cache;
+
+	// the tags are unit state, checkpoints keep them
+	snprintf(state, sizeof(state), "%s_tags", name);
+	llsim_register_state(unit, state, cache->tags, nr_lines * sizeof(int));
+	snprintf(state, sizeof(state), "%s_dirty", name);
+	llsim_register_state(unit, state, cache->dirty, nr_lines);
+	snprintf(state, sizeof(state), "%s_stamps", name);
+	llsim_register_state(unit, state, cache->stamps, nr_lines * sizeof(int));
+	snprintf(state, sizeof(state), "%s_stamp", name);
+	llsim_register_state(unit, state, &cache->stamp, sizeof(cache->stamp));
+	snprintf(state, sizeof(state), "%s_random", name);
+	llsim_register_state(unit, state, &cache->random, sizeof(cache->random));
+	snprintf(state, sizeof(state), "%s_fill_line", name);
+	llsim_register_state(unit, state, &cache->fill_line, sizeof(cache->fill_line));
+	snprintf(state, sizeof(state), "%s_fill_way", name);
+	llsim_register_state(unit, state, &cache->fill_way, sizeof(cache->fill_way));
+	snprintf(state, sizeof(state), "%s_fill_ready", name);
+	llsim_register_state(unit, state, &cache->fill_ready, sizeof(cache->fill_ready));
+	snprintf(state, sizeof(state), "%s_stats", name);
+	llsim_register_state(unit, state, &cache->stats, sizeof(cache->stats));
+
+	return cache;
+}
+
+/*
+ * way of set holding line, -1 when it doesn't
+ */
+static int llsim_cache_lookup(llsim_cache_t *cache, int set, int line)
+{
+	int *tags = cache->tags + set * cache->cfg.ways;
+	int way;
+
+	for (way = 0; way < cache->cfg.ways; way++)
+		if (tags[way] == line)
+			return way;
+	return -1;
+}
+
+/*
+ * way of set to replace: an invalid one, or the policy's choice
+ */
+static int llsim_cache_victim(llsim_cache_t *cache, int set)
+{
+	int *tags = cache->tags + set * cache->cfg.ways;
+	int *stamps = cache->stamps + set * cache->cfg.ways;
+	int way, victim;
+
+	for (way = 0; way < cache->cfg.ways; way++)
+		if (tags[way] < 0)
+			return way;
+	if (cache->cfg.policy == LLSIM_CACHE_RANDOM) {
+		// xorshift, deterministic from run to run
+		cache->random ^= cache->random << 13;
+		cache->random ^= cache->random >> 17;
+		cache->random ^= cache->random << 5;
+		return cache->random % cache->cfg.ways;
+	}
+	// lru stamps the last use, fifo the fill: the oldest goes
+	victim = 0;
+	for (way = 1; way < cache->cfg.ways; way++)
+		if (stamps[way] < stamps[victim])
+			victim = way;
+	return victim;
+}
+
+/*
+ * 1 when an access of addr would go ahead this clock, without counting it
+ */
+int llsim_cache_probe(llsim_cache_t *cache, int addr, int write)
+{
+	int line = addr >> cache->line_shift;
+
+	if (cache->fill_line >= 0)
+		return cache->fill_line == line && llsim->clock >= cache->fill_ready;
+	if (write && !cache->cfg.write_back)
+		return 1;
+	return llsim_cache_lookup(cache, line & (cache->nr_sets - 1), line) >= 0;
+}
+
+/*
+ * an access of addr: 1 when it goes ahead this clock, 0 when the unit has
+ * to stall and try again
+ */
+int llsim_cache_access(llsim_cache_t *cache, int addr, int write)
+{
+	int line = addr >> cache->line_shift;
+	int set = line & (cache->nr_sets - 1);
+	int way, i, latency;
+
+	if (cache->fill_line < 0) {
+		cache->stats.accesses++;
+		way = llsim_cache_lookup(cache, set, line);
+		if (way >= 0) {
+			i = set * cache->cfg.ways + way;
+			cache->stats.hits++;
+			if (cache->cfg.policy == LLSIM_CACHE_LRU)
+				cache->stamps[i] = ++cache->stamp;
+			if (write && cache->cfg.write_back)
+				cache->dirty[i] = 1;
+			return 1;
+		}
+		cache->stats.misses++;
+		if (write && !cache->cfg.write_back)
+			return 1;
+
+		way = llsim_cache_victim(cache, set);
+		i = set * cache->cfg.ways + way;
+		latency = cache->cfg.latency;
+		if (cache->tags[i] >= 0) {
+			cache->stats.evictions++;
+			if (cache->dirty[i]) {
+				cache->stats.writebacks++;
+				latency += cache->cfg.latency;
+			}
+			cache->tags[i] = -1;
+		}
+		cache->fill_line = line;
+		cache->fill_way = way;
+		cache->fill_ready = llsim->clock + latency;
+	}
+
+	llsim_assert(cache->fill_line == line, "ERROR: cache %s: access of line %d while filling line %d\n",
+		     cache->name, line, cache->fill_line);
+	if (llsim->clock < cache->fill_ready) {
+		cache->stats.stall_cycles++;
+		return 0;
+	}
+
+	// the line arrived
+	i = set * cache->cfg.ways + cache->fill_way;
+	cache->tags[i] = line;
+	cache->dirty[i] = write;
+	cache->stamps[i] = ++cache->stamp;
+	cache->fill_line = -1;
+	return 1;
+}
+
+/*
+ * the clock an access of addr waiting for its line goes ahead, llsim->clock
+ * when it doesn't wait for a line in flight
+ */
+int llsim_cache_ready(llsim_cache_t *cache, int addr)
+{
+	if (cache->fill_line == addr >> cache->line_shift && llsim->clock < cache->fill_ready)
+		return cache->fill_ready;
+	return llsim->clock;
+}
+
+/*
+ * an access waiting for its line skipped cycles clocks, see llsim_skip_idle()
+ */
+void llsim_cache_skip(llsim_cache_t *cache, int cycles)
+{
+	cache->stats.stall_cycles += cycles;
+}
+
+void llsim_cache_print(llsim_cache_t *cache)
+{
+	llsim_cache_stats_t *st = &cache->stats;
+
+	llsim_printf("llsim: cache %s: %d accesses, %d hits, %d misses, %d evictions, %d writebacks, %d stall cycles\n",
+		     cache->name, st->accesses, st->hits, st->misses, st->evictions, st->writebacks, st->stall_cycles);
+}
+
+/*
+ * the counters as report() lines
+ */
+void llsim_cache_report(llsim_cache_t *cache, FILE *fp)
+{
+	llsim_cache_stats_t *st = &cache->stats;
+
+	fprintf(fp, "%s_accesses %d\n", cache->name, st->accesses);
+	fprintf(fp, "%s_hits %d\n", cache->name, st->hits);
+	fprintf(fp, "%s_misses %d\n", cache->name, st->misses);
+	fprintf(fp, "%s_evictions %d\n", cache->name, st->evictions);
+	fprintf(fp, "%s_writebacks %d\n", cache->name, st->writebacks);
+	fprintf(fp, "%s_stall_cycles %d\n", cache->name, st->stall_cycles);
+}
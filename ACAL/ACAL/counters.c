@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "llsim.h"
+
+/*
+ * performance counters
+ *
+ * a unit keeps its counters as ints of its private state and registers
+ * them by name. registration order numbers them, which is how a simulated
+ * instruction reads them (llsim_read_counter()). llsim_counters_dump()
+ * writes every unit's counters, the reads and writes of its memories and
+ * the statistics of its caches to counters.json or counters.csv, only with
+ * -S. a unit counting "cycles" and "instructions" gets its ipc too, of
+ * "detailed_instructions" instead when it counts them: cycles aren't
+ * simulated for functionally executed instructions.
+ *
+ * counters aren't kept in checkpoints by registering them, the unit keeps
+ * them with the rest of its state (llsim_register_state()).
+ */
+void llsim_register_counter(llsim_unit_t *unit, char *name, int *p)
+{
+	llsim_counter_t *counter, **pp;
+
+	counter = (llsim_counter_t *) llsim_malloc(sizeof(llsim_counter_t));
+	counter->name = (char *) llsim_malloc(strlen(name)+1);
+	strcpy(counter->name, name);
+	counter->p = p;
+	for (pp = &unit->counters; *pp; pp = &(*pp)->next)
+		;
+	*pp = counter;
+}
+
+/*
+ * value of the unit's counter number index, 0 when there is none
+ */
+int llsim_read_counter(llsim_unit_t *unit, int index)
+{
+	llsim_counter_t *counter;
+
+	for (counter = unit->counters; counter; counter = counter->next)
+		if (index-- == 0)
+			return *counter->p;
+	return 0;
+}
+
+typedef struct llsim_counters_out_s {
+	FILE *fp;
+	int format;
+	int nr_values;			// of the current unit
+} llsim_counters_out_t;
+
+static void llsim_counters_unit(llsim_counters_out_t *out, llsim_unit_t *unit)
+{
+	if (out->format == LLSIM_COUNTERS_JSON)
+		fprintf(out->fp, ",\n\t\"%s\": {", unit->name);
+	out->nr_values = 0;
+}
+
+static void llsim_counters_end_unit(llsim_counters_out_t *out)
+{
+	if (out->format == LLSIM_COUNTERS_JSON)
+		fprintf(out->fp, "\n\t}");
+}
+
+static void llsim_counters_value(llsim_counters_out_t *out, llsim_unit_t *unit, char *prefix, char *name, char *val)
+{
+	if (out->format == LLSIM_COUNTERS_JSON)
+		fprintf(out->fp, "%s\n\t\t\"%s%s\": %s", out->nr_values ? "," : "", prefix, name, val);
+	else
+		fprintf(out->fp, "%s,%s%s,%s\n", unit->name, prefix, name, val);
+	out->nr_values++;
+}
+
+static void llsim_counters_int(llsim_counters_out_t *out, llsim_unit_t *unit, char *prefix, char *name, int val)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%d", val);
+	llsim_counters_value(out, unit, prefix, name, buf);
+}
+
+void llsim_counters_dump(void)
+{
+	llsim_counters_out_t out;
+	llsim_unit_t *unit;
+	llsim_counter_t *counter;
+	llsim_memory_t *mem;
+	llsim_cache_t *cache;
+	char prefix[256], buf[32];
+	int cycles, instructions, detailed;
+
+	if (llsim->counters_format == LLSIM_COUNTERS_NONE)
+		return;
+	memset(&out, 0, sizeof(out));
+	out.format = llsim->counters_format;
+	if (out.format == LLSIM_COUNTERS_JSON) {
+		out.fp = llsim_fopen("counters.json", "w");
+		fprintf(out.fp, "{\n\t\"clock\": %d", llsim->clock);
+	} else {
+		out.fp = llsim_fopen("counters.csv", "w");
+		fprintf(out.fp, "unit,counter,value\n");
+		fprintf(out.fp, "llsim,clock,%d\n", llsim->clock);
+	}
+
+	for (unit = llsim->units; unit; unit = unit->next) {
+		if (!unit->counters && !unit->mems && !unit->caches)
+			continue;
+		llsim_counters_unit(&out, unit);
+		cycles = instructions = detailed = -1;
+		for (counter = unit->counters; counter; counter = counter->next) {
+			llsim_counters_int(&out, unit, "", counter->name, *counter->p);
+			if (strcmp(counter->name, "cycles") == 0)
+				cycles = *counter->p;
+			if (strcmp(counter->name, "instructions") == 0)
+				instructions = *counter->p;
+			if (strcmp(counter->name, "detailed_instructions") == 0)
+				detailed = *counter->p;
+		}
+		if (detailed >= 0)
+			instructions = detailed;
+		if (cycles > 0 && instructions >= 0) {
+			snprintf(buf, sizeof(buf), "%.3f", (double) instructions / cycles);
+			llsim_counters_value(&out, unit, "", "ipc", buf);
+		}
+		for (mem = unit->mems; mem; mem = mem->next) {
+			snprintf(prefix, sizeof(prefix), "%s_", mem->name);
+			llsim_counters_int(&out, unit, prefix, "reads", mem->reads);
+			llsim_counters_int(&out, unit, prefix, "writes", mem->writes);
+		}
+		for (cache = unit->caches; cache; cache = cache->next) {
+			snprintf(prefix, sizeof(prefix), "%s_", cache->name);
+			llsim_counters_int(&out, unit, prefix, "accesses", cache->stats.accesses);
+			llsim_counters_int(&out, unit, prefix, "hits", cache->stats.hits);
+			llsim_counters_int(&out, unit, prefix, "misses", cache->stats.misses);
+			llsim_counters_int(&out, unit, prefix, "evictions", cache->stats.evictions);
+			llsim_counters_int(&out, unit, prefix, "writebacks", cache->stats.writebacks);
+			llsim_counters_int(&out, unit, prefix, "stall_cycles", cache->stats.stall_cycles);
+		}
+		llsim_counters_end_unit(&out);
+	}
+
+	if (out.format == LLSIM_COUNTERS_JSON)
+		fprintf(out.fp, "\n}\n");
+	fclose(out.fp);
+}
@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+// bytes looked at to tell text from binary images
+#define IMAGE_SNIFF_LEN	512
+
+char *image_format_names[IMAGE_NR_FORMATS] = {"text", "bin", "sparse", "rle"};
+
+// first line of the compact text formats
+static char *image_headers[IMAGE_NR_FORMATS] = {NULL, NULL, "@sparse", "@rle"};
+
+typedef struct image_parser_s {
+	char *path;
+	unsigned char *p, *end;
+	int line;
+} image_parser_t;
+
+static void *image_malloc(size_t len)
+{
+	void *p;
+
+	p = malloc(len);
+	if (p == NULL) {
+		printf("image: out of memory\n");
+		exit(1);
+	}
+	memset(p, 0, len);
+	return p;
+}
+
+static int image_digit(int c, int base)
+{
+	int d = -1;
+
+	if (c >= '0' && c <= '9')
+		d = c - '0';
+	else if (c >= 'a' && c <= 'f')
+		d = c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		d = c - 'A' + 10;
+	return (d < base) ? d : -1;
+}
+
+/*
+ * text images only hold hex digits and white space, a binary image of a
+ * real program has zero bytes in its first words
+ */
+static int image_detect(unsigned char *p, int len)
+{
+	int i;
+
+	for (i = IMAGE_SPARSE; i < IMAGE_NR_FORMATS; i++)
+		if (len > strlen(image_headers[i]) && !memcmp(p, image_headers[i], strlen(image_headers[i])))
+			return i;
+	if (len > IMAGE_SNIFF_LEN)
+		len = IMAGE_SNIFF_LEN;
+	for (i = 0; i < len; i++)
+		if (image_digit(p[i], 16) < 0 && !isspace(p[i]))
+			return IMAGE_BINARY;
+	return IMAGE_TEXT;
+}
+
+/*
+ * skips white space, returns 0 at the end of the file
+ */
+static int image_skip_space(image_parser_t *ps)
+{
+	while (ps->p < ps->end && isspace(*ps->p)) {
+		if (*ps->p == '\n')
+			ps->line++;
+		ps->p++;
+	}
+	return ps->p < ps->end;
+}
+
+/*
+ * next number of up to max_digits digits, at the end of the file when
+ * optional
+ */
+static unsigned int image_number(image_parser_t *ps, int base, int max_digits, int optional, int *eof)
+{
+	unsigned int val = 0;
+	int digits, d;
+
+	*eof = !image_skip_space(ps);
+	if (*eof) {
+		if (optional)
+			return 0;
+		printf("%s:%d: unexpected end of file\n", ps->path, ps->line);
+		exit(1);
+	}
+	for (digits = 0; digits < max_digits && ps->p < ps->end; digits++, ps->p++) {
+		d = image_digit(*ps->p, base);
+		if (d < 0)
+			break;
+		if (val > (UINT_MAX - d) / base) {
+			printf("%s:%d: number too large\n", ps->path, ps->line);
+			exit(1);
+		}
+		val = val * base + d;
+	}
+	if (digits == 0) {
+		printf("%s:%d: bad number\n", ps->path, ps->line);
+		exit(1);
+	}
+	return val;
+}
+
+/*
+ * same words the legacy fscanf("%08x\n") loop read: up to 8 hex digits at
+ * a time, white space in between is skipped
+ */
+static void image_parse_text(image_t *image, image_parser_t *ps, int max_words)
+{
+	unsigned int word;
+	int eof;
+
+	// every word takes at least one digit and one separator
+	if (max_words > image->map_len / 2 + 1)
+		max_words = image->map_len / 2 + 1;
+	image->buf = image_malloc(max_words * sizeof(int));
+	while (image->nr_words < max_words) {
+		word = image_number(ps, 16, 8, 1, &eof);
+		if (eof)
+			break;
+		image->buf[image->nr_words++] = word;
+	}
+}
+
+/*
+ * "@sparse height" then "addr value" lines of the non zero words,
+ * "@rle height" then "value count" runs covering the whole image
+ */
+static void image_parse_compact(image_t *image, image_parser_t *ps, int max_words)
+{
+	unsigned int addr, val, count, height;
+	int eof;
+
+	ps->p += strlen(image_headers[image->format]);
+	height = image_number(ps, 10, 10, 0, &eof);
+	if (height > INT_MAX) {
+		printf("%s:%d: bad height %u\n", ps->path, ps->line, height);
+		exit(1);
+	}
+	image->nr_words = height;
+	if (image->nr_words > max_words)
+		image->nr_words = max_words;
+	image->buf = image_malloc(image->nr_words * sizeof(int));
+	addr = 0;
+	for (;;) {
+		if (image->format == IMAGE_SPARSE) {
+			addr = image_number(ps, 16, 8, 1, &eof);
+			if (eof)
+				break;
+			val = image_number(ps, 16, 8, 0, &eof);
+			if (addr < image->nr_words)
+				image->buf[addr] = val;
+		} else {
+			val = image_number(ps, 16, 8, 1, &eof);
+			if (eof)
+				break;
+			count = image_number(ps, 10, 10, 0, &eof);
+			for (; count && addr < image->nr_words; count--)
+				image->buf[addr++] = val;
+		}
+	}
+}
+
+static void image_load_binary(image_t *image, char *path, int max_words)
+{
+	int i;
+
+	if (image->map_len % sizeof(int)) {
+		printf("%s: binary image size %d isn't a multiple of 4\n", path, image->map_len);
+		exit(1);
+	}
+	image->nr_words = image->map_len / sizeof(int);
+	if (image->nr_words > max_words)
+		image->nr_words = max_words;
+	image->words = image->map;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	image->buf = image_malloc(image->nr_words * sizeof(int));
+	for (i = 0; i < image->nr_words; i++)
+		image->buf[i] = __builtin_bswap32(image->words[i]);
+	image->words = image->buf;
+#else
+	(void) i;
+#endif
+}
+
+/*
+ * opens an image of any format, at most max_words are used
+ */
+image_t *image_open(char *path, int max_words)
+{
+	image_parser_t ps;
+	image_t *image;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("couldn't open file %s\n", path);
+		exit(1);
+	}
+	image = image_malloc(sizeof(image_t));
+	image->map_len = st.st_size;
+	if (image->map_len) {
+		image->map = mmap(NULL, image->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image->map == MAP_FAILED) {
+			printf("couldn't map file %s\n", path);
+			exit(1);
+		}
+	}
+	close(fd);
+
+	image->format = image_detect(image->map, image->map_len);
+	if (image->format == IMAGE_BINARY) {
+		image_load_binary(image, path, max_words);
+		return image;
+	}
+
+	ps.path = path;
+	ps.p = image->map;
+	ps.end = ps.p + image->map_len;
+	ps.line = 1;
+	if (image->format == IMAGE_TEXT)
+		image_parse_text(image, &ps, max_words);
+	else
+		image_parse_compact(image, &ps, max_words);
+	image->words = image->buf;
+	return image;
+}
+
+void image_close(image_t *image)
+{
+	if (image->map_len)
+		munmap(image->map, image->map_len);
+	free(image->buf);
+	free(image);
+}
+
+static char *image_put_hex(char *p, unsigned int val)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		p[7 - i] = hex[(val >> (i * 4)) & 0xf];
+	return p + 8;
+}
+
+/*
+ * page i covers words [i << page_shift, (i + 1) << page_shift), words of
+ * clean pages are known to be zero
+ */
+static int image_page_clean(unsigned char *dirty, int page_shift, int addr)
+{
+	return dirty && !dirty[addr >> page_shift];
+}
+
+static void image_write_text(FILE *fp, int *words, int nr_words, unsigned char *dirty, int page_shift)
+{
+	char buf[4096], *p;
+	int i;
+
+	p = buf;
+	for (i = 0; i < nr_words; i++) {
+		p = image_put_hex(p, image_page_clean(dirty, page_shift, i) ? 0 : words[i]);
+		*p++ = '\n';
+		if (p - buf > sizeof(buf) - 9) {
+			fwrite(buf, 1, p - buf, fp);
+			p = buf;
+		}
+	}
+	fwrite(buf, 1, p - buf, fp);
+}
+
+static void image_write_compact(FILE *fp, int format, int *words, int nr_words, unsigned char *dirty, int page_shift)
+{
+	unsigned int val;
+	int i, run;
+
+	fprintf(fp, "%s %d\n", image_headers[format], nr_words);
+	for (i = 0; i < nr_words; i += run) {
+		if (image_page_clean(dirty, page_shift, i)) {
+			// rest of the clean page
+			val = 0;
+			run = (1 << page_shift) - (i & ((1 << page_shift) - 1));
+		} else {
+			val = words[i];
+			run = 1;
+		}
+		if (format == IMAGE_SPARSE) {
+			if (val)
+				fprintf(fp, "%05x %08x\n", i, val);
+			continue;
+		}
+		// extend the run over equal words and clean pages of zeros
+		while (i + run < nr_words) {
+			if (image_page_clean(dirty, page_shift, i + run) && val == 0)
+				run += 1 << page_shift;
+			else if (!image_page_clean(dirty, page_shift, i + run) && words[i + run] == val)
+				run++;
+			else
+				break;
+		}
+		if (i + run > nr_words)
+			run = nr_words - i;
+		fprintf(fp, "%08x %d\n", val, run);
+	}
+}
+
+/*
+ * writes nr_words words in the given format. dirty, when not NULL, is a map
+ * of pages of 1 << page_shift words: words of clean pages are zero and
+ * aren't looked at.
+ */
+void image_write_pages(char *path, int format, int *words, int nr_words, unsigned char *dirty, int page_shift)
+{
+	unsigned char le[4];
+	FILE *fp;
+	int i;
+
+	fp = fopen(path, format == IMAGE_BINARY ? "wb" : "w");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", path);
+		exit(1);
+	}
+	switch (format) {
+	case IMAGE_TEXT:
+		image_write_text(fp, words, nr_words, dirty, page_shift);
+		break;
+	case IMAGE_BINARY:
+		for (i = 0; i < nr_words; i++) {
+			if (image_page_clean(dirty, page_shift, i))
+				memset(le, 0, 4);
+			else {
+				le[0] = words[i];
+				le[1] = words[i] >> 8;
+				le[2] = words[i] >> 16;
+				le[3] = words[i] >> 24;
+			}
+			fwrite(le, 1, 4, fp);
+		}
+		break;
+	default:
+		image_write_compact(fp, format, words, nr_words, dirty, page_shift);
+		break;
+	}
+	fclose(fp);
+}
+
+void image_write(char *path, int format, int *words, int nr_words)
+{
+	image_write_pages(path, format, words, nr_words, NULL, 0);
+}
+
+/*
+ * returns the format called name, -1 if there is none
+ */
+int image_parse_format(char *name)
+{
+	int i;
+
+	for (i = 0; i < IMAGE_NR_FORMATS; i++)
+		if (strcmp(name, image_format_names[i]) == 0)
+			return i;
+	return -1;
+}
@@ -0,0 +1,46 @@
+/*
+ * imgconv - convert program images and sram dumps between formats
+ *
+ * usage: imgconv [-t | -b | -s | -r] in out
+ *
+ * the input format is detected. -t / -b / -s / -r select a text / binary /
+ * sparse / rle output, by default text becomes binary and everything else
+ * becomes text, e.g. the legacy sram_out.txt of a compact dump.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "image.h"
+
+int main(int argc, char **argv)
+{
+	static char *flags[IMAGE_NR_FORMATS] = {"-t", "-b", "-s", "-r"};
+	image_t *image;
+	int format = -1, i;
+
+	if (argc == 4) {
+		for (i = 0; i < IMAGE_NR_FORMATS; i++)
+			if (!strcmp(argv[1], flags[i]))
+				format = i;
+		if (format >= 0) {
+			argv++;
+			argc--;
+		}
+	}
+	if (argc != 3) {
+		printf("usage: imgconv [-t | -b | -s | -r] in out\n");
+		exit(1);
+	}
+
+	// the whole image, dumps of wide address spaces (-w) are larger than
+	// the 64k words of the legacy srams
+	image = image_open(argv[1], INT_MAX);
+	if (format < 0)
+		format = (image->format == IMAGE_TEXT) ? IMAGE_BINARY : IMAGE_TEXT;
+	image_write(argv[2], format, image->words, image->nr_words);
+	printf("%s: %d words, %s -> %s\n", argv[2], image->nr_words,
+	       image_format_names[image->format], image_format_names[format]);
+	image_close(image);
+	return 0;
+}
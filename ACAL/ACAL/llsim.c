@@ -1,13 +1,46 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "llsim.h"
+#include "image.h"
 
 /*
  * chip simulator
+ *
+ * all simulation state lives in llsim_t and the units' private structures.
+ * llsim points at the instance the calling thread is running, so any
+ * number of instances can be created and run one after the other or in
+ * different threads. the command line options below are the defaults every
+ * new instance starts with.
  */
-llsim_t *llsim = NULL;
-static int stop_sim = 0;
+__thread llsim_t *llsim = NULL;
+int llsim_log_mask = LLSIM_LOG_DEFAULT;
+static int trace_format = LLSIM_TRACE_TEXT;
+static int trace_async = 0;
+static int no_traces = 0;
+static int fast_forward = 0;
+static int dump_format = IMAGE_TEXT;
+static int nr_threads = 1;
+static int checkpoint_clock = 0;
+static char *restore_path = NULL;
+static int sample_interval = 0;
+static int sample_window = 0;
+static int dma_port = 0;
+static int nr_banks = 0;
+static int addr_bits = 16;
+static int huge_pages = 0;
+static int counters_format = LLSIM_COUNTERS_NONE;
+static int profile = 0;
+static int host_time = 0;
+static llsim_cache_config_t icache_config;
+static llsim_cache_config_t dcache_config;
+
+// file name extension of memory dumps by format
+char *llsim_dump_ext[IMAGE_NR_FORMATS] = {"txt", "img", "sparse", "rle"};
 
 void *llsim_malloc(int len)
 {
@@ -19,6 +52,32 @@ void *llsim_malloc(int len)
 	return p;
 }
 
+/*
+ * path of an output file of the current instance, name is relative to its
+ * output directory
+ */
+void llsim_output_path(char *path, int size, char *name)
+{
+	if (llsim && llsim->outdir)
+		snprintf(path, size, "%s/%s", llsim->outdir, name);
+	else
+		snprintf(path, size, "%s", name);
+}
+
+FILE *llsim_fopen(char *name, char *mode)
+{
+	char path[1024];
+	FILE *fp;
+
+	llsim_output_path(path, sizeof(path), name);
+	fp = fopen(path, mode);
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", path);
+		exit(1);
+	}
+	return fp;
+}
+
 /*
  * unit registration functions
  */
@@ -30,9 +89,13 @@ llsim_unit_t *llsim_register_unit(char *name, void (*run) (struct llsim_unit_s *
 	unit->name = llsim_malloc(strlen(name)+1);
 	strcpy(unit->name, name);
 	unit->run = run;
+	unit->destroy = NULL;
+	unit->horizon = NULL;
+	unit->skip = NULL;
 	unit->next = llsim->units;
 	unit->regs = NULL;
 	llsim->units = unit;
+	llsim->compiled = 0;
 	return unit;
 }
 
@@ -61,6 +124,7 @@ llsim_unit_registers_t *llsim_allocate_registers(llsim_unit_t *unit, char *name,
 	ur->new = (void *) llsim_malloc(size);
 	ur->next = unit->regs;
 	unit->regs = ur;
+	llsim->compiled = 0;
 	return ur;
 }
 
@@ -92,6 +156,24 @@ void llsim_register_register(char *unit_name, char *reg_name, int bits, int rese
 	}
 }
 
+/*
+ * state saved in checkpoints besides the unit's registers and memories
+ */
+void llsim_register_state(llsim_unit_t *unit, char *name, void *p, int size)
+{
+	llsim_unit_state_t *st, **pp;
+
+	st = (llsim_unit_state_t *) llsim_malloc(sizeof(llsim_unit_state_t));
+	st->name = (char *) llsim_malloc(strlen(name)+1);
+	strcpy(st->name, name);
+	st->p = p;
+	st->size = size;
+	// keep registration order, checkpoints list them in it
+	for (pp = &unit->states; *pp; pp = &(*pp)->next)
+		;
+	*pp = st;
+}
+
 void llsim_register_wire(char *unit_name, char *wire_name, int bits, void *wirep)
 {
 	// FIXME
@@ -151,36 +233,64 @@ void llsim_register_input(char *unit_name, char *input_name, int bits, void *old
 	}
 }
 
+/*
+ * bit ranges of up to 32 bits anywhere in an array of 32 bit words, p must
+ * be word aligned. a range may cross a word boundary, only the words it
+ * covers are accessed.
+ */
 int generic_extract_bits(char *p, int msb, int lsb)
 {
-	int byte_pos;
-	i64 *p64, val64;
-
-	byte_pos = lsb / 8;
+	unsigned int *w = (unsigned int *) p + lsb / 32;
+	int shift = lsb % 32, width = msb - lsb + 1;
+	unsigned long long val;
 
-	p64 = (i64 *) (p + byte_pos);
-	val64 = lsbs(*p64, msb - byte_pos * 8, lsb - byte_pos * 8);
-	return (int) val64;
+	val = w[0] >> shift;
+	if (shift + width > 32)
+		val |= (unsigned long long) w[1] << (32 - shift);
+	return (int) (val & lbitmask0(width));
 }
 
 void generic_inject_bits(char *p, int data, int msb, int lsb)
 {
-	int byte_pos;
-	i64 *p64;
+	unsigned int *w = (unsigned int *) p + lsb / 32;
+	int shift = lsb % 32, width = msb - lsb + 1;
+	unsigned long long val, mask;
 
-	byte_pos = lsb / 8;
-	p64 = (i64 *) (p + byte_pos);
-	*p64 = lrbs(*p64, data, msb - byte_pos * 8, lsb - byte_pos * 8);
+	mask = lbitmask0(width) << shift;
+	val = ((unsigned long long) (unsigned int) data << shift) & mask;
+	w[0] = (w[0] & ~(unsigned int) mask) | (unsigned int) val;
+	if (shift + width > 32)
+		w[1] = (w[1] & ~(unsigned int) (mask >> 32)) | (unsigned int) (val >> 32);
 }
 
 /*
  * memories
  */
+/*
+ * the contents of a memory are an anonymous mapping: the host allocates
+ * its pages on first touch, pages never written read as zeros and cost
+ * nothing. with -H they are backed by transparent huge pages.
+ */
+static int *llsim_mem_map(llsim_memory_t *mem)
+{
+	size_t len = (size_t) mem->height * mem->entry_size * sizeof(int);
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	llsim_assert(p != MAP_FAILED, "out of memory");
+#ifdef MADV_HUGEPAGE
+	if (llsim->huge_pages)
+		madvise(p, len, MADV_HUGEPAGE);
+#endif
+	return (int *) p;
+}
+
 llsim_memory_t *llsim_allocate_memory(llsim_unit_t *unit, char *name, int bits, int height, int dp)
 {
 	llsim_memory_t *mem;
+	int i;
 
-	llsim_assert(bits <= 32, "ERROR: bits %d not supported", bits);
+	llsim_assert(bits <= 32 || bits == 64 || bits == 128 || bits == 256, "ERROR: bits %d not supported", bits);
 	mem = (llsim_memory_t *) llsim_malloc(sizeof(llsim_memory_t));
 	mem->entry_size = (bits + 31) / 32;
 	mem->name = (char *) llsim_malloc(strlen(name)+1);
@@ -188,20 +298,74 @@ llsim_memory_t *llsim_allocate_memory(llsim_unit_t *unit, char *name, int bits,
 	mem->bits = bits;
 	mem->height = height;
 	mem->dp = dp;
-	mem->data = (int *) llsim_malloc(height * mem->entry_size * sizeof(int));
-	mem->datain = (int *) llsim_malloc(mem->entry_size);
-	mem->dataout = (int *) llsim_malloc(mem->entry_size);
+	llsim_assert((i64) height * mem->entry_size <= 0x7fffffff, "ERROR: memory %s of %d entries too large", name, height);
+	mem->data = llsim_mem_map(mem);
+	mem->datain = (int *) llsim_malloc(mem->entry_size * sizeof(int));
+	mem->dataout = (int *) llsim_malloc(mem->entry_size * sizeof(int));
+	mem->nr_ports = (dp == 0) ? 1 : (dp == 1) ? 2 : dp;
+	if (mem->nr_ports > 1) {
+		mem->ports = (llsim_mem_port_t *) llsim_malloc((mem->nr_ports - 1) * sizeof(llsim_mem_port_t));
+		for (i = 0; i < mem->nr_ports - 1; i++) {
+			mem->ports[i].datain = (int *) llsim_malloc(mem->entry_size * sizeof(int));
+			mem->ports[i].dataout = (int *) llsim_malloc(mem->entry_size * sizeof(int));
+		}
+	}
+	mem->nr_pages = (height + (1 << LLSIM_MEM_PAGE_SHIFT) - 1) >> LLSIM_MEM_PAGE_SHIFT;
+	mem->dirty = (unsigned char *) llsim_malloc(mem->nr_pages);
+	mem->nr_banks = 1;
 	mem->next = unit->mems;
 	unit->mems = mem;
+	llsim->compiled = 0;
 	return mem;
 }
 
+/*
+ * banked memory: nr_banks (a power of 2) single port banks interleaved by
+ * the low address bits, shared by the dp ports. a requester claims the
+ * bank of its address with llsim_mem_claim_bank() before accessing it,
+ * whoever claims first in a clock gets the bank and the others stall.
+ * ports accessing the same bank in one clock are an error.
+ */
+llsim_memory_t *llsim_allocate_banked_memory(llsim_unit_t *unit, char *name, int bits, int height, int dp, int nr_banks)
+{
+	llsim_memory_t *mem;
+
+	llsim_assert(nr_banks > 0 && (nr_banks & (nr_banks - 1)) == 0, "ERROR: %d banks not supported", nr_banks);
+	llsim_assert(dp, "ERROR: banked memory %s needs more than one port", name);
+	mem = llsim_allocate_memory(unit, name, bits, height, dp);
+	mem->nr_banks = nr_banks;
+	mem->bank_busy = (unsigned char *) llsim_malloc(nr_banks);
+	return mem;
+}
+
+/*
+ * returns 1 and reserves the bank of addr for this clock if it is free,
+ * otherwise counts a conflict and returns 0
+ */
+int llsim_mem_claim_bank(llsim_memory_t *memory, int addr)
+{
+	int bank = addr & (memory->nr_banks - 1);
+
+	memory->bank_accesses++;
+	if (memory->bank_busy && memory->bank_busy[bank]) {
+		memory->bank_conflicts++;
+		return 0;
+	}
+	if (memory->bank_busy)
+		memory->bank_busy[bank] = 1;
+	return 1;
+}
+
+/*
+ * bit range of up to 32 bits of an entry, msb may be up to bits - 1
+ */
 void llsim_mem_inject(llsim_memory_t *memory, int addr, int val, int msb, int lsb)
 {
 	int *p;
 
 	p = memory->data + addr * memory->entry_size;
 	generic_inject_bits((char *) p, val, msb, lsb);
+	llsim_mem_dirty(memory, addr);
 }
 
 int llsim_mem_extract(llsim_memory_t *memory, int addr, int msb, int lsb)
@@ -212,6 +376,62 @@ int llsim_mem_extract(llsim_memory_t *memory, int addr, int msb, int lsb)
 	return generic_extract_bits((char *) p,msb,lsb);
 }
 
+/*
+ * bulk load of nr_words 32 bit words starting at entry addr, e.g. a
+ * program image. entries of wide memories are filled low word first.
+ */
+void llsim_mem_load(llsim_memory_t *memory, int addr, int *words, int nr_words)
+{
+	int nr_entries, i;
+
+	nr_entries = (nr_words + memory->entry_size - 1) / memory->entry_size;
+	llsim_assert(addr >= 0 && addr + nr_entries <= memory->height,
+		     "ERROR: load of %d words at %d overflows memory %s", nr_words, addr, memory->name);
+	for (i = 0; i < nr_entries; i += 1 << LLSIM_MEM_PAGE_SHIFT)
+		llsim_mem_dirty(memory, addr + i);
+	if (nr_entries)
+		llsim_mem_dirty(memory, addr + nr_entries - 1);
+	if (memory->bits % 32 == 0) {
+		memcpy(memory->data + addr * memory->entry_size, words, nr_words * sizeof(int));
+		return;
+	}
+	for (i = 0; i < nr_words; i++)
+		llsim_mem_inject(memory, addr + i, words[i], memory->bits - 1, 0);
+}
+
+/*
+ * writes the memory to name plus the extension of the dump format, pages
+ * that were never written are skipped. wide entries are dumped as their
+ * 32 bit words, low word first. the dense formats (text, bin) end after
+ * the last written page, but cover at least LLSIM_DUMP_MIN_ENTRIES so dumps
+ * of the 64k word srams keep their length.
+ */
+#define LLSIM_DUMP_MIN_ENTRIES	(1 << 16)
+
+void llsim_mem_dump(llsim_memory_t *memory, char *name)
+{
+	char file[256], path[1024];
+	int shift, height, page;
+
+	// entry_size is a power of 2
+	for (shift = 0; (1 << shift) < memory->entry_size; shift++)
+		;
+	height = memory->height;
+	if (llsim->dump_format == IMAGE_TEXT || llsim->dump_format == IMAGE_BINARY) {
+		for (page = memory->nr_pages; page > 0 && !memory->dirty[page - 1]; page--)
+			;
+		height = page << LLSIM_MEM_PAGE_SHIFT;
+		if (height < LLSIM_DUMP_MIN_ENTRIES)
+			height = LLSIM_DUMP_MIN_ENTRIES;
+		if (height > memory->height)
+			height = memory->height;
+	}
+	snprintf(file, sizeof(file), "%s.%s", name, llsim_dump_ext[llsim->dump_format]);
+	llsim_output_path(path, sizeof(path), file);
+	image_write_pages(path, llsim->dump_format, memory->data, height * memory->entry_size,
+			  memory->dirty, LLSIM_MEM_PAGE_SHIFT + shift);
+}
+
 void llsim_mem_write(llsim_memory_t *memory, int addr)
 {
 	llsim_assert(!memory->write, "ERROR: multiple memory writes to memory %s", memory->name);
@@ -226,88 +446,558 @@ void llsim_mem_read(llsim_memory_t *memory, int addr)
 	memory->read_addr = addr;
 }
 
-void llsim_mem_set_datain(llsim_memory_t *memory, int val, int msb, int lsb)
+/*
+ * keeps port 0's dataout of the last read through this clock instead of
+ * invalidating it, for a unit that stalls before using it
+ */
+void llsim_mem_hold(llsim_memory_t *memory)
 {
-	int *p;
+	memory->hold = 1;
+}
 
-	llsim_assert(msb <= 31 && lsb <= 31, "ERROR only <=32 bit memories supported");
-	p = (int *) memory->datain;
-	*p = rbs(*p,val,msb,lsb);
+/*
+ * datain and dataout hold a whole entry. the bit range variants access up
+ * to 32 bits of it, the words variants all entry_size words.
+ */
+void llsim_mem_set_datain(llsim_memory_t *memory, int val, int msb, int lsb)
+{
+	llsim_assert(msb < memory->bits && lsb <= msb && msb - lsb < 32,
+		     "ERROR: bits %d:%d of memory %s", msb, lsb, memory->name);
+	if (memory->entry_size == 1) {
+		*memory->datain = rbs(*memory->datain, val, msb, lsb);
+		return;
+	}
+	generic_inject_bits((char *) memory->datain, val, msb, lsb);
 }
 
 int llsim_mem_extract_dataout(llsim_memory_t *memory, int msb, int lsb)
 {
-	int *p;
+	llsim_assert(msb < memory->bits && lsb <= msb && msb - lsb < 32,
+		     "ERROR: bits %d:%d of memory %s", msb, lsb, memory->name);
+	if (memory->entry_size == 1)
+		return sbs(*memory->dataout, msb, lsb);
+	return generic_extract_bits((char *) memory->dataout, msb, lsb);
+}
+
+void llsim_mem_set_datain_words(llsim_memory_t *memory, int *words)
+{
+	memcpy(memory->datain, words, memory->entry_size * sizeof(int));
+}
 
-	llsim_assert(msb <= 31 && lsb <= 31, "ERROR only <=32 bit memories supported");
-	p = (int *) memory->dataout;
-	return sbs(*p,msb,lsb);
+void llsim_mem_extract_dataout_words(llsim_memory_t *memory, int *words)
+{
+	memcpy(words, memory->dataout, memory->entry_size * sizeof(int));
 }
 
-void llsim_run_clock(void)
+/*
+ * multi port memories: every port has its own address, datain and dataout
+ * and does one read or one write per clock. port 0 is the same as the
+ * functions above. all reads of a clock see the memory before its writes
+ * (read first), two ports writing the same entry in one clock is an error.
+ */
+static llsim_mem_port_t *llsim_mem_port(llsim_memory_t *memory, int port)
+{
+	llsim_assert(port > 0 && port < memory->nr_ports, "ERROR: memory %s has no port %d", memory->name, port);
+	return &memory->ports[port - 1];
+}
+
+void llsim_mem_read_port(llsim_memory_t *memory, int port, int addr)
+{
+	llsim_mem_port_t *p;
+
+	if (port == 0) {
+		llsim_mem_read(memory, addr);
+		return;
+	}
+	p = llsim_mem_port(memory, port);
+	llsim_assert(!p->read, "ERROR: multiple memory reads to memory %s port %d", memory->name, port);
+	p->read = 1;
+	p->read_addr = addr;
+}
+
+void llsim_mem_write_port(llsim_memory_t *memory, int port, int addr)
+{
+	llsim_mem_port_t *p;
+
+	if (port == 0) {
+		llsim_mem_write(memory, addr);
+		return;
+	}
+	p = llsim_mem_port(memory, port);
+	llsim_assert(!p->write, "ERROR: multiple memory writes to memory %s port %d", memory->name, port);
+	p->write = 1;
+	p->write_addr = addr;
+}
+
+void llsim_mem_set_datain_port(llsim_memory_t *memory, int port, int val, int msb, int lsb)
+{
+	if (port == 0) {
+		llsim_mem_set_datain(memory, val, msb, lsb);
+		return;
+	}
+	llsim_assert(msb < memory->bits && lsb <= msb && msb - lsb < 32,
+		     "ERROR: bits %d:%d of memory %s", msb, lsb, memory->name);
+	generic_inject_bits((char *) llsim_mem_port(memory, port)->datain, val, msb, lsb);
+}
+
+int llsim_mem_extract_dataout_port(llsim_memory_t *memory, int port, int msb, int lsb)
+{
+	if (port == 0)
+		return llsim_mem_extract_dataout(memory, msb, lsb);
+	llsim_assert(msb < memory->bits && lsb <= msb && msb - lsb < 32,
+		     "ERROR: bits %d:%d of memory %s", msb, lsb, memory->name);
+	return generic_extract_bits((char *) llsim_mem_port(memory, port)->dataout, msb, lsb);
+}
+
+/*
+ * flatten units, memories and register blocks into arrays so the clock
+ * loop doesn't chase list pointers. units keep their list order.
+ */
+void llsim_compile(void)
 {
 	llsim_unit_t *unit;
 	llsim_unit_registers_t *ur;
 	llsim_memory_t *mem;
-	int read_done, write_done;
-	
-	/*
-	 * run units
-	 */
-	unit = llsim->units;
-	while (unit) {
-		unit->run(unit);
-
-		// memories
-		mem = unit->mems;
-		while (mem) {
-			read_done = mem->read;
-			write_done = mem->write;
-			if (mem->read) {
-				llsim_assert(mem->read_addr < mem->height, "mem %s read address %d out of range\n", mem->name, mem->read_addr);
-				*mem->dataout = mem->data[mem->read_addr];
-				llsim_printf("llsim: clock %d: READ MEM %s addr %d --> %08x\n", llsim->clock, mem->name, mem->read_addr, *mem->dataout);
-				mem->read = 0;
-			}
-			if (mem->write) {
-				llsim_assert(mem->write_addr < mem->height, "mem %s write address %d out of range\n", mem->name, mem->write_addr);
-				mem->data[mem->write_addr] = *mem->datain;
-				llsim_printf("llsim: clock %d: WRITE %08x --> MEM %s addr %d\n", llsim->clock, *mem->datain, mem->name, mem->write_addr);
-				mem->write = 0;
-			}
-			llsim_assert(!(read_done && write_done), "ERROR: simultaneous access to memory %s", mem->name);
-			if (!read_done && !write_done)
-				*mem->dataout = 0xBAADBAAD;
-			mem = mem->next;
+	int nr_units, nr_mems, nr_copy;
+
+	nr_units = nr_mems = nr_copy = 0;
+	llsim->nr_busy_units = 0;
+	for (unit = llsim->units; unit; unit = unit->next) {
+		nr_units++;
+		if (!unit->horizon)
+			llsim->nr_busy_units++;
+		for (mem = unit->mems; mem; mem = mem->next)
+			nr_mems++;
+		for (ur = unit->regs; ur; ur = ur->next)
+			nr_copy++;
+	}
+
+	free(llsim->unit_vec);
+	free(llsim->unit_mems);
+	free(llsim->mem_vec);
+	free(llsim->copy_regs_vec);
+	llsim->unit_vec = llsim_malloc((nr_units + 1) * sizeof(llsim_unit_t *));
+	llsim->unit_mems = llsim_malloc((nr_units + 1) * sizeof(int));
+	llsim->mem_vec = llsim_malloc((nr_mems + 1) * sizeof(llsim_memory_t *));
+	llsim->copy_regs_vec = llsim_malloc((nr_copy + 1) * sizeof(llsim_unit_registers_t *));
+
+	nr_units = nr_mems = nr_copy = 0;
+	for (unit = llsim->units; unit; unit = unit->next) {
+		llsim->unit_mems[nr_units] = nr_mems;
+		llsim->unit_vec[nr_units++] = unit;
+		for (mem = unit->mems; mem; mem = mem->next)
+			llsim->mem_vec[nr_mems++] = mem;
+		for (ur = unit->regs; ur; ur = ur->next)
+			llsim->copy_regs_vec[nr_copy++] = ur;
+	}
+	llsim->unit_mems[nr_units] = nr_mems;
+	llsim->nr_units = nr_units;
+	llsim->nr_copy_regs = nr_copy;
+	llsim->compiled = 1;
+
+	// threads beyond one per unit would only wait at the barriers
+	if (!llsim->pool && llsim->nr_threads > nr_units && llsim->nr_threads > 1) {
+		printf("llsim: %d host threads for %d units, using %d\n", llsim->nr_threads, nr_units,
+		       nr_units > 1 ? nr_units : 1);
+		llsim->nr_threads = nr_units > 1 ? nr_units : 1;
+	}
+}
+
+/*
+ * hex of a wide entry, high word first
+ */
+static char *llsim_mem_format(char *buf, int *words, int entry_size)
+{
+	int i;
+
+	for (i = 0; i < entry_size; i++)
+		sprintf(buf + 8 * i, "%08x", words[entry_size - 1 - i]);
+	return buf;
+}
+
+static void llsim_commit_wide_memory(llsim_memory_t *mem)
+{
+	char buf[8 * 8 + 1];
+	int read_done, write_done, i;
+
+	read_done = mem->read;
+	write_done = mem->write;
+	if (mem->read) {
+		llsim_assert(mem->read_addr < mem->height, "mem %s read address %d out of range\n", mem->name, mem->read_addr);
+		memcpy(mem->dataout, mem->data + mem->read_addr * mem->entry_size, mem->entry_size * sizeof(int));
+		if (llsim_log_enabled(LLSIM_LOG_MEM))
+			llsim_printf("llsim: clock %d: READ MEM %s addr %d --> %s\n", llsim->clock, mem->name, mem->read_addr,
+				     llsim_mem_format(buf, mem->dataout, mem->entry_size));
+		mem->read = 0;
+		mem->reads++;
+	}
+	if (mem->write) {
+		llsim_assert(mem->write_addr < mem->height, "mem %s write address %d out of range\n", mem->name, mem->write_addr);
+		memcpy(mem->data + mem->write_addr * mem->entry_size, mem->datain, mem->entry_size * sizeof(int));
+		llsim_mem_dirty(mem, mem->write_addr);
+		if (llsim_log_enabled(LLSIM_LOG_MEM))
+			llsim_printf("llsim: clock %d: WRITE %s --> MEM %s addr %d\n", llsim->clock,
+				     llsim_mem_format(buf, mem->datain, mem->entry_size), mem->name, mem->write_addr);
+		mem->write = 0;
+		mem->writes++;
+	}
+	llsim_assert(!(read_done && write_done), "ERROR: simultaneous access to memory %s", mem->name);
+	if (!read_done && !write_done && !mem->hold)
+		for (i = 0; i < mem->entry_size; i++)
+			mem->dataout[i] = 0xBAADBAAD;
+	mem->hold = 0;
+}
+
+static void llsim_commit_port_read(llsim_memory_t *mem, int port, llsim_mem_port_t *p)
+{
+	char buf[8 * 8 + 1];
+	int i;
+
+	if (!p->read) {
+		if (!p->write && !(port == 0 && mem->hold))
+			for (i = 0; i < mem->entry_size; i++)
+				p->dataout[i] = 0xBAADBAAD;
+		return;
+	}
+	llsim_assert(!p->write, "ERROR: simultaneous access to memory %s port %d", mem->name, port);
+	llsim_assert(p->read_addr < mem->height, "mem %s port %d read address %d out of range\n", mem->name, port, p->read_addr);
+	memcpy(p->dataout, mem->data + p->read_addr * mem->entry_size, mem->entry_size * sizeof(int));
+	if (llsim_log_enabled(LLSIM_LOG_MEM))
+		llsim_printf("llsim: clock %d: READ MEM %s port %d addr %d --> %s\n", llsim->clock, mem->name, port, p->read_addr,
+			     llsim_mem_format(buf, p->dataout, mem->entry_size));
+	p->read = 0;
+	mem->reads++;
+}
+
+static void llsim_commit_port_write(llsim_memory_t *mem, int port, llsim_mem_port_t *p, llsim_mem_port_t *ports)
+{
+	char buf[8 * 8 + 1];
+	int i;
+
+	if (!p->write)
+		return;
+	llsim_assert(p->write_addr < mem->height, "mem %s port %d write address %d out of range\n", mem->name, port, p->write_addr);
+	for (i = 0; i < port; i++)
+		llsim_assert(!ports[i].write || ports[i].write_addr != p->write_addr,
+			     "ERROR: ports %d and %d of memory %s write address %d", i, port, mem->name, p->write_addr);
+	memcpy(mem->data + p->write_addr * mem->entry_size, p->datain, mem->entry_size * sizeof(int));
+	llsim_mem_dirty(mem, p->write_addr);
+	mem->writes++;
+	if (llsim_log_enabled(LLSIM_LOG_MEM))
+		llsim_printf("llsim: clock %d: WRITE %s --> MEM %s port %d addr %d\n", llsim->clock,
+			     llsim_mem_format(buf, p->datain, mem->entry_size), mem->name, port, p->write_addr);
+}
+
+/*
+ * all ports read, then all ports write
+ */
+static void llsim_commit_multiport_memory(llsim_memory_t *mem)
+{
+	llsim_mem_port_t ports[mem->nr_ports];
+	int bank[mem->nr_ports], i, j;
+
+	// port 0 lives in the memory itself
+	ports[0].read = mem->read;
+	ports[0].read_addr = mem->read_addr;
+	ports[0].write = mem->write;
+	ports[0].write_addr = mem->write_addr;
+	ports[0].datain = mem->datain;
+	ports[0].dataout = mem->dataout;
+	memcpy(&ports[1], mem->ports, (mem->nr_ports - 1) * sizeof(llsim_mem_port_t));
+
+	if (mem->nr_banks > 1) {
+		for (i = 0; i < mem->nr_ports; i++) {
+			bank[i] = -1;
+			if (ports[i].read || ports[i].write)
+				bank[i] = (ports[i].read ? ports[i].read_addr : ports[i].write_addr) & (mem->nr_banks - 1);
+			for (j = 0; j < i; j++)
+				llsim_assert(bank[i] < 0 || bank[i] != bank[j],
+					     "ERROR: ports %d and %d of memory %s access bank %d", j, i, mem->name, bank[i]);
 		}
-		unit = unit->next;
+		memset(mem->bank_busy, 0, mem->nr_banks);
 	}
 
-	/*
-	 * copy registers
-	 */
-	unit = llsim->units;
-	while (unit) {
-		ur = unit->regs;
-		while (ur) {
-			memcpy(ur->old, ur->new, ur->size);
-			ur = ur->next;
+	for (i = 0; i < mem->nr_ports; i++)
+		llsim_commit_port_read(mem, i, &ports[i]);
+	for (i = 0; i < mem->nr_ports; i++)
+		llsim_commit_port_write(mem, i, &ports[i], ports);
+
+	mem->read = mem->write = mem->hold = 0;
+	for (i = 0; i < mem->nr_ports - 1; i++)
+		mem->ports[i].read = mem->ports[i].write = 0;
+}
+
+static inline void llsim_commit_memory(llsim_memory_t *mem)
+{
+	int read_done, write_done;
+
+	if (mem->nr_ports > 1) {
+		llsim_commit_multiport_memory(mem);
+		return;
+	}
+	if (mem->entry_size > 1) {
+		llsim_commit_wide_memory(mem);
+		return;
+	}
+	read_done = mem->read;
+	write_done = mem->write;
+	if (mem->read) {
+		llsim_assert(mem->read_addr < mem->height, "mem %s read address %d out of range\n", mem->name, mem->read_addr);
+		*mem->dataout = mem->data[mem->read_addr];
+		llsim_log(LLSIM_LOG_MEM, "llsim: clock %d: READ MEM %s addr %d --> %08x\n", llsim->clock, mem->name, mem->read_addr, *mem->dataout);
+		mem->read = 0;
+		mem->reads++;
+	}
+	if (mem->write) {
+		llsim_assert(mem->write_addr < mem->height, "mem %s write address %d out of range\n", mem->name, mem->write_addr);
+		mem->data[mem->write_addr] = *mem->datain;
+		llsim_mem_dirty(mem, mem->write_addr);
+		llsim_log(LLSIM_LOG_MEM, "llsim: clock %d: WRITE %08x --> MEM %s addr %d\n", llsim->clock, *mem->datain, mem->name, mem->write_addr);
+		mem->write = 0;
+		mem->writes++;
+	}
+	llsim_assert(!(read_done && write_done), "ERROR: simultaneous access to memory %s", mem->name);
+	if (!read_done && !write_done && !mem->hold)
+		*mem->dataout = 0xBAADBAAD;
+	mem->hold = 0;
+}
+
+static void llsim_run_unit_timed(int i)
+{
+	llsim_unit_t *unit = llsim->unit_vec[i];
+	i64 t0, t1;
+	int j;
+
+	t0 = llsim_host_ticks();
+	unit->run(unit);
+	t1 = llsim_host_ticks();
+	for (j = llsim->unit_mems[i]; j < llsim->unit_mems[i + 1]; j++)
+		llsim_commit_memory(llsim->mem_vec[j]);
+	unit->host_run += t1 - t0;
+	unit->host_commit += llsim_host_ticks() - t1;
+}
+
+static inline void llsim_run_unit(int i)
+{
+	llsim_unit_t *unit = llsim->unit_vec[i];
+	int j;
+
+	if (llsim->host_timing) {
+		llsim_run_unit_timed(i);
+		return;
+	}
+	unit->run(unit);
+	for (j = llsim->unit_mems[i]; j < llsim->unit_mems[i + 1]; j++)
+		llsim_commit_memory(llsim->mem_vec[j]);
+}
+
+/*
+ * copies register blocks first, first + step, ...
+ */
+static inline void llsim_copy_registers(int first, int step)
+{
+	llsim_unit_registers_t *ur;
+	int i;
+
+	for (i = first; i < llsim->nr_copy_regs; i += step) {
+		ur = llsim->copy_regs_vec[i];
+		memcpy(ur->old, ur->new, ur->size);
+	}
+}
+
+/*
+ * idle cycle skipping
+ *
+ * a unit's horizon() returns the earliest clock at which its state can
+ * change, LLSIM_HORIZON_NEVER when only another unit can get it going
+ * again. when no unit will do anything before clock h, clocks up to h are
+ * not simulated: every unit's skip() accounts for the cycles (cycle
+ * counters, trace annotations) and llsim->clock jumps to h. units without
+ * horizon() are busy every clock.
+ */
+static void llsim_skip_idle(void)
+{
+	llsim_unit_t *unit;
+	int horizon, h, n, i;
+
+	if (!llsim->compiled)
+		llsim_compile();
+	// cheap test for the common case of a unit that is always busy
+	if (llsim->nr_busy_units)
+		return;
+
+	horizon = LLSIM_HORIZON_NEVER;
+	for (i = 0; i < llsim->nr_units; i++) {
+		unit = llsim->unit_vec[i];
+		h = unit->horizon(unit);
+		if (h <= llsim->clock)
+			return;
+		if (h < horizon)
+			horizon = h;
+	}
+	llsim_assert(horizon != LLSIM_HORIZON_NEVER, "ERROR: all units are idle for good\n");
+	// checkpoints and the end of a sample window fall on their clock
+	if (llsim->checkpoint_clock > llsim->clock && llsim->checkpoint_clock < horizon)
+		horizon = llsim->checkpoint_clock;
+	if (llsim->sample_clock >= 0 && llsim->sample_clock + llsim->sample_window < horizon)
+		horizon = llsim->sample_clock + llsim->sample_window;
+
+	n = horizon - llsim->clock;
+	llsim_log(LLSIM_LOG_CLOCK, "llsim: clock %d: %d idle cycles skipped\n", llsim->clock, n);
+	for (i = 0; i < llsim->nr_units; i++) {
+		unit = llsim->unit_vec[i];
+		if (unit->skip)
+			unit->skip(unit, n);
+	}
+	llsim->clock = horizon;
+	llsim->idle_skipped += n;
+}
+
+/*
+ * multi-threaded clock engine
+ *
+ * units only read old registers and write new ones, so within a clock they
+ * don't depend on each other. with nr_threads > 1 a pool of worker threads
+ * (the calling thread is worker 0) takes units off a shared counter, every
+ * unit's memories are committed by the thread that ran it. after a barrier
+ * the register blocks are copied, split evenly between the threads. units
+ * must only access their own memories, and log output of different units
+ * may interleave. llsim_compile() caps nr_threads at the number of units,
+ * so single unit designs like both sp cores always run serially.
+ */
+#define LLSIM_BARRIER_SPINS	1000
+
+typedef struct llsim_barrier_s {
+	int count;
+	int waiting;
+	int generation;
+} llsim_barrier_t;
+
+typedef struct llsim_pool_s {
+	llsim_t *sim;
+	int nr_threads;
+	pthread_t *threads;
+	int nr_started;
+	int quit;
+	int next_unit;
+	llsim_barrier_t barrier;
+} llsim_pool_t;
+
+/*
+ * a barrier per clock phase is too frequent for futex based barriers, spin
+ * a while before yielding the cpu
+ */
+static void llsim_barrier_wait(llsim_barrier_t *b)
+{
+	int gen, spins;
+
+	gen = __atomic_load_n(&b->generation, __ATOMIC_ACQUIRE);
+	if (__atomic_add_fetch(&b->waiting, 1, __ATOMIC_ACQ_REL) == b->count) {
+		__atomic_store_n(&b->waiting, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&b->generation, gen + 1, __ATOMIC_RELEASE);
+		return;
+	}
+	for (spins = 0; __atomic_load_n(&b->generation, __ATOMIC_ACQUIRE) == gen; spins++)
+		if (spins > LLSIM_BARRIER_SPINS)
+			sched_yield();
+}
+
+static void llsim_pool_clock(llsim_pool_t *pool, int tid)
+{
+	i64 t;
+	int i;
+
+	while ((i = __atomic_fetch_add(&pool->next_unit, 1, __ATOMIC_RELAXED)) < llsim->nr_units)
+		llsim_run_unit(i);
+	llsim_barrier_wait(&pool->barrier);
+	// the host time of the copies is the calling thread's share
+	t = tid ? 0 : llsim_host_begin();
+	llsim_copy_registers(tid, pool->nr_threads);
+	llsim_host_end(&llsim->host_copy, t);
+}
+
+static void *llsim_worker(void *arg)
+{
+	llsim_pool_t *pool = arg;
+	int tid;
+
+	tid = __atomic_add_fetch(&pool->nr_started, 1, __ATOMIC_RELAXED);
+	llsim = pool->sim;
+	for (;;) {
+		llsim_barrier_wait(&pool->barrier);
+		if (pool->quit)
+			break;
+		llsim_pool_clock(pool, tid);
+		llsim_barrier_wait(&pool->barrier);
+	}
+	return NULL;
+}
+
+static void llsim_pool_start(void)
+{
+	llsim_pool_t *pool;
+	int i;
+
+	pool = llsim_malloc(sizeof(llsim_pool_t));
+	pool->sim = llsim;
+	pool->nr_threads = llsim->nr_threads;
+	pool->barrier.count = pool->nr_threads;
+	pool->threads = llsim_malloc(pool->nr_threads * sizeof(pthread_t));
+	for (i = 1; i < pool->nr_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, llsim_worker, pool) != 0) {
+			printf("llsim: couldn't start worker thread\n");
+			exit(1);
 		}
-		unit = unit->next;
 	}
+	llsim->pool = pool;
 }
 
-static void llsim_init_units(char *program_name)
+static void llsim_pool_stop(llsim_t *sim)
 {
-	llsim->units = NULL;
-	llsim->clock = 0;
-	sp_init(program_name);
+	llsim_pool_t *pool = sim->pool;
+	int i;
+
+	pool->quit = 1;
+	llsim_barrier_wait(&pool->barrier);
+	for (i = 1; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	free(pool);
+	sim->pool = NULL;
 }
 
-static void llsim_init(char *program_name)
+void llsim_run_clock(void)
 {
-	llsim = llsim_malloc(sizeof(llsim_t));
-	llsim_init_units(program_name);
+	llsim_pool_t *pool;
+	i64 t;
+	int i;
+
+	if (!llsim->compiled)
+		llsim_compile();
+
+	if (llsim->nr_threads > 1) {
+		if (!llsim->pool)
+			llsim_pool_start();
+		pool = llsim->pool;
+		pool->next_unit = 0;
+		llsim_barrier_wait(&pool->barrier);
+		llsim_pool_clock(pool, 0);
+		llsim_barrier_wait(&pool->barrier);
+	} else {
+		/*
+		 * run units, each unit's memories are committed right after it
+		 */
+		for (i = 0; i < llsim->nr_units; i++)
+			llsim_run_unit(i);
+
+		/*
+		 * copy registers
+		 */
+		t = llsim_host_begin();
+		llsim_copy_registers(0, 1);
+		llsim_host_end(&llsim->host_copy, t);
+	}
+
 }
 
 static void llsim_init_reset_values(void)
@@ -331,35 +1021,494 @@ static void llsim_init_reset_values(void)
 
 void llsim_stop(void)
 {
-	stop_sim = 1;
+	llsim->stop = 1;
 }
 
-int main(int argc, char **argv)
+/*
+ * creates an instance simulating program_name. its output files go to
+ * outdir, the current directory when NULL. the new instance becomes the
+ * current one of the calling thread.
+ */
+llsim_t *llsim_create(char *program_name, char *outdir)
 {
-	int i;
+	llsim_t *sim;
+
+	sim = llsim_malloc(sizeof(llsim_t));
+	if (outdir) {
+		sim->outdir = llsim_malloc(strlen(outdir) + 1);
+		strcpy(sim->outdir, outdir);
+	}
+	sim->trace_format = trace_format;
+	sim->trace_async = trace_async;
+	sim->no_traces = no_traces;
+	sim->fast_forward = fast_forward;
+	sim->dump_format = dump_format;
+	sim->dma_port = dma_port;
+	sim->nr_banks = nr_banks;
+	sim->addr_bits = addr_bits;
+	sim->huge_pages = huge_pages;
+	sim->counters_format = counters_format;
+	sim->profile = profile;
+	sim->host_time = host_time;
+	sim->icache = icache_config;
+	sim->dcache = dcache_config;
+	sim->nr_threads = nr_threads;
+	sim->checkpoint_clock = checkpoint_clock;
+	sim->sample_interval = sample_interval;
+	sim->sample_window = sample_window;
+	sim->sample_clock = -1;
+
+	llsim = sim;
+	sp_init(program_name);
+	if (restore_path)
+		llsim_restore(restore_path);
+	return sim;
+}
+
+/*
+ * host time (-T)
+ *
+ * the whole run is timed with the wall clock and its phases with the tsc,
+ * read at their boundaries in every clock: each unit's run() and its trace
+ * output, the commits of its memories and the register copies. what's
+ * left of the wall clock time (idle skipping, checkpoints, the clock loop
+ * and the timing itself) is other.
+ */
+static i64 llsim_host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void llsim_host_start(void)
+{
+	llsim->host_start_clock = llsim->clock;
+	llsim->host_start_ns = llsim_host_ns();
+	llsim->host_start_ticks = llsim_host_ticks();
+	llsim->host_timing = 1;
+}
+
+static void llsim_host_phase(char *name, i64 ticks, double scale, double wall)
+{
+	llsim_printf("llsim: host: %-20s %10.3f s %6.1f%%\n", name, ticks * scale, wall > 0 ? 100.0 * ticks * scale / wall : 0.0);
+}
+
+/*
+ * prints the simulated clock rate and where the host time went
+ */
+static void llsim_host_print(void)
+{
+	llsim_unit_t *unit;
+	char name[64];
+	double wall, scale, rate;
+	i64 ticks, phases;
+	int clocks;
 
-	llsim_init(argv[1]);
+	wall = (llsim_host_ns() - llsim->host_start_ns) / 1e9;
+	ticks = llsim_host_ticks() - llsim->host_start_ticks;
+	clocks = llsim->clock - llsim->host_start_clock;
+	rate = wall > 0 ? clocks / wall : 0.0;
+	if (rate >= 1e6)
+		llsim_printf("llsim: host: %d clocks in %.3f s, %.3f MHz\n", clocks, wall, rate / 1e6);
+	else
+		llsim_printf("llsim: host: %d clocks in %.3f s, %.3f kHz\n", clocks, wall, rate / 1e3);
+	if (ticks <= 0)
+		return;
+
+	// seconds per tick
+	scale = wall / ticks;
+	phases = llsim->host_copy;
+	for (unit = llsim->units; unit; unit = unit->next) {
+		snprintf(name, sizeof(name), "%s run", unit->name);
+		llsim_host_phase(name, unit->host_run - unit->host_trace, scale, wall);
+		snprintf(name, sizeof(name), "%s trace", unit->name);
+		llsim_host_phase(name, unit->host_trace, scale, wall);
+		snprintf(name, sizeof(name), "%s memory commit", unit->name);
+		llsim_host_phase(name, unit->host_commit, scale, wall);
+		phases += unit->host_run + unit->host_commit;
+	}
+	llsim_host_phase("register copy", llsim->host_copy, scale, wall);
+	llsim_printf("llsim: host: %-20s %10.3f s %6.1f%%\n", "other", wall - phases * scale,
+		     wall > 0 ? 100.0 * (wall - phases * scale) / wall : 0.0);
+}
 
+/*
+ * runs the instance until one of its units calls llsim_stop()
+ */
+void llsim_run(llsim_t *sim)
+{
+	char path[1024];
+	int i;
+
+	llsim = sim;
 	llsim_printf("llsim: starting simulation\n");
-	llsim->reset = 1;
+	if (llsim->host_time)
+		llsim_host_start();
+	if (!llsim->restored) {
+		llsim->reset = 1;
 
-	// init registers
-	llsim_init_reset_values();
+		// init registers
+		llsim_init_reset_values();
 
-	for (i = 0; i < 5; i++) {
-		llsim_run_clock();
-		llsim->clock++;
+		for (i = 0; i < 5; i++) {
+			llsim_run_clock();
+			llsim->clock++;
+		}
+		llsim->reset = 0;
 	}
-	llsim->reset = 0;
-	while (!stop_sim) {
-		printf(">>>>> clock %d <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n", llsim->clock);
+	while (!llsim->stop) {
+		llsim_skip_idle();
+		if (llsim->checkpoint_clock && llsim->clock >= llsim->checkpoint_clock) {
+			llsim_output_path(path, sizeof(path), "llsim.ckpt");
+			llsim_checkpoint(path);
+			llsim->checkpoint_clock = 0;
+		}
+		llsim_log(LLSIM_LOG_CLOCK, ">>>>> clock %d <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n", llsim->clock);
 		llsim_run_clock();
 		llsim->clock++;
-		/*
-		if ((llsim->clock % 1000000) == 0)
-			printf("clock %d\n", llsim->clock);
-		*/
+		if (llsim->sample_pending)
+			llsim_sample_fork();
+		if (llsim->sample_clock >= 0 && llsim->clock - llsim->sample_clock >= llsim->sample_window)
+			llsim->stop = 1;
+	}
+	if (llsim->idle_skipped)
+		llsim_printf("llsim: %d idle cycles skipped\n", llsim->idle_skipped);
+	if (llsim->host_time) {
+		llsim->host_timing = 0;
+		llsim_host_print();
+	}
+	if (llsim->sample_clock >= 0)
+		llsim_sample_end();
+	else if (llsim->sampler)
+		llsim_sample_merge();
+}
+
+static void llsim_free_units(llsim_t *sim)
+{
+	llsim_unit_t *unit;
+	llsim_unit_registers_t *ur;
+	llsim_unit_state_t *st;
+	llsim_memory_t *mem;
+	llsim_cache_t *cache;
+	llsim_counter_t *counter;
+	llsim_register_t *reg;
+	llsim_output_t *output;
+	llsim_input_t *input;
+	void *next;
+	int i;
+
+	for (unit = sim->units; unit; unit = next) {
+		if (unit->destroy)
+			unit->destroy(unit);
+		for (ur = unit->regs; ur; ur = next) {
+			next = ur->next;
+			free(ur->name);
+			free(ur->old);
+			free(ur->new);
+			free(ur);
+		}
+		for (st = unit->states; st; st = next) {
+			next = st->next;
+			free(st->name);
+			free(st);
+		}
+		if (unit->profile) {
+			free(unit->profile->cycles);
+			free(unit->profile->count);
+			free(unit->profile->back_target);
+			free(unit->profile->back_count);
+			free(unit->profile->leader);
+			free(unit->profile);
+		}
+		for (counter = unit->counters; counter; counter = next) {
+			next = counter->next;
+			free(counter->name);
+			free(counter);
+		}
+		for (mem = unit->mems; mem; mem = next) {
+			next = mem->next;
+			free(mem->name);
+			munmap(mem->data, (size_t) mem->height * mem->entry_size * sizeof(int));
+			free(mem->datain);
+			free(mem->dataout);
+			for (i = 0; i < mem->nr_ports - 1; i++) {
+				free(mem->ports[i].datain);
+				free(mem->ports[i].dataout);
+			}
+			free(mem->ports);
+			free(mem->bank_busy);
+			free(mem->dirty);
+			free(mem);
+		}
+		for (cache = unit->caches; cache; cache = next) {
+			next = cache->next;
+			free(cache->name);
+			free(cache->tags);
+			free(cache->dirty);
+			free(cache->stamps);
+			free(cache);
+		}
+		for (reg = unit->registers; reg; reg = next) {
+			next = reg->next;
+			free(reg->unit_name);
+			free(reg->reg_name);
+			free(reg);
+		}
+		for (output = unit->outputs; output; output = next) {
+			next = output->next;
+			free(output->unit_name);
+			free(output->output_name);
+			free(output);
+		}
+		for (input = unit->inputs; input; input = next) {
+			next = input->next;
+			free(input->unit_name);
+			free(input->input_name);
+			free(input);
+		}
+		next = unit->next;
+		free(unit->name);
+		free(unit);
+	}
+}
+
+/*
+ * frees the instance, every unit's destroy callback releases its private
+ * state first
+ */
+void llsim_destroy(llsim_t *sim)
+{
+	llsim_t *prev = llsim;
+	int sample = sim->sample_clock >= 0;
+
+	if (sim->pool)
+		llsim_pool_stop(sim);
+
+	// destroy callbacks may still use llsim
+	llsim = sim;
+	llsim_free_units(sim);
+	llsim = (prev == sim) ? NULL : prev;
+
+	free(sim->unit_vec);
+	free(sim->unit_mems);
+	free(sim->mem_vec);
+	free(sim->copy_regs_vec);
+	free(sim->outdir);
+	free(sim);
+
+	// a forked sample ends with its instance. _exit() leaves the
+	// parent's buffers and open traces alone
+	if (sample) {
+		fflush(stdout);
+		_exit(0);
 	}
-	return 0;
 }
 
+/*
+ * runs one program to completion in the current directory
+ */
+void llsim_simulate(char *program_name)
+{
+	llsim_t *sim;
+
+	sim = llsim_create(program_name, NULL);
+	llsim_run(sim);
+	llsim_destroy(sim);
+}
+
+/*
+ * the command line, bench/microbench.c links llsim without it
+ */
+#ifndef LLSIM_NO_MAIN
+static char *llsim_log_names[LLSIM_LOG_NR] = {"clock", "mem", "unit", "dma"};
+
+/*
+ * parse a comma separated list of log categories ("all" and "none" allowed)
+ */
+static int llsim_parse_log_mask(char *list)
+{
+	char *name;
+	int mask, i;
+
+	mask = 0;
+	for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		if (strcmp(name, "all") == 0) {
+			mask = LLSIM_LOG_ALL;
+			continue;
+		}
+		if (strcmp(name, "none") == 0) {
+			mask = 0;
+			continue;
+		}
+		for (i = 0; i < LLSIM_LOG_NR; i++)
+			if (strcmp(name, llsim_log_names[i]) == 0)
+				break;
+		if (i == LLSIM_LOG_NR) {
+			printf("llsim: unknown log category %s\n", name);
+			exit(1);
+		}
+		mask |= 1 << i;
+	}
+	return mask;
+}
+
+/*
+ * whether the core takes option opt, every core takes the common ones
+ */
+static int llsim_core_option(int opt)
+{
+	return !strchr(LLSIM_CORE_OPTIONS, opt) || strchr(sp_options, opt);
+}
+
+static void llsim_usage(char *prog)
+{
+	printf("usage: %s [options] program\n", prog);
+	printf("       %s [options] -m manifest [-j jobs] [-o dir]\n", prog);
+	printf("  -q       no log output\n");
+	printf("  -l list  log categories: clock,mem,unit,dma,all,none\n");
+	printf("           (default all but dma)\n");
+	if (llsim_core_option('b'))
+		printf("  -b       binary cycle trace (see trace2txt)\n");
+	if (llsim_core_option('a'))
+		printf("  -a       write traces from a background thread\n");
+	printf("  -n       no instruction and cycle traces\n");
+	printf("  -f n     execute the first n instructions functionally\n");
+	printf("  -d fmt   memory dump format: text,bin,sparse,rle (see imgconv)\n");
+	printf("  -t n     run units on n host threads, at most one per unit\n");
+	printf("  -c n     write a checkpoint (llsim.ckpt) at clock n\n");
+	printf("  -r file  continue from a checkpoint\n");
+	if (llsim_core_option('p'))
+		printf("  -p       DMA engine on its own data memory port\n");
+	if (llsim_core_option('k'))
+		printf("  -k n     data memory of n interleaved banks shared by core and DMA\n");
+	printf("  -w bits  data address width, 16 to 30 bits (default 16)\n");
+	printf("  -H       back memories with huge pages\n");
+	printf("  -S fmt   dump the counters at the end, fmt: json,csv\n");
+	printf("  -P       profile the guest code into profile.txt\n");
+	printf("  -T       print the simulated clock rate and the host time per phase\n");
+	printf("  -I spec  instruction cache, spec: size=n,ways=n,line=n,policy=lru|fifo|random,\n");
+	printf("           write=wb|wt,latency=n (sizes in words, latency in clocks per line)\n");
+	printf("  -D spec  data cache, same spec\n");
+	printf("  -s n:w   sampled simulation: n instructions functionally, then a\n");
+	printf("           forked detailed sample of w clocks, repeatedly\n");
+	printf("  -m file  batch mode, run every program of the manifest file\n");
+	printf("  -j n     batch jobs running in parallel (default: one per cpu)\n");
+	printf("  -o dir   batch output directory (default: batch_out)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *manifest = NULL, *outdir = "batch_out";
+	int opt, jobs = 0;
+
+	while ((opt = getopt(argc, argv, "ql:banf:d:pk:w:HS:PTI:D:t:c:r:s:m:j:o:")) != -1) {
+		if (!llsim_core_option(opt)) {
+			printf("llsim: this core doesn't support -%c\n", opt);
+			llsim_usage(argv[0]);
+		}
+		switch (opt) {
+		case 'q':
+			llsim_log_mask = 0;
+			break;
+		case 'l':
+			llsim_log_mask = llsim_parse_log_mask(optarg);
+			break;
+		case 'b':
+			trace_format = LLSIM_TRACE_BINARY;
+			break;
+		case 'a':
+			trace_async = 1;
+			break;
+		case 'n':
+			no_traces = 1;
+			break;
+		case 'f':
+			fast_forward = atoi(optarg);
+			break;
+		case 'd':
+			dump_format = image_parse_format(optarg);
+			if (dump_format < 0)
+				llsim_usage(argv[0]);
+			break;
+		case 'p':
+			dma_port = 1;
+			break;
+		case 'k':
+			nr_banks = atoi(optarg);
+			if (nr_banks <= 0 || (nr_banks & (nr_banks - 1)))
+				llsim_usage(argv[0]);
+			break;
+		case 'w':
+			addr_bits = atoi(optarg);
+			if (addr_bits < 16 || addr_bits > 30)
+				llsim_usage(argv[0]);
+			break;
+		case 'H':
+			huge_pages = 1;
+			break;
+		case 'S':
+			if (strcmp(optarg, "json") == 0)
+				counters_format = LLSIM_COUNTERS_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				counters_format = LLSIM_COUNTERS_CSV;
+			else
+				llsim_usage(argv[0]);
+			break;
+		case 'P':
+			profile = 1;
+			break;
+		case 'T':
+			host_time = 1;
+			break;
+		case 'I':
+			if (llsim_cache_parse(&icache_config, optarg))
+				llsim_usage(argv[0]);
+			break;
+		case 'D':
+			if (llsim_cache_parse(&dcache_config, optarg))
+				llsim_usage(argv[0]);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1)
+				llsim_usage(argv[0]);
+			break;
+		case 'c':
+			checkpoint_clock = atoi(optarg);
+			break;
+		case 'r':
+			restore_path = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%d:%d", &sample_interval, &sample_window) != 2 ||
+			    sample_interval <= 0 || sample_window <= 0)
+				llsim_usage(argv[0]);
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'o':
+			outdir = optarg;
+			break;
+		default:
+			llsim_usage(argv[0]);
+		}
+	}
+	if (manifest) {
+		if (optind != argc)
+			llsim_usage(argv[0]);
+		return llsim_batch(manifest, outdir, jobs) ? 1 : 0;
+	}
+	if (optind != argc - 1)
+		llsim_usage(argv[0]);
+
+	llsim_simulate(argv[optind]);
+	return 0;
+}
+#endif
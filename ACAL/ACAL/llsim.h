@@ -1,16 +1,24 @@
 #ifndef _LLSIM_H_
 #define _LLSIM_H_
+#include <time.h>
 typedef long long i64;
 
 void sp_init(char *program_name);
 
+/*
+ * options only some cores have, sp.c lists the ones its core takes in
+ * sp_options
+ */
+#define LLSIM_CORE_OPTIONS	"bapk"
+extern char *sp_options;
+
 /*
  * support functions
  */
 #define llsim_assert(cond, args...)					\
 	do {								\
 		if (!(cond)) {						\
-			printf("llsim: clock %d: assertion failed at file %s line %d: ", llsim->clock, __FILE__, __LINE__); \
+			printf("llsim: clock %d: assertion failed at file %s line %d: ", llsim ? llsim->clock : 0, __FILE__, __LINE__); \
 			printf(args);					\
 			exit (1);					\
 		}							\
@@ -18,6 +26,39 @@ void sp_init(char *program_name);
 
 #define llsim_printf	printf
 
+/*
+ * log categories
+ */
+#define LLSIM_LOG_CLOCK		0	// per cycle clock banner
+#define LLSIM_LOG_MEM		1	// memory reads and writes
+#define LLSIM_LOG_UNIT		2	// unit debug prints
+#define LLSIM_LOG_DMA		3	// DMA engine state
+#define LLSIM_LOG_NR		4
+
+#define LLSIM_LOG_ALL		((1 << LLSIM_LOG_NR) - 1)
+
+// the DMA state is printed every clock, only on request
+#define LLSIM_LOG_DEFAULT	(LLSIM_LOG_ALL & ~(1 << LLSIM_LOG_DMA))
+
+/*
+ * categories compiled into the binary, build with -DLLSIM_LOG_BUILD_MASK=0
+ * to drop every llsim_log() call
+ */
+#ifndef LLSIM_LOG_BUILD_MASK
+#define LLSIM_LOG_BUILD_MASK	LLSIM_LOG_ALL
+#endif
+
+extern int llsim_log_mask;
+
+#define llsim_log_enabled(cat)						\
+	((LLSIM_LOG_BUILD_MASK & (1 << (cat))) && (llsim_log_mask & (1 << (cat))))
+
+#define llsim_log(cat, args...)						\
+	do {								\
+		if (llsim_log_enabled(cat))				\
+			llsim_printf(args);				\
+	} while (0)
+
 #define llsim_error(args...) llsim_assert(0, args)
 
 static inline int bitmask0(bits)
@@ -118,24 +159,111 @@ typedef struct llsim_unit_registers_s {
 /*
  * memory
  */
+typedef struct llsim_mem_port_s {
+	int read;
+	int read_addr;
+	int write;
+	int write_addr;
+	int *datain;
+	int *dataout;
+} llsim_mem_port_t;
+
 typedef struct llsim_memory_s {
-	int entry_size;
+	int entry_size;			// 32 bit words per entry: 1, 2, 4 or 8
 	int bits;
 	int height;
-	int dp;
+	int dp;				// 0: single port, 1: dual port, n > 1: n ports
 	int *data;
 	char *name;
 
+	// port 0
 	int read;
 	int read_addr;
 	int write;
 	int write_addr;
 	int *datain;
 	int *dataout;
+	int hold;			// see llsim_mem_hold()
+
+	// ports 1 .. nr_ports - 1, see llsim_mem_read_port()
+	int nr_ports;
+	llsim_mem_port_t *ports;
+
+	// banks, see llsim_allocate_banked_memory(). 1: not banked
+	int nr_banks;
+	unsigned char *bank_busy;
+	int bank_accesses;
+	int bank_conflicts;
+
+	// accesses committed, of all ports
+	int reads;
+	int writes;
+
+	// pages written since allocation, all others still hold zeros
+	unsigned char *dirty;
+	int nr_pages;
 
 	struct llsim_memory_s *next;
 } llsim_memory_t;
 
+#define LLSIM_MEM_PAGE_SHIFT	8	// entries per dirty page: 256
+
+static inline void llsim_mem_dirty(llsim_memory_t *memory, int addr)
+{
+	memory->dirty[addr >> LLSIM_MEM_PAGE_SHIFT] = 1;
+}
+
+/*
+ * cache: the tags of a set associative cache in front of a memory. the
+ * data stays in the memory, a cache only decides when an access may go
+ * ahead, see cache.c
+ */
+#define LLSIM_CACHE_LRU		0
+#define LLSIM_CACHE_FIFO	1
+#define LLSIM_CACHE_RANDOM	2
+
+typedef struct llsim_cache_config_s {
+	int size;			// words, 0: no cache
+	int ways;
+	int line;			// words per line
+	int policy;			// LLSIM_CACHE_*
+	int write_back;			// 0: write through, no write allocate
+	int latency;			// clocks of the backing memory per line
+} llsim_cache_config_t;
+
+typedef struct llsim_cache_stats_s {
+	int accesses;
+	int hits;
+	int misses;
+	int evictions;
+	int writebacks;
+	int stall_cycles;
+} llsim_cache_stats_t;
+
+typedef struct llsim_cache_s {
+	char *name;
+	llsim_cache_config_t cfg;
+	int nr_sets;
+	int line_shift;
+
+	// per way of every set: line address (-1: invalid), dirty, and the
+	// stamp of the last use (lru) or of the fill (fifo)
+	int *tags;
+	unsigned char *dirty;
+	int *stamps;
+	int stamp;
+	unsigned int random;
+
+	// the line being filled (-1: none), its way and the clock it arrives
+	int fill_line;
+	int fill_way;
+	int fill_ready;
+
+	llsim_cache_stats_t stats;
+
+	struct llsim_cache_s *next;
+} llsim_cache_t;
+
 typedef struct llsim_register_s {
 	char *unit_name;
 	char *reg_name;
@@ -164,18 +292,71 @@ typedef struct llsim_input_s {
 	struct llsim_input_s *next;
 } llsim_input_t;
 
+/*
+ * unit private state that isn't a register, e.g. counters and tables
+ * updated in place. only used by checkpoints.
+ */
+typedef struct llsim_unit_state_s {
+	char *name;
+	void *p;
+	int size;
+	struct llsim_unit_state_s *next;
+} llsim_unit_state_t;
+
+/*
+ * performance counter of a unit, see counters.c
+ */
+typedef struct llsim_counter_s {
+	char *name;
+	int *p;
+	struct llsim_counter_s *next;
+} llsim_counter_t;
+
+/*
+ * guest code profile of a unit, see profile.c
+ */
+typedef struct llsim_profile_s {
+	int size;			// pcs
+	i64 *cycles;
+	int *count;
+	int *back_target;		// target of a backward jump from pc, -1: none
+	int *back_count;
+	unsigned char *leader;		// pc starts a basic block
+	int last_pc;			// last retired, -1: none yet
+	int last_clock;
+} llsim_profile_t;
+
 /*
  * simulated unit
  */
+#define LLSIM_HORIZON_NEVER	0x7fffffff
+
 typedef struct llsim_unit_s {
 	char *name;
 	void (*run) (struct llsim_unit_s *unit);
+	// releases private and whatever else the unit allocated, may be NULL
+	void (*destroy) (struct llsim_unit_s *unit);
+	// idle cycle skipping, see llsim_skip_idle(). NULL: busy every clock
+	int (*horizon) (struct llsim_unit_s *unit);
+	void (*skip) (struct llsim_unit_s *unit, int cycles);
+	// writes the unit's statistics as "name value" lines, may be NULL
+	void (*report) (struct llsim_unit_s *unit, FILE *fp);
 	llsim_unit_registers_t *regs;
+	llsim_unit_state_t *states;
 	void *private;
 	llsim_memory_t *mems;
+	llsim_cache_t *caches;
+	llsim_counter_t *counters;
+	llsim_profile_t *profile;
 	llsim_register_t *registers;
 	llsim_output_t *outputs;
 	llsim_input_t *inputs;
+
+	// host time of the timed clocks, see llsim_host_print()
+	i64 host_run;
+	i64 host_commit;
+	i64 host_trace;
+
 	struct llsim_unit_s *next;
 } llsim_unit_t;
 
@@ -186,9 +367,92 @@ typedef struct llsim_s {
 	llsim_unit_t *units;
 	int clock;
 	int reset;
+	int stop;
+
+	// units without horizon(), cycles skipped while the design was idle
+	int nr_busy_units;
+	int idle_skipped;
+
+	// write a checkpoint when reaching this clock (0: never), continuing
+	// from a checkpoint (no reset)
+	int checkpoint_clock;
+	int restored;
+
+	// sampled simulation, see sample.c: instructions run functionally
+	// between samples and clocks simulated in detail per sample. in a
+	// forked sample sample_clock is the clock it started at, otherwise -1
+	int sample_interval;
+	int sample_window;
+	int sample_clock;
+	int sample_pending;
+	struct llsim_sampler_s *sampler;
+
+	// directory of the output files, NULL for the current directory
+	char *outdir;
+
+	// flattened design, rebuilt by llsim_compile() when units change
+	int compiled;
+	int nr_units;
+	llsim_unit_t **unit_vec;
+	int *unit_mems;			// unit i owns mem_vec[unit_mems[i]..unit_mems[i+1]-1]
+	llsim_memory_t **mem_vec;
+	int nr_copy_regs;
+	llsim_unit_registers_t **copy_regs_vec;
+
+	// cycle trace output format
+	int trace_format;
+#define LLSIM_TRACE_TEXT	0
+#define LLSIM_TRACE_BINARY	1
+
+	// format and write traces from a background thread
+	int trace_async;
+
+	// no instruction and cycle traces at all
+	int no_traces;
+
+	// instructions to execute functionally before detailed simulation
+	int fast_forward;
+
+	// format of memory dumps, one of the IMAGE_* formats
+	int dump_format;
+
+	// DMA engine on a second port of the data memory instead of sharing
+	// the core's, banks of the data memory (0: not banked)
+	int dma_port;
+	int nr_banks;
+
+	// width of the core's data addresses, back memories with huge pages
+	int addr_bits;
+	int huge_pages;
+
+	// format of the performance counters dump, none by default
+	int counters_format;
+#define LLSIM_COUNTERS_NONE	0
+#define LLSIM_COUNTERS_JSON	1
+#define LLSIM_COUNTERS_CSV	2
+
+	// profile the guest code
+	int profile;
+
+	// measure the host time (-T), host_timing: while running
+	int host_time;
+	int host_timing;
+	int host_start_clock;
+	i64 host_start_ns;
+	i64 host_start_ticks;
+	i64 host_copy;
+
+	// instruction and data caches of the core
+	llsim_cache_config_t icache;
+	llsim_cache_config_t dcache;
+
+	// host threads running the units, started by the first clock
+	int nr_threads;
+	struct llsim_pool_s *pool;
 } llsim_t;
 
-llsim_t *llsim;
+// instance the calling thread is running
+extern __thread llsim_t *llsim;
 
 void *llsim_malloc(int len);
 llsim_unit_t *llsim_register_unit(char *name, void (*run) (struct llsim_unit_s *unit));
@@ -200,17 +464,104 @@ void llsim_register_register(char *unit_name, char *reg_name, int bits, int rese
 void llsim_register_wire(char *unit_name, char *wire_name, int bits, void *wirep);
 void llsim_register_output(char *unit_name, char *output_name, int bits, void *oldp, void *newp);
 void llsim_register_input(char *unit_name, char *input_name, int bits, void *oldp, void *newp);
+void llsim_register_state(llsim_unit_t *unit, char *name, void *p, int size);
 void llsim_stop(void);
+void llsim_output_path(char *path, int size, char *name);
+FILE *llsim_fopen(char *name, char *mode);
+llsim_t *llsim_create(char *program_name, char *outdir);
+void llsim_run(llsim_t *sim);
+void llsim_destroy(llsim_t *sim);
+void llsim_simulate(char *program_name);
+void llsim_checkpoint(char *path);
+void llsim_restore(char *path);
+void llsim_sample_request(void);
+void llsim_sample_fork(void);
+void llsim_sample_end(void);
+void llsim_sample_merge(void);
+int llsim_batch(char *manifest, char *outdir, int jobs);
+extern char *llsim_dump_ext[];
 
 /*
  * memories
  */
 llsim_memory_t *llsim_allocate_memory(llsim_unit_t *unit, char *name, int bits, int height, int dp);
+llsim_memory_t *llsim_allocate_banked_memory(llsim_unit_t *unit, char *name, int bits, int height, int dp, int nr_banks);
+int llsim_mem_claim_bank(llsim_memory_t *memory, int addr);
 void llsim_mem_inject(llsim_memory_t *memory, int addr, int val, int msb, int lsb);
 int llsim_mem_extract(llsim_memory_t *memory, int addr, int msb, int lsb);
+void llsim_mem_load(llsim_memory_t *memory, int addr, int *words, int nr_words);
+void llsim_mem_dump(llsim_memory_t *memory, char *name);
 void llsim_mem_set_datain(llsim_memory_t *memory, int val, int msb, int lsb);
 void llsim_mem_write(llsim_memory_t *memory, int addr);
 void llsim_mem_read(llsim_memory_t *memory, int addr);
+void llsim_mem_hold(llsim_memory_t *memory);
 int llsim_mem_extract_dataout(llsim_memory_t *memory, int msb, int lsb);
+void llsim_mem_set_datain_words(llsim_memory_t *memory, int *words);
+void llsim_mem_extract_dataout_words(llsim_memory_t *memory, int *words);
+void llsim_mem_read_port(llsim_memory_t *memory, int port, int addr);
+void llsim_mem_write_port(llsim_memory_t *memory, int port, int addr);
+void llsim_mem_set_datain_port(llsim_memory_t *memory, int port, int val, int msb, int lsb);
+int llsim_mem_extract_dataout_port(llsim_memory_t *memory, int port, int msb, int lsb);
+
+/*
+ * caches
+ */
+int llsim_cache_parse(llsim_cache_config_t *cfg, char *spec);
+llsim_cache_t *llsim_allocate_cache(llsim_unit_t *unit, char *name, llsim_cache_config_t *cfg);
+int llsim_cache_probe(llsim_cache_t *cache, int addr, int write);
+int llsim_cache_access(llsim_cache_t *cache, int addr, int write);
+int llsim_cache_ready(llsim_cache_t *cache, int addr);
+void llsim_cache_skip(llsim_cache_t *cache, int cycles);
+void llsim_cache_print(llsim_cache_t *cache);
+void llsim_cache_report(llsim_cache_t *cache, FILE *fp);
+
+/*
+ * performance counters
+ */
+void llsim_register_counter(llsim_unit_t *unit, char *name, int *p);
+int llsim_read_counter(llsim_unit_t *unit, int index);
+void llsim_counters_dump(void);
+
+/*
+ * guest code profiler
+ */
+llsim_profile_t *llsim_allocate_profile(llsim_unit_t *unit, int size);
+void llsim_profile_retire(llsim_profile_t *prof, int pc);
+void llsim_profile_write(llsim_unit_t *unit, void (*disasm) (llsim_unit_t *unit, int pc, char *buf, int size));
+
+/*
+ * host time, the tsc where there is one, nanoseconds otherwise
+ */
+static inline i64 llsim_host_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * a unit brackets its trace output with these, the time counts as
+ * trace instead of run when the clock is timed:
+ *	t = llsim_host_begin();
+ *	...
+ *	llsim_host_end(&unit->host_trace, t);
+ */
+static inline i64 llsim_host_begin(void)
+{
+	return llsim->host_timing ? llsim_host_ticks() : 0;
+}
+
+static inline void llsim_host_end(i64 *ticks, i64 t)
+{
+	if (t)
+		*ticks += llsim_host_ticks() - t;
+}
+
+void llsim_compile(void);
 void llsim_run_clock(void);
 #endif
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "llsim.h"
+
+/*
+ * guest code profiler (-P)
+ *
+ * the unit tells llsim_profile_retire() the pc of every instruction it
+ * retires. the clocks since the previous retirement go to that pc, so an
+ * instruction is charged with whatever held it up: its fetch and cache
+ * misses, the stalls waiting for its operands, and the refill after a
+ * flush for the first instruction of the new path.
+ *
+ * non sequential flow gives the basic blocks: its target and the word
+ * after its source start one. a jump to the same or a lower pc is a
+ * backward branch, it closes a loop from its target to its source.
+ *
+ * it only counts, no text is traced, llsim_profile_write() puts the
+ * report in profile.txt when the program halts. instructions executed by
+ * the functional fast forward aren't retired and not profiled.
+ */
+llsim_profile_t *llsim_allocate_profile(llsim_unit_t *unit, int size)
+{
+	llsim_profile_t *prof;
+	int i;
+
+	prof = (llsim_profile_t *) llsim_malloc(sizeof(llsim_profile_t));
+	prof->size = size;
+	prof->cycles = (i64 *) llsim_malloc(size * sizeof(i64));
+	prof->count = (int *) llsim_malloc(size * sizeof(int));
+	prof->back_target = (int *) llsim_malloc(size * sizeof(int));
+	prof->back_count = (int *) llsim_malloc(size * sizeof(int));
+	prof->leader = (unsigned char *) llsim_malloc(size);
+	for (i = 0; i < size; i++)
+		prof->back_target[i] = -1;
+	prof->leader[0] = 1;
+	prof->last_pc = -1;
+	unit->profile = prof;
+
+	// checkpoints keep the profile so far
+	llsim_register_state(unit, "profile_cycles", prof->cycles, size * sizeof(i64));
+	llsim_register_state(unit, "profile_count", prof->count, size * sizeof(int));
+	llsim_register_state(unit, "profile_back_target", prof->back_target, size * sizeof(int));
+	llsim_register_state(unit, "profile_back_count", prof->back_count, size * sizeof(int));
+	llsim_register_state(unit, "profile_leader", prof->leader, size);
+	llsim_register_state(unit, "profile_last_pc", &prof->last_pc, sizeof(prof->last_pc));
+	llsim_register_state(unit, "profile_last_clock", &prof->last_clock, sizeof(prof->last_clock));
+
+	return prof;
+}
+
+void llsim_profile_retire(llsim_profile_t *prof, int pc)
+{
+	int last = prof->last_pc;
+
+	if (pc < 0 || pc >= prof->size)
+		return;
+	prof->cycles[pc] += llsim->clock - prof->last_clock;
+	prof->count[pc]++;
+	prof->last_clock = llsim->clock;
+	prof->last_pc = pc;
+	if (last < 0 || pc == last + 1)
+		return;
+
+	prof->leader[pc] = 1;
+	if (last + 1 < prof->size)
+		prof->leader[last + 1] = 1;
+	if (pc <= last) {
+		prof->back_target[last] = pc;
+		prof->back_count[last]++;
+	}
+}
+
+typedef struct llsim_profile_spot_s {
+	int pc;
+	i64 cycles;
+} llsim_profile_spot_t;
+
+static int llsim_profile_cmp(const void *a, const void *b)
+{
+	const llsim_profile_spot_t *x = a, *y = b;
+
+	// most cycles first, lower pcs first among equals
+	if (x->cycles != y->cycles)
+		return x->cycles < y->cycles ? 1 : -1;
+	return x->pc - y->pc;
+}
+
+static double llsim_profile_percent(i64 cycles, i64 total)
+{
+	return total ? 100.0 * cycles / total : 0.0;
+}
+
+/*
+ * end of the basic block starting at pc: before the next leader or the
+ * next word never executed
+ */
+static int llsim_profile_block_end(llsim_profile_t *prof, int pc)
+{
+	while (pc + 1 < prof->size && prof->count[pc + 1] && !prof->leader[pc + 1])
+		pc++;
+	return pc;
+}
+
+#define LLSIM_PROFILE_HOT_SPOTS	20
+
+/*
+ * writes the unit's profile to profile.txt. disasm() puts the instruction
+ * at pc into buf.
+ */
+void llsim_profile_write(llsim_unit_t *unit, void (*disasm) (llsim_unit_t *unit, int pc, char *buf, int size))
+{
+	llsim_profile_t *prof = unit->profile;
+	llsim_profile_spot_t *spots;
+	unsigned char *head;
+	FILE *fp;
+	char buf[128];
+	i64 total = 0, cycles;
+	int nr_spots = 0, instructions = 0, pc, end, i;
+
+	for (pc = 0; pc < prof->size; pc++) {
+		total += prof->cycles[pc];
+		instructions += prof->count[pc];
+		if (prof->count[pc])
+			nr_spots++;
+	}
+	spots = (llsim_profile_spot_t *) llsim_malloc((nr_spots + 1) * sizeof(llsim_profile_spot_t));
+	head = (unsigned char *) llsim_malloc(prof->size);
+	for (pc = 0, i = 0; pc < prof->size; pc++) {
+		if (!prof->count[pc])
+			continue;
+		spots[i].pc = pc;
+		spots[i].cycles = prof->cycles[pc];
+		i++;
+	}
+	qsort(spots, nr_spots, sizeof(llsim_profile_spot_t), llsim_profile_cmp);
+
+	fp = llsim_fopen("profile.txt", "w");
+	fprintf(fp, "profile of %s: %d instructions retired in %lld cycles, cpi %.3f\n",
+		unit->name, instructions, total, instructions ? (double) total / instructions : 0.0);
+
+	fprintf(fp, "\nhot spots:\n");
+	fprintf(fp, "%6s %12s %7s %10s %7s  %s\n", "pc", "cycles", "%", "count", "cpi", "instruction");
+	for (i = 0; i < nr_spots && i < LLSIM_PROFILE_HOT_SPOTS; i++) {
+		pc = spots[i].pc;
+		disasm(unit, pc, buf, sizeof(buf));
+		fprintf(fp, "%6d %12lld %6.2f%% %10d %7.2f  %s\n", pc, prof->cycles[pc],
+			llsim_profile_percent(prof->cycles[pc], total), prof->count[pc],
+			(double) prof->cycles[pc] / prof->count[pc], buf);
+	}
+
+	fprintf(fp, "\nbasic blocks:\n");
+	fprintf(fp, "%6s %6s %10s %12s %7s\n", "start", "end", "count", "cycles", "%");
+	for (pc = 0; pc < prof->size; pc = end + 1) {
+		end = pc;
+		if (!prof->count[pc])
+			continue;
+		end = llsim_profile_block_end(prof, pc);
+		for (cycles = 0, i = pc; i <= end; i++)
+			cycles += prof->cycles[i];
+		fprintf(fp, "%6d %6d %10d %12lld %6.2f%%\n", pc, end, prof->count[pc], cycles,
+			llsim_profile_percent(cycles, total));
+	}
+
+	fprintf(fp, "\nloops:\n");
+	fprintf(fp, "%6s %6s %10s %12s %7s\n", "start", "end", "iterations", "cycles", "%");
+	for (pc = 0; pc < prof->size; pc++) {
+		if (!prof->back_count[pc])
+			continue;
+		head[prof->back_target[pc]] = 1;
+		for (cycles = 0, i = prof->back_target[pc]; i <= pc; i++)
+			cycles += prof->cycles[i];
+		fprintf(fp, "%6d %6d %10d %12lld %6.2f%%\n", prof->back_target[pc], pc, prof->back_count[pc],
+			cycles, llsim_profile_percent(cycles, total));
+	}
+
+	// '>' starts a basic block, '^' is a loop head, '<' jumps back
+	fprintf(fp, "\nannotated disassembly:\n");
+	for (pc = 0; pc < prof->size; pc++) {
+		if (!prof->count[pc])
+			continue;
+		if (pc && !prof->count[pc - 1])
+			fprintf(fp, "%9s\n", "...");
+		disasm(unit, pc, buf, sizeof(buf));
+		fprintf(fp, "%c%c %5d %10d %12lld %6.2f%%  %s", prof->leader[pc] ? '>' : ' ', head[pc] ? '^' : ' ', pc,
+			prof->count[pc], prof->cycles[pc], llsim_profile_percent(prof->cycles[pc], total), buf);
+		if (prof->back_count[pc])
+			fprintf(fp, "  < %d", prof->back_target[pc]);
+		fprintf(fp, "\n");
+	}
+
+	fclose(fp);
+	free(spots);
+	free(head);
+}
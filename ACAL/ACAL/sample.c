@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "llsim.h"
+
+/*
+ * sampled simulation
+ *
+ * with -s interval:window a unit with a functional model (the sp core)
+ * executes interval instructions functionally in one clock and then asks
+ * for a sample with llsim_sample_request(). at the end of that clock the
+ * instance forks: the child shares the whole simulation state copy on
+ * write and continues in detail for window clocks with its outputs in
+ * sample_<clock>/, while the parent goes on with the next chunk. a child
+ * ends by writing sample.txt, the "name value" lines of every unit's
+ * report() callback. when the parent finishes it waits for its children
+ * and merges their reports into samples.txt.
+ *
+ * children are forked at clock boundaries from the thread running the
+ * instance, the unit thread pool stays with the parent.
+ */
+#define LLSIM_SAMPLE_MAX_STATS	64
+
+typedef struct llsim_sample_s {
+	int clock;
+	pid_t pid;
+	int status;
+} llsim_sample_t;
+
+typedef struct llsim_sampler_s {
+	llsim_sample_t *samples;
+	int nr_samples, size;
+	int nr_reaped;		// samples are reaped in fork order
+	int max_running;
+} llsim_sampler_t;
+
+/*
+ * called by a unit during a clock, the fork happens at its end
+ */
+void llsim_sample_request(void)
+{
+	llsim->sample_pending = 1;
+}
+
+static void llsim_sample_reap(llsim_sampler_t *s)
+{
+	llsim_sample_t *sample = &s->samples[s->nr_reaped];
+
+	if (waitpid(sample->pid, &sample->status, 0) < 0) {
+		printf("llsim: wait for sample at clock %d failed\n", sample->clock);
+		exit(1);
+	}
+	s->nr_reaped++;
+}
+
+/*
+ * the child: from now on a detailed run of sample_window clocks
+ */
+static void llsim_sample_child(void)
+{
+	char name[64], path[1024];
+
+	snprintf(name, sizeof(name), "sample_%d", llsim->clock);
+	llsim_output_path(path, sizeof(path), name);
+	if (mkdir(path, 0777) && errno != EEXIST) {
+		printf("couldn't create directory %s\n", path);
+		exit(1);
+	}
+	free(llsim->outdir);
+	llsim->outdir = llsim_malloc(strlen(path) + 1);
+	strcpy(llsim->outdir, path);
+	llsim_output_path(path, sizeof(path), "stdout.txt");
+	if (freopen(path, "w", stdout) == NULL)
+		exit(1);
+	dup2(fileno(stdout), 2);
+
+	// the pool threads weren't forked along, neither are the samples
+	llsim->pool = NULL;
+	llsim->nr_threads = 1;
+	free(llsim->sampler->samples);
+	free(llsim->sampler);
+	llsim->sampler = NULL;
+	llsim->checkpoint_clock = 0;
+	llsim->sample_clock = llsim->clock;
+}
+
+/*
+ * forks off a sample at the current clock
+ */
+void llsim_sample_fork(void)
+{
+	llsim_sampler_t *s = llsim->sampler;
+	pid_t pid;
+
+	llsim->sample_pending = 0;
+	if (s == NULL) {
+		s = llsim->sampler = llsim_malloc(sizeof(llsim_sampler_t));
+		s->max_running = sysconf(_SC_NPROCESSORS_ONLN);
+		if (s->max_running <= 0)
+			s->max_running = 1;
+	}
+	if (s->nr_samples - s->nr_reaped == s->max_running)
+		llsim_sample_reap(s);
+	if (s->nr_samples == s->size) {
+		s->size = s->size ? s->size * 2 : 16;
+		s->samples = realloc(s->samples, s->size * sizeof(llsim_sample_t));
+		llsim_assert(s->samples != NULL, "out of memory");
+	}
+
+	// nothing buffered may be written twice
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		printf("llsim: fork failed\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		llsim_sample_child();
+		return;
+	}
+	s->samples[s->nr_samples].clock = llsim->clock;
+	s->samples[s->nr_samples].pid = pid;
+	s->nr_samples++;
+}
+
+/*
+ * the child's report, at the end of its window
+ */
+void llsim_sample_end(void)
+{
+	llsim_unit_t *unit;
+	FILE *fp;
+
+	fp = llsim_fopen("sample.txt", "w");
+	fprintf(fp, "clocks %d\n", llsim->clock - llsim->sample_clock);
+	for (unit = llsim->units; unit; unit = unit->next)
+		if (unit->report)
+			unit->report(unit, fp);
+	fclose(fp);
+}
+
+/*
+ * waits for all samples and writes samples.txt: one line per sample, then
+ * the sums of every statistic. units report executed instructions as
+ * "instructions", which gives the sampled clocks per instruction.
+ */
+void llsim_sample_merge(void)
+{
+	llsim_sampler_t *s = llsim->sampler;
+	char *names[LLSIM_SAMPLE_MAX_STATS], name[256], buf[1024], path[1024];
+	i64 sums[LLSIM_SAMPLE_MAX_STATS], val, clocks, insts;
+	int nr_names, nr_ok, i, j;
+	FILE *out, *fp;
+
+	while (s->nr_reaped < s->nr_samples)
+		llsim_sample_reap(s);
+
+	out = llsim_fopen("samples.txt", "w");
+	fprintf(out, "# interval %d instructions, window %d clocks\n", llsim->sample_interval, llsim->sample_window);
+	nr_names = nr_ok = 0;
+	for (i = 0; i < s->nr_samples; i++) {
+		fprintf(out, "sample %d clock %d", i, s->samples[i].clock);
+		snprintf(buf, sizeof(buf), "sample_%d/sample.txt", s->samples[i].clock);
+		llsim_output_path(path, sizeof(path), buf);
+		fp = fopen(path, "r");
+		if (!WIFEXITED(s->samples[i].status) || WEXITSTATUS(s->samples[i].status) || fp == NULL) {
+			fprintf(out, " failed\n");
+			if (fp)
+				fclose(fp);
+			continue;
+		}
+		while (fgets(buf, sizeof(buf), fp)) {
+			if (sscanf(buf, "%255s %lld", name, &val) != 2)
+				continue;
+			fprintf(out, " %s %lld", name, val);
+			for (j = 0; j < nr_names; j++)
+				if (strcmp(names[j], name) == 0)
+					break;
+			if (j == nr_names) {
+				if (nr_names == LLSIM_SAMPLE_MAX_STATS)
+					continue;
+				names[j] = llsim_malloc(strlen(name) + 1);
+				strcpy(names[j], name);
+				sums[j] = 0;
+				nr_names++;
+			}
+			sums[j] += val;
+		}
+		fclose(fp);
+		fprintf(out, "\n");
+		nr_ok++;
+	}
+
+	fprintf(out, "total samples %d", nr_ok);
+	clocks = insts = 0;
+	for (j = 0; j < nr_names; j++) {
+		fprintf(out, " %s %lld", names[j], sums[j]);
+		if (strcmp(names[j], "clocks") == 0)
+			clocks = sums[j];
+		if (strcmp(names[j], "instructions") == 0)
+			insts = sums[j];
+		free(names[j]);
+	}
+	fprintf(out, "\n");
+	if (insts)
+		fprintf(out, "cpi %.3f\n", (double) clocks / insts);
+	fclose(out);
+	llsim_printf("llsim: %d of %d samples merged into samples.txt\n", nr_ok, s->nr_samples);
+
+	free(s->samples);
+	free(s);
+	llsim->sampler = NULL;
+}
@@ -8,6 +8,7 @@
 #include <netinet/in.h>
 
 #include "llsim.h"
+#include "image.h"
 
 typedef enum {
 	inst_params_imm = 65535,        // 00000000000000001111111111111111
@@ -25,20 +26,7 @@ typedef enum {
 	inst_params_opcode_shift = 25     // 00111110000000000000000000000000
 }inst_params_shift;
 
-//DMA hardware
-int dma_regs[5]; //registers serving the DMA functionality
-bool read_into_reg3 = true;	//if false, read into reg4
-bool write_reg3 = true;  //if false, write reg4's data
-bool dma_opcode_received = false;
-
-// 3 bit control state machine of DMA
-int ctl_dma_state;
-
-//DMA functions
-void perform_dma_logic(bool mem_available, sp_t *sp);
-void init_dma_logic(int source, int dest, int amount);
-
-// control states
+// DMA control states
 #define NO_READ_WRITE		0
 #define ONE_READ_NO_WRITE	1
 #define ONE_READ_ONE_WRITE	2
@@ -59,13 +47,12 @@ void init_dma_logic(int source, int dest, int amount);
 
 #define sp_printf(a...)						\
 	do {							\
-		llsim_printf("sp: clock %d: ", llsim->clock);	\
-		llsim_printf(a);				\
+		if (llsim_log_enabled(LLSIM_LOG_UNIT)) {	\
+			llsim_printf("sp: clock %d: ", llsim->clock);	\
+			llsim_printf(a);			\
+		}						\
 	} while (0)
 
-int nr_simulated_instructions = 0;
-FILE *inst_trace_fp = NULL, *cycle_trace_fp = NULL;
-
 typedef struct sp_registers_s {
 	// 6 32 bit registers (r[0], r[1] don't exist)
 	int r[8];
@@ -120,18 +107,54 @@ typedef struct sp_registers_s {
  * Master structure
  */
 typedef struct sp_s {
-	// local sram
+	// local sram of 1 << llsim->addr_bits words, programs live in its
+	// first SP_SRAM_HEIGHT words (the pc is 16 bits)
 #define SP_SRAM_HEIGHT	64 * 1024
 	llsim_memory_t *sram;
 
-	unsigned int memory_image[SP_SRAM_HEIGHT];
-	int memory_image_size;
+	// instruction and data caches in front of it, NULL: none
+	llsim_cache_t *icache, *dcache;
 
 	sp_registers_t *spro, *sprn;
 	
 	int start;
+
+	// instructions to execute functionally before detailed simulation
+	int fast_forward;
+	struct sp_decode_s *decode;
+
+	int nr_simulated_instructions;
+	FILE *inst_trace_fp, *cycle_trace_fp;
+
+	// sampled simulation: running functionally, instructions at the start
+	// of the sample window
+	int sampling;
+	int sample_instructions;
+
+	// performance counters, CNT reads them by number: 0 cycles,
+	// 1 instructions (nr_simulated_instructions), 2 branches, 3 branches
+	// taken, 4 detailed_instructions. cycles and detailed_instructions
+	// only count detailed simulation, the fast-forward counts the others
+	llsim_unit_t *unit;
+	struct sp_counters_s {
+		int cycles;
+		int branches;
+		int branches_taken;
+		int detailed_instructions;
+	} counters;
+
+	// DMA hardware
+	int dma_regs[5];		// registers serving the DMA functionality
+	bool read_into_reg3;		// if false, read into reg4
+	bool write_reg3;		// if false, write reg4's data
+	bool dma_opcode_received;
+	int ctl_dma_state;		// 3 bit control state machine of DMA
 } sp_t;
 
+//DMA functions
+void perform_dma_logic(bool mem_available, sp_t *sp);
+void init_dma_logic(sp_t *sp, int source, int dest, int amount);
+
 static void sp_reset(sp_t *sp)
 {
 	sp_registers_t *sprn = sp->sprn;
@@ -159,70 +182,330 @@ static void sp_reset(sp_t *sp)
 #define JIN 20
 #define DMA 21
 #define POL 22
+#define CNT 23
 #define HLT 24
 
 static char opcode_name[32][4] = {"ADD", "SUB", "LSF", "RSF", "AND", "OR", "XOR", "LHI",
 				 "LD", "ST", "U", "U", "U", "U", "U", "U",
-				 "JLT", "JLE", "JEQ", "JNE", "JIN", "U", "U", "U",
+				 "JLT", "JLE", "JEQ", "JNE", "JIN", "U", "U", "CNT",
 				 "HLT", "U", "U", "U", "U", "U", "U", "U"};
 
-static void dump_sram(sp_t *sp)
+/*
+ * the instruction at pc, for the profile
+ */
+static void sp_disasm(llsim_unit_t *unit, int pc, char *buf, int size)
 {
-	FILE *fp;
-	int i;
+	sp_t *sp = (sp_t *) unit->private;
+	int inst = llsim_mem_extract(sp->sram, pc, 31, 0);
+	int opcode = (inst & inst_params_opcode) >> inst_params_opcode_shift;
+
+	snprintf(buf, size, "%-3s %d, %d, %d, %d", opcode_name[opcode],
+		 (inst & inst_params_dst) >> inst_params_dst_shift,
+		 (inst & inst_params_src0) >> inst_params_src0_shift,
+		 (inst & inst_params_src1) >> inst_params_src1_shift,
+		 (short) (inst & inst_params_imm));
+}
 
-	fp = fopen("sram_out.txt", "w");
-	if (fp == NULL) {
-                printf("couldn't open file sram_out.txt\n");
-                exit(1);
-	}
+
+/*
+ * pre-decoded instruction cache of the functional simulator, one entry per
+ * sram word kept as a struct of arrays. handler[] is the interpreter label
+ * of the decoded instruction, or the decode label for words that weren't
+ * decoded yet or were written since. the operand pointers point either at
+ * the register file or at immediate[]. [lo, hi) is the decoded range, only
+ * stores into it invalidate entries.
+ */
+typedef struct sp_decode_s {
+	void *handler[SP_SRAM_HEIGHT];
+	int *alu0[SP_SRAM_HEIGHT];
+	int *alu1[SP_SRAM_HEIGHT];
+	int *rd[SP_SRAM_HEIGHT];
+	int immediate[SP_SRAM_HEIGHT];
+	int inst[SP_SRAM_HEIGHT];
+	unsigned char opcode[SP_SRAM_HEIGHT];
+	unsigned char dst[SP_SRAM_HEIGHT];
+	unsigned char src0[SP_SRAM_HEIGHT];
+	unsigned char src1[SP_SRAM_HEIGHT];
+	int lo, hi;
+} sp_decode_t;
+
+/*
+ * ends an instruction of the threaded interpreter: moves on to target and
+ * jumps straight to the handler of the next instruction
+ */
+#define sp_ff_next(target)						\
+	do {								\
+		last = pc;						\
+		pc = (target);						\
+		if (++n == count)					\
+			goto out;					\
+		llsim_assert((unsigned) pc < SP_SRAM_HEIGHT,		\
+			     "fast forward: pc %d out of range\n", pc);	\
+		goto *d->handler[pc];					\
+	} while (0)
+
+#define sp_ff_operands()						\
+	do {								\
+		alu0 = *d->alu0[pc];					\
+		alu1 = *d->alu1[pc];					\
+	} while (0)
+
+/*
+ * functional fast-forward: executes up to count instructions directly over
+ * the sram data array, starting at sprn->pc with the register file of spro.
+ * instructions are decoded once into sp->decode and dispatched with
+ * computed gotos. the resulting architectural state (r[], pc, memory) and
+ * the registers of the last instruction are handed to the detailed model
+ * in FETCH0 exactly as if every instruction had taken its 6 clocks. branches
+ * are counted on the way. stops in front of HLT so the detailed model ends
+ * the simulation. returns the number executed.
+ */
+static int sp_fast_forward(sp_t *sp, int count)
+{
+	static void *op_handler[32] = {
+		&&op_add, &&op_sub, &&op_lsf, &&op_rsf,
+		&&op_and, &&op_or, &&op_xor, &&op_lhi,
+		&&op_ld, &&op_st, &&op_nop, &&op_nop,
+		&&op_nop, &&op_nop, &&op_nop, &&op_nop,
+		&&op_jlt, &&op_jle, &&op_jeq, &&op_jne,
+		&&op_jin, &&op_dma, &&op_nop, &&op_cnt,
+		&&op_hlt, &&op_nop, &&op_nop, &&op_nop,
+		&&op_nop, &&op_nop, &&op_nop, &&op_nop,
+	};
+	sp_registers_t s = *sp->spro;
+	sp_decode_t *d = sp->decode;
+	int *mem = sp->sram->data, height = sp->sram->height;
+	int r[8], pc, last, alu0, alu1, aluout, inst, n, i;
+
+	if (d == NULL)
+		d = sp->decode = llsim_malloc(sizeof(sp_decode_t));
+
+	// operand pointers refer to this invocation's register file
 	for (i = 0; i < SP_SRAM_HEIGHT; i++)
-		fprintf(fp, "%08x\n", llsim_mem_extract(sp->sram, i, 31, 0));
-	fclose(fp);
+		d->handler[i] = &&decode;
+	d->lo = SP_SRAM_HEIGHT;
+	d->hi = 0;
+
+	memcpy(r, s.r, sizeof(r));
+	alu0 = s.alu0;
+	alu1 = s.alu1;
+	aluout = s.aluout;
+	pc = sp->sprn->pc;
+	last = -1;
+	n = 0;
+	if (count <= 0)
+		goto out;
+	llsim_assert((unsigned) pc < SP_SRAM_HEIGHT, "fast forward: pc %d out of range\n", pc);
+	goto *d->handler[pc];
+
+decode:
+	inst = mem[pc];
+	d->inst[pc] = inst;
+	d->opcode[pc] = (inst & inst_params_opcode) >> inst_params_opcode_shift;
+	d->immediate[pc] = (short) (inst & inst_params_imm);
+	d->src1[pc] = (inst & inst_params_src1) >> inst_params_src1_shift;
+	d->src0[pc] = (inst & inst_params_src0) >> inst_params_src0_shift;
+	d->dst[pc] = (inst & inst_params_dst) >> inst_params_dst_shift;
+	d->alu0[pc] = (d->src0[pc] == 1) ? &d->immediate[pc] : &r[d->src0[pc]];
+	d->alu1[pc] = (d->src1[pc] == 1) ? &d->immediate[pc] : &r[d->src1[pc]];
+	d->rd[pc] = &r[d->dst[pc]];
+	d->handler[pc] = op_handler[d->opcode[pc]];
+	if (pc < d->lo)
+		d->lo = pc;
+	if (pc >= d->hi)
+		d->hi = pc + 1;
+	goto *d->handler[pc];
+
+op_add:
+	sp_ff_operands();
+	aluout = alu0 + alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_sub:
+	sp_ff_operands();
+	aluout = alu0 - alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_lsf:
+	sp_ff_operands();
+	aluout = alu0 << alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_rsf:
+	sp_ff_operands();
+	aluout = alu0 >> alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_and:
+	sp_ff_operands();
+	aluout = alu0 & alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_or:
+	sp_ff_operands();
+	aluout = alu0 | alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_xor:
+	sp_ff_operands();
+	aluout = alu0 ^ alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_lhi:
+	sp_ff_operands();
+	if (d->dst[pc] > 1)
+		aluout = alu0 & (d->immediate[pc]) << 16;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_cnt:
+	sp_ff_operands();
+	// instructions count the ones executed so far too
+	sp->nr_simulated_instructions += n;
+	aluout = llsim_read_counter(sp->unit, alu1);
+	sp->nr_simulated_instructions -= n;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_ld:
+	sp_ff_operands();
+	if (d->dst[pc] > 1)
+		*d->rd[pc] = ((unsigned) alu1 < height) ? mem[alu1] : 0xBAADBAAD;
+	sp_ff_next(pc + 1);
+op_st:
+	sp_ff_operands();
+	if ((unsigned) alu1 < height) {
+		mem[alu1] = alu0;
+		llsim_mem_dirty(sp->sram, alu1);
+		if (alu1 >= d->lo && alu1 < d->hi)
+			d->handler[alu1] = &&decode;
+	}
+	sp_ff_next(pc + 1);
+op_jlt:
+	sp_ff_operands();
+	aluout = alu0 < alu1;
+	goto branch;
+op_jle:
+	sp_ff_operands();
+	aluout = alu0 <= alu1;
+	goto branch;
+op_jeq:
+	sp_ff_operands();
+	aluout = alu0 == alu1;
+	goto branch;
+op_jne:
+	sp_ff_operands();
+	aluout = alu0 != alu1;
+branch:
+	sp->counters.branches++;
+	sp->counters.branches_taken += aluout;
+	goto jump;
+op_jin:
+	sp_ff_operands();
+	if (alu0 < SP_SRAM_HEIGHT)
+		aluout = 1;
+jump:
+	if (aluout) {
+		r[7] = pc;
+		sp_ff_next(d->immediate[pc]);
+	}
+	sp_ff_next(pc + 1);
+op_dma:
+	// the dma unit isn't clocked by this core, only its registers are set
+	init_dma_logic(sp, r[d->src0[pc]], r[d->src1[pc]], d->immediate[pc]);
+	sp_ff_next(pc + 1);
+op_nop:
+	sp_ff_operands();
+	sp_ff_next(pc + 1);
+op_hlt:
+out:
+	if (last >= 0) {
+		s.inst = d->inst[last];
+		s.opcode = d->opcode[last];
+		s.dst = d->dst[last];
+		s.src0 = d->src0[last];
+		s.src1 = d->src1[last];
+		s.immediate = d->immediate[last];
+	}
+	memcpy(s.r, r, sizeof(r));
+	s.alu0 = alu0;
+	s.alu1 = alu1;
+	s.aluout = aluout;
+	s.pc = pc;
+	s.cycle_counter = sp->sprn->cycle_counter + 6 * n;
+	s.ctl_state = CTL_STATE_FETCH0;
+	*sp->sprn = s;
+	sp->nr_simulated_instructions += n;
+	return n;
 }
 
+static void sp_trace_cycle(sp_t *sp)
+{
+	sp_registers_t *spro = sp->spro;
+	int i;
+
+	fprintf(sp->cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
+	for (i = 2; i <= 7; i++)
+		fprintf(sp->cycle_trace_fp, "r%d %08x\n", i, spro->r[i]);
+	fprintf(sp->cycle_trace_fp, "pc %08x\n", spro->pc);
+	fprintf(sp->cycle_trace_fp, "inst %08x\n", spro->inst);
+	fprintf(sp->cycle_trace_fp, "opcode %08x\n", spro->opcode);
+	fprintf(sp->cycle_trace_fp, "dst %08x\n", spro->dst);
+	fprintf(sp->cycle_trace_fp, "src0 %08x\n", spro->src0);
+	fprintf(sp->cycle_trace_fp, "src1 %08x\n", spro->src1);
+	fprintf(sp->cycle_trace_fp, "immediate %08x\n", spro->immediate);
+	fprintf(sp->cycle_trace_fp, "alu0 %08x\n", spro->alu0);
+	fprintf(sp->cycle_trace_fp, "alu1 %08x\n", spro->alu1);
+	fprintf(sp->cycle_trace_fp, "aluout %08x\n", spro->aluout);
+	fprintf(sp->cycle_trace_fp, "cycle_counter %08x\n", spro->cycle_counter);
+	fprintf(sp->cycle_trace_fp, "ctl_state %08x\n\n", spro->ctl_state);
+}
 
 static void sp_ctl(sp_t *sp)
 {
 	sp_registers_t *spro = sp->spro;
 	sp_registers_t *sprn = sp->sprn;
+	i64 t;
 	int i;
 
 	// sp_ctl
 
-	fprintf(cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
-	for (i = 2; i <= 7; i++)
-		fprintf(cycle_trace_fp, "r%d %08x\n", i, spro->r[i]);
-	fprintf(cycle_trace_fp, "pc %08x\n", spro->pc);
-	fprintf(cycle_trace_fp, "inst %08x\n", spro->inst);
-	fprintf(cycle_trace_fp, "opcode %08x\n", spro->opcode);
-	fprintf(cycle_trace_fp, "dst %08x\n", spro->dst);
-	fprintf(cycle_trace_fp, "src0 %08x\n", spro->src0);
-	fprintf(cycle_trace_fp, "src1 %08x\n", spro->src1);
-	fprintf(cycle_trace_fp, "immediate %08x\n", spro->immediate);
-	fprintf(cycle_trace_fp, "alu0 %08x\n", spro->alu0);
-	fprintf(cycle_trace_fp, "alu1 %08x\n", spro->alu1);
-	fprintf(cycle_trace_fp, "aluout %08x\n", spro->aluout);
-	fprintf(cycle_trace_fp, "cycle_counter %08x\n", spro->cycle_counter);
-	fprintf(cycle_trace_fp, "ctl_state %08x\n\n", spro->ctl_state);
+	if (sp->cycle_trace_fp) {
+		t = llsim_host_begin();
+		sp_trace_cycle(sp);
+		llsim_host_end(&sp->unit->host_trace, t);
+	}
 
 	sprn->cycle_counter = spro->cycle_counter + 1;
+	sp->counters.cycles++;
 
 	switch (spro->ctl_state) {
 	case CTL_STATE_IDLE:
 		sprn->pc = 0;
 		if (sp->start)
 			sprn->ctl_state = CTL_STATE_FETCH0;
+		if (sp->start && sp->fast_forward) {
+			i = sp_fast_forward(sp, sp->fast_forward);
+			sp_printf("fast forward: %d instructions executed functionally\n", i);
+			sp->fast_forward = 0;
+		}
 		break;
 
 	case CTL_STATE_FETCH0:
+		// wait in FETCH0 for an instruction cache miss
+		if (sp->icache && !llsim_cache_access(sp->icache, spro->pc, 0))
+			break;
+
 		//Trace first line in inst_trace
-		print_line1(inst_trace_fp, nr_simulated_instructions, spro->pc);
+		if (sp->inst_trace_fp) {
+			t = llsim_host_begin();
+			print_line1(sp->inst_trace_fp, sp->nr_simulated_instructions, spro->pc);
+			llsim_host_end(&sp->unit->host_trace, t);
+		}
 
 		llsim_mem_read(sp->sram, spro->pc);
 		sprn->ctl_state = CTL_STATE_FETCH1;
 		sprn->pc = (spro->pc);
-		nr_simulated_instructions++;
+		sp->nr_simulated_instructions++;
+		sp->counters.detailed_instructions++;
 		break;
 
 	case CTL_STATE_FETCH1:
@@ -246,9 +529,13 @@ static void sp_ctl(sp_t *sp)
 	case CTL_STATE_DEC1:
 		if (sprn->opcode != DMA)
 		{
-			print_line2(inst_trace_fp, sp->spro);
-			print_line3(inst_trace_fp, sp->spro);
-			print_line4(inst_trace_fp, sp->spro);
+			if (sp->inst_trace_fp) {
+				t = llsim_host_begin();
+				print_line2(sp->inst_trace_fp, sp->spro);
+				print_line3(sp->inst_trace_fp, sp->spro);
+				print_line4(sp->inst_trace_fp, sp->spro);
+				llsim_host_end(&sp->unit->host_trace, t);
+			}
 			if (spro->src0 == 1)
 			{
 				sprn->alu0 = spro->immediate;
@@ -269,7 +556,7 @@ static void sp_ctl(sp_t *sp)
 		}
 		else
 		{
-			init_dma_logic(spro->r[spro->src0], spro->r[spro->src1], spro->immediate);
+			init_dma_logic(sp, spro->r[spro->src0], spro->r[spro->src1], spro->immediate);
 		}
 
 		sprn->ctl_state = CTL_STATE_EXEC0; 
@@ -279,6 +566,11 @@ static void sp_ctl(sp_t *sp)
 
 	case CTL_STATE_EXEC0:
 	//in this step we change the pc to the pc of the next instruction(pc++ or with jump instruction)
+		// loads and stores wait in EXEC0 for a data cache miss
+		if (sp->dcache && (spro->opcode == LD || spro->opcode == ST) && spro->alu1 < sp->sram->height &&
+		    !llsim_cache_access(sp->dcache, spro->alu1, spro->opcode == ST))
+			break;
+
 	switch (spro->opcode)
 	{
 		case ADD:
@@ -319,7 +611,7 @@ static void sp_ctl(sp_t *sp)
 			break;
 
 		case LD:
-			if (spro->alu1 < SP_SRAM_HEIGHT)
+			if (spro->alu1 < sp->sram->height)
 			{
 				llsim_mem_read(sp->sram, spro->alu1);
 			}
@@ -354,6 +646,15 @@ static void sp_ctl(sp_t *sp)
 			}
 			break;
 
+		case CNT:
+			// counted at fetch, the instructions read the ones before this one
+			sp->nr_simulated_instructions--;
+			sp->counters.detailed_instructions--;
+			sprn->aluout = llsim_read_counter(sp->unit, spro->alu1);
+			sp->nr_simulated_instructions++;
+			sp->counters.detailed_instructions++;
+			break;
+
 		case HLT:
 			break;
 	}
@@ -363,6 +664,8 @@ static void sp_ctl(sp_t *sp)
 		break;
 
 	case CTL_STATE_EXEC1:
+		if (sp->unit->profile)
+			llsim_profile_retire(sp->unit->profile, spro->pc);
 		switch (spro->opcode)
 		{
 			case ADD:
@@ -373,6 +676,7 @@ static void sp_ctl(sp_t *sp)
 			case OR:
 			case XOR:
 			case LHI:
+			case CNT:
 				sprn->r[spro->dst] = spro->aluout;
 				break;
 
@@ -387,7 +691,7 @@ static void sp_ctl(sp_t *sp)
 
 			case ST:
 				// now we start the write
-				if (spro->alu1 < SP_SRAM_HEIGHT)
+				if (spro->alu1 < sp->sram->height)
 				{
 					llsim_mem_set_datain(sp->sram, spro->alu0, 31, 0);
 					llsim_mem_write(sp->sram, spro->alu1);
@@ -399,6 +703,11 @@ static void sp_ctl(sp_t *sp)
 			case JEQ:
 			case JNE:
 			case JIN:
+				if (spro->opcode != JIN)
+				{
+					sp->counters.branches++;
+					sp->counters.branches_taken += spro->aluout;
+				}
 				if (spro->aluout)
 				{
 					sprn->r[7] = spro->pc;
@@ -406,18 +715,32 @@ static void sp_ctl(sp_t *sp)
 				}
 				break;
 			case HLT:
-				dump_sram(sp);
+				llsim_mem_dump(sp->sram, "sram_out");
+				if (sp->icache)
+					llsim_cache_print(sp->icache);
+				if (sp->dcache)
+					llsim_cache_print(sp->dcache);
+				llsim_counters_dump();
+				if (sp->unit->profile)
+					llsim_profile_write(sp->unit, sp_disasm);
 				llsim_stop();
 				break;
 		}
 		sprn->pc++;
-		print_line5(inst_trace_fp, sp);
+		if (sp->inst_trace_fp) {
+			t = llsim_host_begin();
+			print_line5(sp->inst_trace_fp, sp);
+			llsim_host_end(&sp->unit->host_trace, t);
+		}
 		if (spro->opcode == HLT)
 		{
 			sprn->ctl_state = CTL_STATE_IDLE;
-			end_trace(inst_trace_fp, nr_simulated_instructions-1, sp->spro->pc-1);
-			fclose(inst_trace_fp);
-			fclose(cycle_trace_fp);
+			if (sp->inst_trace_fp) {
+				end_trace(sp->inst_trace_fp, sp->nr_simulated_instructions-1, sp->spro->pc-1);
+				fclose(sp->inst_trace_fp);
+				fclose(sp->cycle_trace_fp);
+				sp->inst_trace_fp = sp->cycle_trace_fp = NULL;
+			}
 		}
 		else
 		{
@@ -427,6 +750,108 @@ static void sp_ctl(sp_t *sp)
 	}
 }
 
+/*
+ * the cache FETCH0 or EXEC0 asks before accessing sram at *addr, NULL when
+ * the state doesn't access sram through a cache
+ */
+static llsim_cache_t *sp_cache_user(sp_t *sp, int *addr)
+{
+	sp_registers_t *spro = sp->spro;
+
+	if (spro->ctl_state == CTL_STATE_FETCH0 && sp->icache) {
+		*addr = spro->pc;
+		return sp->icache;
+	}
+	if (spro->ctl_state == CTL_STATE_EXEC0 && sp->dcache && (spro->opcode == LD || spro->opcode == ST) &&
+	    spro->alu1 < sp->sram->height) {
+		*addr = spro->alu1;
+		return sp->dcache;
+	}
+	return NULL;
+}
+
+/*
+ * idle cycle skipping: waiting in FETCH0 or EXEC0 for a cache fill only
+ * counts cycles until the line arrives
+ */
+static int sp_horizon(llsim_unit_t *unit)
+{
+	sp_t *sp = (sp_t *) unit->private;
+	llsim_cache_t *cache;
+	int addr;
+
+	cache = sp_cache_user(sp, &addr);
+	if (sp->sampling || cache == NULL)
+		return llsim->clock;
+	return llsim_cache_ready(cache, addr);
+}
+
+static void sp_skip(llsim_unit_t *unit, int cycles)
+{
+	sp_t *sp = (sp_t *) unit->private;
+	int addr, i;
+
+	llsim_cache_skip(sp_cache_user(sp, &addr), cycles);
+	for (i = 0; i < cycles; i++) {
+		if (sp->cycle_trace_fp)
+			sp_trace_cycle(sp);
+		sp->spro->cycle_counter++;
+	}
+	sp->sprn->cycle_counter = sp->spro->cycle_counter;
+	sp->counters.cycles += cycles;
+}
+
+/*
+ * sampled simulation: a clock of the parent executes a chunk of
+ * instructions functionally and has a sample forked off after it. once HLT
+ * is ahead the parent finishes in detail.
+ */
+static void sp_sample(sp_t *sp)
+{
+	int count, n;
+
+	count = sp->fast_forward ? sp->fast_forward : llsim->sample_interval;
+	sp->fast_forward = 0;
+	n = sp_fast_forward(sp, count);
+	if (n == count)
+		llsim_sample_request();
+	else
+		sp->sampling = 0;
+}
+
+/*
+ * the instruction and cycle traces, none with -n
+ */
+static void sp_open_traces(sp_t *sp)
+{
+	if (llsim->no_traces)
+		return;
+	sp->inst_trace_fp = llsim_fopen("inst_trace.txt", "w");
+	sp->cycle_trace_fp = llsim_fopen("cycle_trace.txt", "w");
+}
+
+/*
+ * first clock of a forked sample. the parent's trace files stay with the
+ * parent, the sample writes its own
+ */
+static void sp_sample_start(sp_t *sp)
+{
+	sp_open_traces(sp);
+	sp->sample_instructions = sp->nr_simulated_instructions;
+	sp->sampling = 0;
+}
+
+static void sp_report(llsim_unit_t *unit, FILE *fp)
+{
+	sp_t *sp = (sp_t *) unit->private;
+
+	fprintf(fp, "instructions %d\n", sp->nr_simulated_instructions - sp->sample_instructions);
+	if (sp->icache)
+		llsim_cache_report(sp->icache, fp);
+	if (sp->dcache)
+		llsim_cache_report(sp->dcache, fp);
+}
+
 static void sp_run(llsim_unit_t *unit)
 {
 	sp_t *sp = (sp_t *) unit->private;
@@ -439,32 +864,26 @@ static void sp_run(llsim_unit_t *unit)
 	sp->sram->read = 0;
 	sp->sram->write = 0;
 
+	if (sp->sampling) {
+		if (llsim->sample_clock < 0) {
+			sp_sample(sp);
+			return;
+		}
+		sp_sample_start(sp);
+	}
+
 	sp_ctl(sp);
 }
 
 static void sp_generate_sram_memory_image(sp_t *sp, char *program_name)
 {
-        FILE *fp;
-        int addr, i;
-
-        fp = fopen(program_name, "r");
-        if (fp == NULL) {
-                printf("couldn't open file %s\n", program_name);
-                exit(1);
-        }
-        addr = 0;
-        while (addr < SP_SRAM_HEIGHT) {
-                fscanf(fp, "%08x\n", &sp->memory_image[addr]);
-                addr++;
-                if (feof(fp))
-                        break;
-        }
-	sp->memory_image_size = addr;
-
-        fprintf(inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, addr);
-
-	for (i = 0; i < sp->memory_image_size; i++)
-		llsim_mem_inject(sp->sram, i, sp->memory_image[i], 31, 0);
+	image_t *image;
+
+	image = image_open(program_name, SP_SRAM_HEIGHT);
+	if (sp->inst_trace_fp)
+		fprintf(sp->inst_trace_fp, "program %s loaded, %d lines\n\n", program_name, image->nr_words);
+	llsim_mem_load(sp->sram, 0, image->words, image->nr_words);
+	image_close(image);
 }
 
 static void sp_register_all_registers(sp_t *sp)
@@ -495,6 +914,21 @@ static void sp_register_all_registers(sp_t *sp)
 	llsim_register_register("sp", "ctl_state", 3, 0, &spro->ctl_state, &sprn->ctl_state);
 }
 
+static void sp_destroy(llsim_unit_t *unit)
+{
+	sp_t *sp = (sp_t *) unit->private;
+
+	// still open when the simulation didn't reach HLT
+	if (sp->inst_trace_fp)
+		fclose(sp->inst_trace_fp);
+	if (sp->cycle_trace_fp)
+		fclose(sp->cycle_trace_fp);
+	free(sp->decode);
+	free(sp);
+}
+
+char *sp_options = "";	// no trace.c, DMA port or banks on this core
+
 void sp_init(char *program_name)
 {
 	llsim_unit_t *llsim_sp_unit;
@@ -503,38 +937,63 @@ void sp_init(char *program_name)
 
 	llsim_printf("initializing sp unit\n");
 
-	inst_trace_fp = fopen("inst_trace.txt", "w");
-	if (inst_trace_fp == NULL) {
-		printf("couldn't open file inst_trace.txt\n");
-		exit(1);
-	}
-
-	cycle_trace_fp = fopen("cycle_trace.txt", "w");
-	if (cycle_trace_fp == NULL) {
-		printf("couldn't open file cycle_trace.txt\n");
-		exit(1);
-	}
-
 	llsim_sp_unit = llsim_register_unit("sp", sp_run);
+	llsim_sp_unit->destroy = sp_destroy;
+	llsim_sp_unit->report = sp_report;
 	llsim_ur = llsim_allocate_registers(llsim_sp_unit, "sp_registers", sizeof(sp_registers_t));
 	sp = llsim_malloc(sizeof(sp_t));
 	llsim_sp_unit->private = sp;
+	sp->unit = llsim_sp_unit;
 	sp->spro = llsim_ur->old;
 	sp->sprn = llsim_ur->new;
 
-	sp->sram = llsim_allocate_memory(llsim_sp_unit, "sram", 32, SP_SRAM_HEIGHT, 0);
+	sp_open_traces(sp);
+
+	sp->sram = llsim_allocate_memory(llsim_sp_unit, "sram", 32, 1 << llsim->addr_bits, 0);
 	sp_generate_sram_memory_image(sp, program_name);
+	if (llsim->icache.size)
+		sp->icache = llsim_allocate_cache(llsim_sp_unit, "icache", &llsim->icache);
+	if (llsim->dcache.size)
+		sp->dcache = llsim_allocate_cache(llsim_sp_unit, "dcache", &llsim->dcache);
+	if (sp->icache || sp->dcache) {
+		// clocks stalled on a cache fill are skipped
+		llsim_sp_unit->horizon = sp_horizon;
+		llsim_sp_unit->skip = sp_skip;
+	}
+	if (llsim->profile)
+		llsim_allocate_profile(llsim_sp_unit, SP_SRAM_HEIGHT);
 
 	sp->start = 1;
+	sp->fast_forward = llsim->fast_forward;
+	sp->read_into_reg3 = true;
+	sp->write_reg3 = true;
+	sp->sampling = llsim->sample_interval > 0;
+
+	// kept in checkpoints with the registers and memories
+	llsim_register_state(llsim_sp_unit, "start", &sp->start, sizeof(sp->start));
+	llsim_register_state(llsim_sp_unit, "fast_forward", &sp->fast_forward, sizeof(sp->fast_forward));
+	llsim_register_state(llsim_sp_unit, "nr_simulated_instructions", &sp->nr_simulated_instructions, sizeof(sp->nr_simulated_instructions));
+	llsim_register_state(llsim_sp_unit, "dma_regs", sp->dma_regs, sizeof(sp->dma_regs));
+	llsim_register_state(llsim_sp_unit, "read_into_reg3", &sp->read_into_reg3, sizeof(sp->read_into_reg3));
+	llsim_register_state(llsim_sp_unit, "write_reg3", &sp->write_reg3, sizeof(sp->write_reg3));
+	llsim_register_state(llsim_sp_unit, "dma_opcode_received", &sp->dma_opcode_received, sizeof(sp->dma_opcode_received));
+	llsim_register_state(llsim_sp_unit, "ctl_dma_state", &sp->ctl_dma_state, sizeof(sp->ctl_dma_state));
+	llsim_register_state(llsim_sp_unit, "counters", &sp->counters, sizeof(sp->counters));
+
+	llsim_register_counter(llsim_sp_unit, "cycles", &sp->counters.cycles);
+	llsim_register_counter(llsim_sp_unit, "instructions", &sp->nr_simulated_instructions);
+	llsim_register_counter(llsim_sp_unit, "branches", &sp->counters.branches);
+	llsim_register_counter(llsim_sp_unit, "branches_taken", &sp->counters.branches_taken);
+	llsim_register_counter(llsim_sp_unit, "detailed_instructions", &sp->counters.detailed_instructions);
 
 	sp_register_all_registers(sp);
 }
 
-void init_dma_logic(int source, int dest, int amount)	//TODO add registers to cycle trace
+void init_dma_logic(sp_t *sp, int source, int dest, int amount)	//TODO add registers to cycle trace
 {
-	dma_regs[0] = source;
-	dma_regs[1] = dest;
-	dma_regs[2] = amount;
+	sp->dma_regs[0] = source;
+	sp->dma_regs[1] = dest;
+	sp->dma_regs[2] = amount;
 }
 /*
 TODO:
@@ -547,88 +1006,88 @@ amount decreases only once value is inserted to register from loading
 
 void perform_dma_logic(bool mem_available, sp_t *sp)
 {
-	switch (ctl_dma_state)
+	switch (sp->ctl_dma_state)
 	{
 	case(NO_READ_WRITE):
-		if (dma_regs[2] == 0)
+		if (sp->dma_regs[2] == 0)
 		{
-			dma_opcode_received = false;
-			ctl_dma_state = DMA_IDLE_STATE;
+			sp->dma_opcode_received = false;
+			sp->ctl_dma_state = DMA_IDLE_STATE;
 		}
 
 		else if (mem_available)
 		{
-			llsim_mem_read(sp->sram, dma_regs[0]);
-			dma_regs[0]++;
-			ctl_dma_state = ONE_READ_NO_WRITE;
+			llsim_mem_read(sp->sram, sp->dma_regs[0]);
+			sp->dma_regs[0]++;
+			sp->ctl_dma_state = ONE_READ_NO_WRITE;
 		}
 		else
 		{
-			ctl_dma_state = NO_READ_WRITE;
+			sp->ctl_dma_state = NO_READ_WRITE;
 		}
 		break;
 
 	case(ONE_READ_NO_WRITE):
-		if (read_into_reg3)
+		if (sp->read_into_reg3)
 		{
-			dma_regs[3] = llsim_mem_extract_dataout(sp->sram, dma_regs[0], 31, 0);
+			sp->dma_regs[3] = llsim_mem_extract_dataout(sp->sram, 31, 0);
 		}
 		else
 		{
-			dma_regs[4] = llsim_mem_extract_dataout(sp->sram, dma_regs[0], 31, 0);
+			sp->dma_regs[4] = llsim_mem_extract_dataout(sp->sram, 31, 0);
 		}
-		read_into_reg3 = !read_into_reg3; //next, data will be loaded to other register
-		dma_regs[2]--;
+		sp->read_into_reg3 = !sp->read_into_reg3; //next, data will be loaded to other register
+		sp->dma_regs[2]--;
 
-		if (dma_regs[2] == 0)
+		if (sp->dma_regs[2] == 0)
 		{
-			ctl_dma_state = ONE_WRITE_READY;
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 		else if (mem_available)
 		{
-			llsim_mem_read(sp->sram, dma_regs[0]);
-			dma_regs[0]++;
-			ctl_dma_state = ONE_READ_ONE_WRITE;
+			llsim_mem_read(sp->sram, sp->dma_regs[0]);
+			sp->dma_regs[0]++;
+			sp->ctl_dma_state = ONE_READ_ONE_WRITE;
 		}
 		else
 		{
-			ctl_dma_state = ONE_WRITE_READY;
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 
 		break;
 
 	case(ONE_READ_ONE_WRITE):
-		if (read_into_reg3)
+		if (sp->read_into_reg3)
 		{
-			dma_regs[3] = llsim_mem_extract_dataout(sp->sram, dma_regs[0], 31, 0);
+			sp->dma_regs[3] = llsim_mem_extract_dataout(sp->sram, 31, 0);
 		}
 		else
 		{
-			dma_regs[4] = llsim_mem_extract_dataout(sp->sram, dma_regs[0], 31, 0);
+			sp->dma_regs[4] = llsim_mem_extract_dataout(sp->sram, 31, 0);
 		}
-		read_into_reg3 = !read_into_reg3; //next, data will be loaded to other register
-		dma_regs[2]--;
+		sp->read_into_reg3 = !sp->read_into_reg3; //next, data will be loaded to other register
+		sp->dma_regs[2]--;
 
 		if (mem_available)
 		{
 			int temp_reg; //simulate mux choosing which register to write
-			if (write_reg3)
+			if (sp->write_reg3)
 			{
-				temp_reg = dma_regs[3];
+				temp_reg = sp->dma_regs[3];
 			}
 			else
 			{
-				temp_reg = dma_regs[4];
+				temp_reg = sp->dma_regs[4];
 			}
-			llsim_mem_write(sp->sram, dma_regs[1]);
+			llsim_mem_write(sp->sram, sp->dma_regs[1]);
 			llsim_mem_set_datain(sp->sram, temp_reg, 31, 0);
-			dma_regs[1]++;
-			write_reg3 = !write_reg3; //next, data will be loaded to other register
-			ctl_dma_state = ONE_WRITE_READY;
+			sp->dma_regs[1]++;
+			sp->write_reg3 = !sp->write_reg3; //next, data will be loaded to other register
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 		else
 		{
-			ctl_dma_state = TWO_WRITE_READY;
+			sp->ctl_dma_state = TWO_WRITE_READY;
 		}
 		break;
 
@@ -636,52 +1095,52 @@ void perform_dma_logic(bool mem_available, sp_t *sp)
 		if (mem_available)
 		{
 			int temp_reg; //simulate mux choosing which register to write
-			if (write_reg3)
+			if (sp->write_reg3)
 			{
-				temp_reg = dma_regs[3];
+				temp_reg = sp->dma_regs[3];
 			}
 			else
 			{
-				temp_reg = dma_regs[4];
+				temp_reg = sp->dma_regs[4];
 			}
-			llsim_mem_write(sp->sram, dma_regs[1]);
+			llsim_mem_write(sp->sram, sp->dma_regs[1]);
 			llsim_mem_set_datain(sp->sram, temp_reg, 31, 0);
-			dma_regs[1]++;
-			write_reg3 = !write_reg3; //next, data will be loaded to other register
-			ctl_dma_state = ONE_WRITE_READY;
+			sp->dma_regs[1]++;
+			sp->write_reg3 = !sp->write_reg3; //next, data will be loaded to other register
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 		else
 		{
-			ctl_dma_state = TWO_WRITE_READY;
+			sp->ctl_dma_state = TWO_WRITE_READY;
 		}
 		break;
 	case(ONE_WRITE_READY):
 		if (mem_available)
 		{
 			int temp_reg; //simulate mux choosing which register to write
-			if (write_reg3)
+			if (sp->write_reg3)
 			{
-				temp_reg = dma_regs[3];
+				temp_reg = sp->dma_regs[3];
 			}
 			else
 			{
-				temp_reg = dma_regs[4];
+				temp_reg = sp->dma_regs[4];
 			}
-			llsim_mem_write(sp->sram, dma_regs[1]);
+			llsim_mem_write(sp->sram, sp->dma_regs[1]);
 			llsim_mem_set_datain(sp->sram, temp_reg, 31, 0);
-			dma_regs[1]++;
-			write_reg3 = !write_reg3; //next, data will be loaded to other register
-			ctl_dma_state = ONE_WRITE_READY;
+			sp->dma_regs[1]++;
+			sp->write_reg3 = !sp->write_reg3; //next, data will be loaded to other register
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 		else
 		{
-			ctl_dma_state = ONE_WRITE_READY;
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 		break;
 	case(DMA_IDLE_STATE):
-		if (dma_opcode_received)
+		if (sp->dma_opcode_received)
 		{
-			ctl_dma_state = NO_READ_WRITE; //TODO check values are ok
+			sp->ctl_dma_state = NO_READ_WRITE; //TODO check values are ok
 		}
 		break;
 
@@ -893,6 +1352,16 @@ int print_line5(FILE* file, sp_t* sp)//, inst_trace* inst_cmd)
 		);
 		break;
 
+	case CNT:
+		check_ret = sprintf(line_to_print,
+			">>>> EXEC: R[%d] = %s[%d] = %d <<<<\n\n",
+			sp->spro->dst,
+			opcode_name[sp->spro->opcode],
+			sp->spro->alu1,
+			sp->spro->aluout
+		);
+		break;
+
 	case HLT:
 		check_ret = sprintf(line_to_print,
 			">>>> EXEC: HALT at PC %04x <<<<\n",
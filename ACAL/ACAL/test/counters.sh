@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# the functional fast-forward against detailed runs, run by make test from
+# ACAL/ACAL
+#
+# runs programs on the multicycle core (ACAL) and the pipelined one
+# (ACAL_lab5) in detail and again with -f n or -s, and checks that DMA
+# programs leave the same memory and the counters.json (-S json):
+# - branches are architectural, the same as in the detailed run
+# - instructions count the fast-forwarded ones too, detailed_instructions
+#   don't: with -f n they differ by n, by less when the fast-forward
+#   stopped at a DMA transfer
+# - CNT of instructions reads the ones before it, whatever the core and
+#   the options: test/cnt.bin stores what it read at 1000 on
+# - ipc is detailed_instructions per cycle
+#
+TOP=$PWD
+OUT=test/out
+
+CORES="acal:$TOP/llsim lab5:$TOP/../../ACAL_lab5/ACAL_lab5/llsim"
+# program, then the runs to check against its detailed run
+CASES="mult_table.bin:-f_100:-f_2000:-s_500:100 hw2_dma_submission_files/dma.bin:-f_10:-f_20:-s_4:2 test/cnt.bin:-f_1:-f_8:-s_4:2"
+# programs whose memory dumps are checked, the pipelined core's load-use
+# hazard already changes mult_table.bin's results in detail
+SAME_MEMORY="hw2_dma_submission_files/dma.bin test/cnt.bin"
+# the counters test/cnt.bin reads: instructions at pc 0, 1 and 7, branches
+CNT_VALUES="00000000 00000001 0000000b 00000003"
+
+status=0
+
+fail()
+{
+	echo "test: $*"
+	status=1
+}
+
+# value of counter $2 in counters.json of directory $1
+counter()
+{
+	sed -n "s/^[[:space:]]*\"$2\": \([0-9.]*\).*/\1/p" $1/counters.json
+}
+
+# runs $2 with the options $3 (_ for space) into directory $1
+run()
+{
+	rm -rf $1
+	mkdir -p $1
+	(cd $1 && $sim -q -n -S json $(echo $3 | tr _ ' ') $TOP/$2 > stdout.txt)
+	if [ ! -f $1/counters.json ]; then
+		fail "$1: no counters.json"
+		return 1
+	fi
+}
+
+rm -rf $OUT
+for core in $CORES; do
+	name=${core%%:*}
+	sim=${core#*:}
+	for case in $CASES; do
+		prog=${case%%:*}
+		runs=$(echo ${case#*:} | sed 's/:-/ -/g')
+		base=$OUT/$name/$(basename $prog .bin)
+		run $base-detailed $prog "" || continue
+		if [ $prog = test/cnt.bin ]; then
+			values=$(cat $base-detailed/sram_out.txt $base-detailed/sramd_out.txt 2>/dev/null |
+				sed -n 1001,1004p | tr '\n' ' ')
+			[ "$values" = "$CNT_VALUES " ] ||
+				fail "$base-detailed: CNT read $values, not $CNT_VALUES"
+		fi
+		branches=$(counter $base-detailed branches)
+		for opts in $runs; do
+			dir=$base$(echo $opts | tr -c 'a-z0-9\n' _)
+			run $dir $prog $opts || continue
+			cycles=$(counter $dir cycles)
+			instructions=$(counter $dir instructions)
+			detailed=$(counter $dir detailed_instructions)
+			ipc=$(awk -v i=$detailed -v c=$cycles 'BEGIN { printf("%.3f", i / c) }')
+			[ "$(counter $dir branches)" = "$branches" ] ||
+				fail "$dir: branches $(counter $dir branches), detailed run $branches"
+			[ "$(counter $dir ipc)" = "$ipc" ] ||
+				fail "$dir: ipc $(counter $dir ipc), $detailed instructions in $cycles cycles"
+			case $opts in
+			-f_*)
+				n=${opts#-f_}
+				[ $((instructions - detailed)) -eq $n ] ||
+					[ $((instructions - detailed)) -lt $n -a $(counter $dir dma_words) -gt 0 ] ||
+					fail "$dir: $instructions instructions, $detailed in detail"
+				;;
+			esac
+			case " $SAME_MEMORY " in
+			*" $prog "*)
+				for out in $base-detailed/*_out.txt; do
+					cmp -s $out $dir/${out##*/} ||
+						fail "$dir: ${out##*/} differs from the detailed run"
+				done
+				;;
+			esac
+		done
+	done
+done
+
+[ $status = 0 ] && echo "test: counters ok"
+exit $status
@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "llsim.h"
+
+/*
+ * checkpoints
+ *
+ * a checkpoint holds the full state of the current instance between two
+ * clocks: the clock, and for every unit its register blocks (old and new),
+ * its private state blocks (llsim_register_state()) and its memories. of a
+ * memory only the dirty pages are written. all numbers are host ints:
+ *
+ *	header		magic, version, clock, idle_skipped, nr_units
+ *	unit		name, nr_regs, { name, size, old, new } ...
+ *			nr_states, { name, size, data } ...
+ *			nr_mems, { name, bits, height, entry_size, nr_ports,
+ *				   { dataout, datain } per port, reads, writes,
+ *				   nr_pages, dirty[], words of every dirty page } ...
+ *	trailer		magic
+ *
+ * strings are a length followed by the characters. units are written in
+ * list order, a checkpoint can only be restored into an instance of the
+ * same design, which is checked name by name.
+ */
+#define LLSIM_CKPT_MAGIC	0x4b43534c	// "LSCK"
+#define LLSIM_CKPT_VERSION	4
+
+typedef struct llsim_ckpt_s {
+	FILE *fp;
+	char *path;
+} llsim_ckpt_t;
+
+static void ckpt_write(llsim_ckpt_t *ck, void *p, int len)
+{
+	if (len && fwrite(p, 1, len, ck->fp) != len) {
+		printf("llsim: couldn't write checkpoint %s\n", ck->path);
+		exit(1);
+	}
+}
+
+static void ckpt_write_int(llsim_ckpt_t *ck, int val)
+{
+	ckpt_write(ck, &val, sizeof(int));
+}
+
+static void ckpt_write_str(llsim_ckpt_t *ck, char *s)
+{
+	ckpt_write_int(ck, strlen(s));
+	ckpt_write(ck, s, strlen(s));
+}
+
+static void ckpt_read(llsim_ckpt_t *ck, void *p, int len)
+{
+	if (len && fread(p, 1, len, ck->fp) != len) {
+		printf("llsim: checkpoint %s is truncated\n", ck->path);
+		exit(1);
+	}
+}
+
+static int ckpt_read_int(llsim_ckpt_t *ck)
+{
+	int val;
+
+	ckpt_read(ck, &val, sizeof(int));
+	return val;
+}
+
+/*
+ * reads a string and checks it is the expected one
+ */
+static void ckpt_expect_str(llsim_ckpt_t *ck, char *what, char *expected)
+{
+	char buf[256];
+	int len;
+
+	len = ckpt_read_int(ck);
+	if (len < 0 || len >= sizeof(buf)) {
+		printf("llsim: checkpoint %s is corrupt\n", ck->path);
+		exit(1);
+	}
+	ckpt_read(ck, buf, len);
+	buf[len] = 0;
+	if (strcmp(buf, expected)) {
+		printf("llsim: checkpoint %s doesn't match the design: %s %s instead of %s\n",
+		       ck->path, what, buf, expected);
+		exit(1);
+	}
+}
+
+static void ckpt_expect_int(llsim_ckpt_t *ck, char *what, char *name, int expected)
+{
+	int val;
+
+	val = ckpt_read_int(ck);
+	if (val != expected) {
+		printf("llsim: checkpoint %s doesn't match the design: %s of %s is %d instead of %d\n",
+		       ck->path, what, name, val, expected);
+		exit(1);
+	}
+}
+
+static void ckpt_write_mem(llsim_ckpt_t *ck, llsim_memory_t *mem)
+{
+	int page_words, i, n;
+
+	ckpt_write_str(ck, mem->name);
+	ckpt_write_int(ck, mem->bits);
+	ckpt_write_int(ck, mem->height);
+	ckpt_write_int(ck, mem->entry_size);
+	ckpt_write_int(ck, mem->nr_ports);
+	ckpt_write(ck, mem->dataout, mem->entry_size * sizeof(int));
+	ckpt_write(ck, mem->datain, mem->entry_size * sizeof(int));
+	for (i = 0; i < mem->nr_ports - 1; i++) {
+		ckpt_write(ck, mem->ports[i].dataout, mem->entry_size * sizeof(int));
+		ckpt_write(ck, mem->ports[i].datain, mem->entry_size * sizeof(int));
+	}
+	ckpt_write_int(ck, mem->reads);
+	ckpt_write_int(ck, mem->writes);
+	ckpt_write_int(ck, mem->nr_pages);
+	ckpt_write(ck, mem->dirty, mem->nr_pages);
+
+	page_words = (1 << LLSIM_MEM_PAGE_SHIFT) * mem->entry_size;
+	for (i = 0; i < mem->nr_pages; i++) {
+		if (!mem->dirty[i])
+			continue;
+		// the last page may be partial
+		n = mem->height * mem->entry_size - i * page_words;
+		if (n > page_words)
+			n = page_words;
+		ckpt_write(ck, mem->data + i * page_words, n * sizeof(int));
+	}
+}
+
+static void ckpt_read_mem(llsim_ckpt_t *ck, llsim_memory_t *mem)
+{
+	int page_words, i, n;
+
+	ckpt_expect_str(ck, "memory", mem->name);
+	ckpt_expect_int(ck, "bits", mem->name, mem->bits);
+	ckpt_expect_int(ck, "height", mem->name, mem->height);
+	ckpt_expect_int(ck, "entry size", mem->name, mem->entry_size);
+	ckpt_expect_int(ck, "ports", mem->name, mem->nr_ports);
+	ckpt_read(ck, mem->dataout, mem->entry_size * sizeof(int));
+	ckpt_read(ck, mem->datain, mem->entry_size * sizeof(int));
+	for (i = 0; i < mem->nr_ports - 1; i++) {
+		ckpt_read(ck, mem->ports[i].dataout, mem->entry_size * sizeof(int));
+		ckpt_read(ck, mem->ports[i].datain, mem->entry_size * sizeof(int));
+		mem->ports[i].read = mem->ports[i].write = 0;
+	}
+	mem->reads = ckpt_read_int(ck);
+	mem->writes = ckpt_read_int(ck);
+	ckpt_expect_int(ck, "pages", mem->name, mem->nr_pages);
+
+	// only pages written so far hold anything but zeros, the others
+	// mustn't be touched
+	page_words = (1 << LLSIM_MEM_PAGE_SHIFT) * mem->entry_size;
+	for (i = 0; i < mem->nr_pages; i++) {
+		if (!mem->dirty[i])
+			continue;
+		n = mem->height * mem->entry_size - i * page_words;
+		if (n > page_words)
+			n = page_words;
+		memset(mem->data + i * page_words, 0, n * sizeof(int));
+	}
+	ckpt_read(ck, mem->dirty, mem->nr_pages);
+
+	for (i = 0; i < mem->nr_pages; i++) {
+		if (!mem->dirty[i])
+			continue;
+		n = mem->height * mem->entry_size - i * page_words;
+		if (n > page_words)
+			n = page_words;
+		ckpt_read(ck, mem->data + i * page_words, n * sizeof(int));
+	}
+	mem->read = mem->write = 0;
+}
+
+/*
+ * writes the state of the current instance to path
+ */
+void llsim_checkpoint(char *path)
+{
+	llsim_unit_t *unit;
+	llsim_unit_registers_t *ur;
+	llsim_unit_state_t *st;
+	llsim_memory_t *mem;
+	llsim_ckpt_t ck;
+	int n;
+
+	ck.path = path;
+	ck.fp = fopen(path, "wb");
+	if (ck.fp == NULL) {
+		printf("couldn't open file %s\n", path);
+		exit(1);
+	}
+
+	n = 0;
+	for (unit = llsim->units; unit; unit = unit->next)
+		n++;
+	ckpt_write_int(&ck, LLSIM_CKPT_MAGIC);
+	ckpt_write_int(&ck, LLSIM_CKPT_VERSION);
+	ckpt_write_int(&ck, llsim->clock);
+	ckpt_write_int(&ck, llsim->idle_skipped);
+	ckpt_write_int(&ck, n);
+
+	for (unit = llsim->units; unit; unit = unit->next) {
+		ckpt_write_str(&ck, unit->name);
+
+		for (n = 0, ur = unit->regs; ur; ur = ur->next)
+			n++;
+		ckpt_write_int(&ck, n);
+		for (ur = unit->regs; ur; ur = ur->next) {
+			ckpt_write_str(&ck, ur->name);
+			ckpt_write_int(&ck, ur->size);
+			ckpt_write(&ck, ur->old, ur->size);
+			ckpt_write(&ck, ur->new, ur->size);
+		}
+
+		for (n = 0, st = unit->states; st; st = st->next)
+			n++;
+		ckpt_write_int(&ck, n);
+		for (st = unit->states; st; st = st->next) {
+			ckpt_write_str(&ck, st->name);
+			ckpt_write_int(&ck, st->size);
+			ckpt_write(&ck, st->p, st->size);
+		}
+
+		for (n = 0, mem = unit->mems; mem; mem = mem->next)
+			n++;
+		ckpt_write_int(&ck, n);
+		for (mem = unit->mems; mem; mem = mem->next)
+			ckpt_write_mem(&ck, mem);
+	}
+	ckpt_write_int(&ck, LLSIM_CKPT_MAGIC);
+
+	if (fclose(ck.fp)) {
+		printf("llsim: couldn't write checkpoint %s\n", path);
+		exit(1);
+	}
+	llsim_printf("llsim: clock %d: checkpoint written to %s\n", llsim->clock, path);
+}
+
+/*
+ * loads a checkpoint into the current instance, which must have been
+ * created for the same design. llsim_run() then continues at the
+ * checkpoint's clock without a reset.
+ */
+void llsim_restore(char *path)
+{
+	llsim_unit_t *unit;
+	llsim_unit_registers_t *ur;
+	llsim_unit_state_t *st;
+	llsim_memory_t *mem;
+	llsim_ckpt_t ck;
+	int n, version;
+
+	ck.path = path;
+	ck.fp = fopen(path, "rb");
+	if (ck.fp == NULL) {
+		printf("couldn't open file %s\n", path);
+		exit(1);
+	}
+
+	if (ckpt_read_int(&ck) != LLSIM_CKPT_MAGIC) {
+		printf("llsim: %s isn't a checkpoint\n", path);
+		exit(1);
+	}
+	version = ckpt_read_int(&ck);
+	if (version != LLSIM_CKPT_VERSION) {
+		printf("llsim: checkpoint %s has unsupported version %d\n", path, version);
+		exit(1);
+	}
+	llsim->clock = ckpt_read_int(&ck);
+	llsim->idle_skipped = ckpt_read_int(&ck);
+	for (n = 0, unit = llsim->units; unit; unit = unit->next)
+		n++;
+	ckpt_expect_int(&ck, "number of units", "design", n);
+
+	for (unit = llsim->units; unit; unit = unit->next) {
+		ckpt_expect_str(&ck, "unit", unit->name);
+
+		for (n = 0, ur = unit->regs; ur; ur = ur->next)
+			n++;
+		ckpt_expect_int(&ck, "register blocks", unit->name, n);
+		for (ur = unit->regs; ur; ur = ur->next) {
+			ckpt_expect_str(&ck, "register block", ur->name);
+			ckpt_expect_int(&ck, "size", ur->name, ur->size);
+			ckpt_read(&ck, ur->old, ur->size);
+			ckpt_read(&ck, ur->new, ur->size);
+		}
+
+		for (n = 0, st = unit->states; st; st = st->next)
+			n++;
+		ckpt_expect_int(&ck, "state blocks", unit->name, n);
+		for (st = unit->states; st; st = st->next) {
+			ckpt_expect_str(&ck, "state block", st->name);
+			ckpt_expect_int(&ck, "size", st->name, st->size);
+			ckpt_read(&ck, st->p, st->size);
+		}
+
+		for (n = 0, mem = unit->mems; mem; mem = mem->next)
+			n++;
+		ckpt_expect_int(&ck, "memories", unit->name, n);
+		for (mem = unit->mems; mem; mem = mem->next)
+			ckpt_read_mem(&ck, mem);
+	}
+	if (ckpt_read_int(&ck) != LLSIM_CKPT_MAGIC) {
+		printf("llsim: checkpoint %s is corrupt\n", path);
+		exit(1);
+	}
+	fclose(ck.fp);
+
+	llsim->reset = 0;
+	llsim->restored = 1;
+	llsim_printf("llsim: clock %d: checkpoint %s restored\n", llsim->clock, path);
+}
@@ -0,0 +1,42 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+/*
+ * program images and memory dumps
+ *
+ * the formats are told apart by looking at the file:
+ * - hex text, one 32 bit word per line ("%08x\n"), as written by the
+ *   assembler and the legacy sram dumps
+ * - binary, raw little-endian 32 bit words
+ * - sparse, "@sparse height" then one "addr value" line per non zero word
+ * - rle, "@rle height" then "value count" runs
+ *
+ * image_open() mmaps the file. binary images are used in place, so loading
+ * a memory is a single copy out of the page cache. the text formats are
+ * parsed once into a word array.
+ */
+#define IMAGE_TEXT	0
+#define IMAGE_BINARY	1
+#define IMAGE_SPARSE	2
+#define IMAGE_RLE	3
+#define IMAGE_NR_FORMATS	4
+
+extern char *image_format_names[IMAGE_NR_FORMATS];
+
+typedef struct image_s {
+	int format;
+	int nr_words;
+	int *words;
+
+	// private
+	void *map;
+	int map_len;
+	int *buf;
+} image_t;
+
+image_t *image_open(char *path, int max_words);
+void image_close(image_t *image);
+void image_write(char *path, int format, int *words, int nr_words);
+void image_write_pages(char *path, int format, int *words, int nr_words, unsigned char *dirty, int page_shift);
+int image_parse_format(char *name);
+#endif
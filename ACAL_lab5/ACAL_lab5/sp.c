@@ -7,15 +7,24 @@
 #include <netinet/in.h>
 #include <stdbool.h>
 #include "llsim.h"
+#include "trace.h"
+#include "image.h"
 
 #define sp_printf(a...)						\
 	do {							\
-		llsim_printf("sp: clock %d: ", llsim->clock);	\
-		llsim_printf(a);				\
+		if (llsim_log_enabled(LLSIM_LOG_UNIT)) {	\
+			llsim_printf("sp: clock %d: ", llsim->clock);	\
+			llsim_printf(a);			\
+		}						\
 	} while (0)
 
-int nr_simulated_instructions = 0;
-FILE *inst_trace_fp = NULL, *cycle_trace_fp = NULL;
+#define dma_printf(a...)					\
+	do {							\
+		if (llsim_log_enabled(LLSIM_LOG_DMA)) {		\
+			llsim_printf("dma: clock %d: ", llsim->clock);	\
+			llsim_printf(a);			\
+		}						\
+	} while (0)
 
 typedef struct sp_registers_s {
 	// 6 32 bit registers (r[0], r[1] don't exist)
@@ -78,18 +87,79 @@ typedef struct sp_registers_s {
  * Master structure
  */
 typedef struct sp_s {
-	// local srams
+	// local srams: SP_SRAM_HEIGHT words of program (the pc is 16 bits)
+	// and 1 << llsim->addr_bits words of data
 #define SP_SRAM_HEIGHT	64 * 1024
 	llsim_memory_t *srami, *sramd;
 
-	unsigned int memory_image[SP_SRAM_HEIGHT];
-	int memory_image_size;
+	// instruction and data caches in front of them, NULL: none
+	llsim_cache_t *icache, *dcache;
 
 	int start;
 
+	// instructions to execute functionally before detailed simulation
+	int fast_forward;
+	struct sp_decode_s *decode;
+
 	sp_registers_t *spro, *sprn;
+
+	int nr_simulated_instructions;
+	FILE *inst_trace_fp;
+	trace_t *inst_trace, *cycle_trace;
+
+	// sampled simulation: running functionally, instructions at the start
+	// of the sample window
+	int sampling;
+	int sample_instructions;
+
+	// performance counters, CNT reads them by number: 0 cycles,
+	// 1 instructions (nr_simulated_instructions), 2 branches, 3
+	// mispredictions, 4 flushes, 5 raw_stalls, 6 dma_words, 7 dma_stalls,
+	// 8 detailed_instructions. instructions and branches count the
+	// fast-forward too, the others only detailed simulation
+	llsim_unit_t *unit;
+	struct sp_counters_s {
+		int cycles;
+		int branches;
+		int mispredictions;
+		int flushes;		// branches squashing fetched instructions
+		int raw_stalls;		// clocks with a RAW hazard stalling decode
+		int dma_words;
+		int dma_stalls;		// clocks the DMA engine waited for sramd
+		int detailed_instructions;
+	} counters;
+
+	// DMA hardware
+	int dma_regs[5];		// registers serving the DMA functionality
+	bool read_into_reg3;		// if false, read into reg4
+	bool write_reg3;		// if false, write reg4's data
+	bool dma_opcode_received;
+	int ctl_dma_state;		// 3 bit control state machine of DMA
+	bool mem_available;
+
+	// 2 bit jump predictors
+	int jump_predictors[40];
+
+	int data_extracted;
+	int raw_hazard;
+	int pc_of_last_inst_executed;
+	int inst_fetched;
 } sp_t;
 
+/*
+ * inst trace record, formatted by the trace writer
+ */
+typedef struct inst_record_s {
+	int kind;
+#define INST_RECORD_EXEC	0
+#define INST_RECORD_END		1
+	int cnt;
+	int pc;
+	sp_registers_t spro, sprn;
+} inst_record_t;
+
+#define INST_RECORD_SIZE	((sizeof(inst_record_t) + sizeof(int) - 1) / sizeof(int))
+
 static void sp_reset(sp_t *sp)
 {
 	sp_registers_t *sprn = sp->sprn;
@@ -117,18 +187,10 @@ static void sp_reset(sp_t *sp)
 #define JIN 20
 #define DMA 21
 #define POL 22
+#define CNT 23
 #define HLT 24
 
- //DMA hardware
-int dma_regs[5]; //registers serving the DMA functionality
-bool read_into_reg3 = true;	//if false, read into reg4
-bool write_reg3 = true;  //if false, write reg4's data
-bool dma_opcode_received = false;
-
-// 3 bit control state machine of DMA
-int ctl_dma_state;
-
-// control states
+// DMA control states
 #define NO_READ_WRITE		0
 #define ONE_READ_NO_WRITE	1
 #define ONE_READ_ONE_WRITE	2
@@ -136,31 +198,13 @@ int ctl_dma_state;
 #define ONE_WRITE_READY		4
 #define DMA_IDLE_STATE		5
 
-//jump predictors
-int jump_predictors[40];
-
 
 
 static char opcode_name[32][4] = {"ADD", "SUB", "LSF", "RSF", "AND", "OR", "XOR", "LHI",
 				 "LD", "ST", "U", "U", "U", "U", "U", "U",
-				 "JLT", "JLE", "JEQ", "JNE", "JIN", "DMA", "POL", "U",
+				 "JLT", "JLE", "JEQ", "JNE", "JIN", "DMA", "POL", "CNT",
 				 "HLT", "U", "U", "U", "U", "U", "U", "U"};
 
-static void dump_sram(sp_t *sp, char *name, llsim_memory_t *sram)
-{
-	FILE *fp;
-	int i;
-
-	fp = fopen(name, "w");
-	if (fp == NULL) {
-                printf("couldn't open file %s\n", name);
-                exit(1);
-	}
-	for (i = 0; i < SP_SRAM_HEIGHT; i++)
-		fprintf(fp, "%08x\n", llsim_mem_extract(sram, i, 31, 0));
-	fclose(fp);
-}
-
 #define R0 (0)
 #define NUM_OF_REGS (8)
 #define MAX_STR_LEN (1024)
@@ -186,90 +230,196 @@ typedef enum {
 	inst_params_opcode_shift = 25     // 00111110000000000000000000000000
 }inst_params_shift;
 
-bool mem_available = true;
-int data_extracted = 0;
-int raw_hazard = 0;
-int pc_of_last_inst_executed = -1;
-int inst_fetched = 0;
+/*
+ * the instruction at pc, for the profile
+ */
+static void sp_disasm(llsim_unit_t *unit, int pc, char *buf, int size)
+{
+	sp_t *sp = (sp_t *) unit->private;
+	int inst = llsim_mem_extract(sp->srami, pc, 31, 0);
+	int opcode = (inst & inst_params_opcode) >> inst_params_opcode_shift;
+
+	snprintf(buf, size, "%-3s %d, %d, %d, %d", opcode_name[opcode],
+		 (inst & inst_params_dst) >> inst_params_dst_shift,
+		 (inst & inst_params_src0) >> inst_params_src0_shift,
+		 (inst & inst_params_src1) >> inst_params_src1_shift,
+		 (short) (inst & inst_params_imm));
+}
+
 //Functions we use for instruction traces
 int end_trace(FILE* file, int cnt, int pc);
 int print_line1(FILE* file, int cnt_of_inst, int pc_of_inst);
 int print_line2(FILE* file, sp_registers_t* inst_regs);
 int print_line3(FILE* file, sp_registers_t* inst_regs);
 int print_line4(FILE* file, sp_registers_t* inst_regs);
-int print_line5(FILE* file, sp_t* sp);
+int print_line5(FILE* file, sp_registers_t* spro, sp_registers_t* sprn);
 void print_all_lines(sp_t* sp, int pc_of_inst, int nr_sim_inst);
-void init_dma_logic(int source, int dest, int amount);
-void perform_dma_logic(bool mem_available, sp_t* sp);
-int predict_jump(int current_pc);
+void print_end_trace(sp_t *sp, int cnt, int pc);
+static void write_inst_records(trace_t *trace, int *recs, int count);
+void init_dma_logic(sp_t *sp, int source, int dest, int amount);
+void perform_dma_logic(sp_t *sp);
+int predict_jump(sp_t *sp, int current_pc);
 bool validate_dma_values(int source, int dest, int amount);
 
 
+/*
+ * cycle trace fields, in cycle_trace.txt order
+ */
+static char *cycle_trace_names[] = {
+	"cycle_counter", "r2", "r3", "r4", "r5", "r6", "r7", "raw_hazard",
+	"fetch0_active", "fetch0_pc", "fetch1_active", "fetch1_pc",
+	"dec0_active", "dec0_pc", "dec0_inst",
+	"dec1_active", "dec1_pc", "dec1_inst", "dec1_opcode", "dec1_src0", "dec1_src1", "dec1_dst", "dec1_immediate",
+	"exec0_active", "exec0_pc", "exec0_inst", "exec0_opcode", "exec0_src0", "exec0_src1", "exec0_dst", "exec0_immediate",
+	"exec0_alu0", "exec0_alu1",
+	"exec1_active", "exec1_pc", "exec1_inst", "exec1_opcode", "exec1_src0", "exec1_src1", "exec1_dst", "exec1_immediate",
+	"exec1_alu0", "exec1_alu1", "exec1_aluout",
+	"mem_available", "ctl_dma_state", "dma_opcode_received",
+	"dma_regs[0]", "dma_regs[1]", "dma_regs[2]", "dma_regs[3]", "dma_regs[4]"};
+
+#define CYCLE_TRACE_NFIELDS	(sizeof(cycle_trace_names) / sizeof(cycle_trace_names[0]))
+
+/*
+ * snapshot the pipeline registers and the DMA state into the cycle trace
+ */
+static void sp_trace_cycle(sp_t *sp)
+{
+	sp_registers_t *spro = sp->spro;
+	int *rec = trace_next(sp->cycle_trace);
+	int n = 0;
+
+	rec[n++] = spro->cycle_counter;
+	memcpy(&rec[n], &spro->r[2], 6 * sizeof(int));
+	n += 6;
+	rec[n++] = sp->raw_hazard;
+	// fetch0_active .. exec1_aluout are laid out in trace order
+	memcpy(&rec[n], &spro->fetch0_active, (&spro->exec1_aluout - &spro->fetch0_active + 1) * sizeof(int));
+	n += &spro->exec1_aluout - &spro->fetch0_active + 1;
+	rec[n++] = sp->mem_available;
+	rec[n++] = sp->ctl_dma_state;
+	rec[n++] = sp->dma_opcode_received;
+	memcpy(&rec[n], sp->dma_regs, 5 * sizeof(int));
+	trace_commit(sp->cycle_trace);
+}
+
+/*
+ * the cache accesses of this clock: fetch0's read of srami and exec0's
+ * access of sramd. returns their number.
+ */
+static int sp_cache_accesses(sp_t *sp, llsim_cache_t **cache, int *addr, int *write)
+{
+	sp_registers_t *spro = sp->spro;
+	int n = 0;
+
+	if (sp->icache && spro->fetch0_active && sp->raw_hazard == 0) {
+		cache[n] = sp->icache;
+		addr[n] = spro->fetch0_pc;
+		write[n++] = 0;
+	}
+	if (sp->dcache && spro->exec0_active &&
+	    ((spro->exec0_opcode == LD && spro->exec0_alu1 < sp->sramd->height) || spro->exec0_opcode == ST)) {
+		cache[n] = sp->dcache;
+		addr[n] = spro->exec0_alu1;
+		write[n++] = spro->exec0_opcode == ST;
+	}
+	return n;
+}
+
+/*
+ * when either access misses the whole pipeline stalls: nothing moves and
+ * srami and sramd keep the data fetch1 and exec1 are waiting for. an
+ * access that would hit isn't counted until the clock it really happens.
+ */
+static bool sp_cache_stall(sp_t *sp)
+{
+	llsim_cache_t *cache[2];
+	int addr[2], write[2], n, i;
+
+	n = sp_cache_accesses(sp, cache, addr, write);
+	for (i = 0; i < n && llsim_cache_probe(cache[i], addr[i], write[i]); i++)
+		;
+	if (i == n) {
+		for (i = 0; i < n; i++)
+			llsim_cache_access(cache[i], addr[i], write[i]);
+		return false;
+	}
+	for (i = 0; i < n; i++)
+		if (!llsim_cache_probe(cache[i], addr[i], write[i]))
+			llsim_cache_access(cache[i], addr[i], write[i]);
+	return true;
+}
+
+/*
+ * idle cycle skipping: a pipeline stalled on cache fills only counts
+ * cycles until the first line arrives, unless the DMA engine is busy
+ */
+static int sp_horizon(llsim_unit_t *unit)
+{
+	sp_t *sp = (sp_t *) unit->private;
+	llsim_cache_t *cache[2];
+	int addr[2], write[2], horizon, ready, n, i;
+
+	if (sp->sampling || sp->fast_forward || sp->dma_opcode_received)
+		return llsim->clock;
+	horizon = LLSIM_HORIZON_NEVER;
+	n = sp_cache_accesses(sp, cache, addr, write);
+	for (i = 0; i < n; i++) {
+		if (llsim_cache_probe(cache[i], addr[i], write[i]))
+			continue;
+		ready = llsim_cache_ready(cache[i], addr[i]);
+		// a miss starting this clock
+		if (ready <= llsim->clock)
+			return llsim->clock;
+		if (ready < horizon)
+			horizon = ready;
+	}
+	return (horizon == LLSIM_HORIZON_NEVER) ? llsim->clock : horizon;
+}
+
+static void sp_skip(llsim_unit_t *unit, int cycles)
+{
+	sp_t *sp = (sp_t *) unit->private;
+	sp_registers_t *spro = sp->spro;
+	llsim_cache_t *cache[2];
+	int addr[2], write[2], n, i;
+
+	n = sp_cache_accesses(sp, cache, addr, write);
+	for (i = 0; i < n; i++)
+		if (!llsim_cache_probe(cache[i], addr[i], write[i]))
+			llsim_cache_skip(cache[i], cycles);
+	for (i = 0; i < cycles; i++) {
+		if (sp->cycle_trace)
+			sp_trace_cycle(sp);
+		sp->mem_available = !(spro->exec1_active && spro->exec1_opcode == LD);
+		spro->cycle_counter++;
+	}
+	sp->sprn->cycle_counter = spro->cycle_counter;
+	sp->counters.cycles += cycles;
+}
+
+/*
+ * 1 when the instruction in exec1 retires this clock
+ */
+static int sp_retiring(sp_t *sp)
+{
+	sp_registers_t *spro = sp->spro;
+
+	return spro->exec1_active && sp->pc_of_last_inst_executed != spro->exec1_pc &&
+	       (sp->pc_of_last_inst_executed != -1 || spro->exec1_pc == 0);
+}
+
 static void sp_ctl(sp_t *sp)
 {
 	sp_registers_t *spro = sp->spro;
 	sp_registers_t *sprn = sp->sprn;
-	int i;
-
-	fprintf(cycle_trace_fp, "cycle %d\n", spro->cycle_counter);
-	fprintf(cycle_trace_fp, "cycle_counter %08x\n", spro->cycle_counter);
-	for (i = 2; i <= 7; i++)
-		fprintf(cycle_trace_fp, "r%d %08x\n", i, spro->r[i]);
+	int n;
+	i64 t;
 
-	fprintf(cycle_trace_fp, "raw_hazard %08x\n", raw_hazard);
-	
-	fprintf(cycle_trace_fp, "fetch0_active %08x\n", spro->fetch0_active);
-	fprintf(cycle_trace_fp, "fetch0_pc %08x\n", spro->fetch0_pc);
-
-	fprintf(cycle_trace_fp, "fetch1_active %08x\n", spro->fetch1_active);
-	fprintf(cycle_trace_fp, "fetch1_pc %08x\n", spro->fetch1_pc);
-
-	fprintf(cycle_trace_fp, "dec0_active %08x\n", spro->dec0_active);
-	fprintf(cycle_trace_fp, "dec0_pc %08x\n", spro->dec0_pc);
-	fprintf(cycle_trace_fp, "dec0_inst %08x\n", spro->dec0_inst); // 32 bits
-
-	fprintf(cycle_trace_fp, "dec1_active %08x\n", spro->dec1_active);
-	fprintf(cycle_trace_fp, "dec1_pc %08x\n", spro->dec1_pc); // 16 bits
-	fprintf(cycle_trace_fp, "dec1_inst %08x\n", spro->dec1_inst); // 32 bits
-	fprintf(cycle_trace_fp, "dec1_opcode %08x\n", spro->dec1_opcode); // 5 bits
-	fprintf(cycle_trace_fp, "dec1_src0 %08x\n", spro->dec1_src0); // 3 bits
-	fprintf(cycle_trace_fp, "dec1_src1 %08x\n", spro->dec1_src1); // 3 bits
-	fprintf(cycle_trace_fp, "dec1_dst %08x\n", spro->dec1_dst); // 3 bits
-	fprintf(cycle_trace_fp, "dec1_immediate %08x\n", spro->dec1_immediate); // 32 bits
-
-	fprintf(cycle_trace_fp, "exec0_active %08x\n", spro->exec0_active);
-	fprintf(cycle_trace_fp, "exec0_pc %08x\n", spro->exec0_pc); // 16 bits
-	fprintf(cycle_trace_fp, "exec0_inst %08x\n", spro->exec0_inst); // 32 bits
-	fprintf(cycle_trace_fp, "exec0_opcode %08x\n", spro->exec0_opcode); // 5 bits
-	fprintf(cycle_trace_fp, "exec0_src0 %08x\n", spro->exec0_src0); // 3 bits
-	fprintf(cycle_trace_fp, "exec0_src1 %08x\n", spro->exec0_src1); // 3 bits
-	fprintf(cycle_trace_fp, "exec0_dst %08x\n", spro->exec0_dst); // 3 bits
-	fprintf(cycle_trace_fp, "exec0_immediate %08x\n", spro->exec0_immediate); // 32 bits
-	fprintf(cycle_trace_fp, "exec0_alu0 %08x\n", spro->exec0_alu0); // 32 bits
-	fprintf(cycle_trace_fp, "exec0_alu1 %08x\n", spro->exec0_alu1); // 32 bits
-
-	fprintf(cycle_trace_fp, "exec1_active %08x\n", spro->exec1_active);
-	fprintf(cycle_trace_fp, "exec1_pc %08x\n", spro->exec1_pc); // 16 bits
-	fprintf(cycle_trace_fp, "exec1_inst %08x\n", spro->exec1_inst); // 32 bits
-	fprintf(cycle_trace_fp, "exec1_opcode %08x\n", spro->exec1_opcode); // 5 bits
-	fprintf(cycle_trace_fp, "exec1_src0 %08x\n", spro->exec1_src0); // 3 bits
-	fprintf(cycle_trace_fp, "exec1_src1 %08x\n", spro->exec1_src1); // 3 bits
-	fprintf(cycle_trace_fp, "exec1_dst %08x\n", spro->exec1_dst); // 3 bits
-	fprintf(cycle_trace_fp, "exec1_immediate %08x\n", spro->exec1_immediate); // 32 bits
-	fprintf(cycle_trace_fp, "exec1_alu0 %08x\n", spro->exec1_alu0); // 32 bits
-	fprintf(cycle_trace_fp, "exec1_alu1 %08x\n", spro->exec1_alu1); // 32 bits
-	fprintf(cycle_trace_fp, "exec1_aluout %08x\n", spro->exec1_aluout);
-
-	fprintf(cycle_trace_fp, "mem_available %08x\n", mem_available);
-	fprintf(cycle_trace_fp, "ctl_dma_state %08x\n", ctl_dma_state);
-	fprintf(cycle_trace_fp, "dma_opcode_received %08x\n", dma_opcode_received);
-	fprintf(cycle_trace_fp, "dma_regs[0] %08x\n", dma_regs[0]);
-	fprintf(cycle_trace_fp, "dma_regs[1] %08x\n", dma_regs[1]);
-	fprintf(cycle_trace_fp, "dma_regs[2] %08x\n", dma_regs[2]);
-	fprintf(cycle_trace_fp, "dma_regs[3] %08x\n", dma_regs[3]);
-	fprintf(cycle_trace_fp, "dma_regs[4] %08x\n", dma_regs[4]);
-
-	fprintf(cycle_trace_fp, "\n\n\n");
+	if (sp->cycle_trace) {
+		t = llsim_host_begin();
+		sp_trace_cycle(sp);
+		llsim_host_end(&sp->unit->host_trace, t);
+	}
 
 	sp_printf("cycle_counter %08x\n", spro->cycle_counter);
 	sp_printf("r2 %08x, r3 %08x\n", spro->r[2], spro->r[3]);
@@ -280,15 +430,30 @@ static void sp_ctl(sp_t *sp)
 		  spro->fetch0_pc, spro->fetch1_pc, spro->dec0_pc, spro->dec1_pc, spro->exec0_pc, spro->exec1_pc);
 
 	sprn->cycle_counter = spro->cycle_counter + 1;
+	sp->counters.cycles++;
 
 	if (sp->start)
 		sprn->fetch0_active = 1;
 
-	mem_available = true;
+	if (sp_cache_stall(sp)) {
+		llsim_mem_hold(sp->srami);
+		llsim_mem_hold(sp->sramd);
+		// the DMA engine goes on, on the core's port only while no load
+		// waits for its data there
+		sp->mem_available = !(spro->exec1_active && spro->exec1_opcode == LD);
+		if (sp->dma_opcode_received)
+			perform_dma_logic(sp);
+		return;
+	}
+
+	if (sp->raw_hazard)
+		sp->counters.raw_stalls++;
+
+	sp->mem_available = true;
 	// fetch0
 	sprn->fetch1_active = 0;
 	if (spro->fetch0_active) {
-		if (raw_hazard == 0)
+		if (sp->raw_hazard == 0)
 		{ 
 			llsim_mem_read(sp->srami, spro->fetch0_pc);
 			sprn->fetch1_pc = spro->fetch0_pc;
@@ -300,23 +465,23 @@ static void sp_ctl(sp_t *sp)
 	// fetch1
 	sprn->dec0_active = 0;
 	if (spro->fetch1_active) {
-		if (raw_hazard == 0)
+		if (sp->raw_hazard == 0)
 		{
 			// When we fetch an instruction in fetch0, we must extract that instruction in fetch1, even if we got a hazard previouly
-			if (!inst_fetched)
+			if (!sp->inst_fetched)
 			{
 				sprn->dec0_inst = llsim_mem_extract_dataout(sp->srami, 31, 0);
 			}
 			else
 			{
-				sprn->dec0_inst = inst_fetched;
-				inst_fetched = 0;
+				sprn->dec0_inst = sp->inst_fetched;
+				sp->inst_fetched = 0;
 			}
 			sprn->dec0_pc = spro->fetch1_pc;
 		}
 		else
 		{
-			inst_fetched = llsim_mem_extract_dataout(sp->srami, 31, 0);
+			sp->inst_fetched = llsim_mem_extract_dataout(sp->srami, 31, 0);
 		}
 		sprn->dec0_active = 1;
 	}
@@ -324,7 +489,7 @@ static void sp_ctl(sp_t *sp)
 	// dec0
 	sprn->dec1_active = 0;
 	if (spro->dec0_active) {
-		if (raw_hazard == 0)
+		if (sp->raw_hazard == 0)
 		{
 			int opcode = (spro->dec0_inst & inst_params_opcode) >> inst_params_opcode_shift;
 			sprn->dec1_opcode = opcode;
@@ -335,7 +500,7 @@ static void sp_ctl(sp_t *sp)
 			sprn->dec1_dst = (spro->dec0_inst & inst_params_dst) >> inst_params_dst_shift;
 			if ((spro->dec1_opcode == LD ) && ((sprn->dec1_src0 == spro->dec1_dst) || (sprn->dec1_src1 == spro->dec1_dst)))
 			{
-				raw_hazard = 1;
+				sp->raw_hazard = 1;
 			}
 
 			sprn->dec1_pc = spro->dec0_pc;
@@ -348,7 +513,7 @@ static void sp_ctl(sp_t *sp)
 				case JLE:
 				case JEQ:
 				case JNE:
-					if (predict_jump(spro->dec0_pc))
+					if (predict_jump(sp, spro->dec0_pc))
 					{
 						sprn->fetch0_pc = (int)imm;
 					}
@@ -365,7 +530,7 @@ static void sp_ctl(sp_t *sp)
 	// dec1
 	sprn->exec0_active = 0;
 	if (spro->dec1_active) {
-		if (raw_hazard == 0 || (spro->dec1_opcode == LD))
+		if (sp->raw_hazard == 0 || (spro->dec1_opcode == LD))
 		{
 			if (spro->dec1_src0 == 1)
 			{
@@ -405,9 +570,9 @@ static void sp_ctl(sp_t *sp)
 	sprn->exec1_active = 0;	
 	if (spro->exec0_active) {
 		//in case DMA is already working, we ignore the new request
-		if (spro->exec0_opcode == DMA && !dma_opcode_received && validate_dma_values(spro->exec0_alu1, spro->exec0_alu0, spro->exec0_immediate)) 
+		if (spro->exec0_opcode == DMA && !sp->dma_opcode_received && validate_dma_values(spro->exec0_alu1, spro->exec0_alu0, spro->exec0_immediate)) 
 		{
-			init_dma_logic(spro->exec0_alu1, spro->exec0_alu0, spro->exec0_immediate);
+			init_dma_logic(sp, spro->exec0_alu1, spro->exec0_alu0, spro->exec0_immediate);
 		}
 		else
 		{
@@ -452,15 +617,18 @@ static void sp_ctl(sp_t *sp)
 				break;
 
 			case LD:
-				mem_available = false;
-				if (spro->exec0_alu1 < SP_SRAM_HEIGHT)
+				sp->mem_available = false;
+				if (spro->exec0_alu1 < sp->sramd->height)
 				{
+					// the core comes first, its bank is always free
+					llsim_mem_claim_bank(sp->sramd, spro->exec0_alu1);
 					llsim_mem_read(sp->sramd, spro->exec0_alu1);
 				}
 				break;
 
 			case ST:
-				mem_available = false;
+				sp->mem_available = false;
+				llsim_mem_claim_bank(sp->sramd, spro->exec0_alu1);
 				llsim_mem_set_datain(sp->sramd, spro->exec0_alu0, 31, 0);
 				llsim_mem_write(sp->sramd, spro->exec0_alu1);
 				break;
@@ -489,7 +657,17 @@ static void sp_ctl(sp_t *sp)
 				}
 				break;
 			case POL:
-				sprn->exec1_aluout = !dma_opcode_received;
+				sprn->exec1_aluout = !sp->dma_opcode_received;
+				break;
+
+			case CNT:
+				// the instructions read the ones before this one, exec1 retires later this clock
+				n = sp_retiring(sp);
+				sp->nr_simulated_instructions += n;
+				sp->counters.detailed_instructions += n;
+				sprn->exec1_aluout = llsim_read_counter(sp->unit, spro->exec0_alu1);
+				sp->nr_simulated_instructions -= n;
+				sp->counters.detailed_instructions -= n;
 				break;
 
 			case HLT:
@@ -507,6 +685,7 @@ static void sp_ctl(sp_t *sp)
 			case OR:
 			case XOR:
 			case LHI:
+			case CNT:
 				// Forwarding
 				if (spro->exec0_dst > 1 && spro->exec0_dst < 8)
 				{
@@ -533,11 +712,14 @@ static void sp_ctl(sp_t *sp)
 			case JLE:
 			case JEQ:
 			case JNE:
+				sp->counters.branches++;
 				// If the branch was taken, we need to check if our prediction was right
 				if (sprn->exec1_aluout == 1)
 				{
+					sp->counters.flushes++;
 					if (spro->fetch1_pc != spro->exec0_immediate)
 					{
+						sp->counters.mispredictions++;
 						sprn->fetch0_active = 0;
 						sprn->fetch1_active = 0;
 						sprn->dec0_active = 0;
@@ -545,7 +727,7 @@ static void sp_ctl(sp_t *sp)
 						sprn->exec0_active = 0;
 						sprn->exec1_active = 1;
 						//If we had a hazard in the pipeline, it's also flushed
-						raw_hazard = 0;
+						sp->raw_hazard = 0;
 					}
 					//If we predicted the branch was taken (right), we need to remove the insts after us, since the prediction is done in dec0
 					else
@@ -555,9 +737,9 @@ static void sp_ctl(sp_t *sp)
 						sprn->branch_taken = 1;
 
 					}
-					if (jump_predictors[(spro->exec0_pc % 40)] < 2)
+					if (sp->jump_predictors[(spro->exec0_pc % 40)] < 2)
 					{
-						jump_predictors[(spro->exec0_pc % 40)]++;
+						sp->jump_predictors[(spro->exec0_pc % 40)]++;
 					}
 				}
 
@@ -567,13 +749,15 @@ static void sp_ctl(sp_t *sp)
 					// If we predicted branch taken (wrong), fetch1 pc will be our immediate, and so we flush
 					if (spro->fetch1_pc == spro->exec0_immediate)
 					{
+						sp->counters.mispredictions++;
+						sp->counters.flushes++;
 						sprn->fetch0_pc = spro->dec0_pc + 1;
 						sprn->fetch1_active = 0;
 						sprn->dec0_active = 0;
 					}
-					if (jump_predictors[(spro->exec0_pc % 40)] != 0)
+					if (sp->jump_predictors[(spro->exec0_pc % 40)] != 0)
 					{
-						jump_predictors[(spro->exec0_pc % 40)]--;
+						sp->jump_predictors[(spro->exec0_pc % 40)]--;
 					}
 				}
 
@@ -584,7 +768,7 @@ static void sp_ctl(sp_t *sp)
 			//Turning off the hazard only for ST and LD, after we forwarded
 			if ((spro->dec1_src0 == spro->exec0_dst || spro->dec1_src1 == spro->exec0_dst) && (spro->exec0_opcode == LD || spro->exec0_opcode == ST))
 			{
-				raw_hazard = 0;
+				sp->raw_hazard = 0;
 			}
 
 
@@ -609,14 +793,14 @@ static void sp_ctl(sp_t *sp)
 		switch(spro->exec1_opcode)
 		{
 		case LD:
-			data_extracted = llsim_mem_extract_dataout(sp->sramd, 31, 0);		
+			sp->data_extracted = llsim_mem_extract_dataout(sp->sramd, 31, 0);		
 			if(spro->exec1_dst > 1 && spro->exec1_dst < 8)
 			{
-				sprn->r[spro->exec1_dst] = data_extracted;
+				sprn->r[spro->exec1_dst] = sp->data_extracted;
 				// FORWARD: LD -> ALU
 				if (spro->exec1_dst == spro->dec1_src0)
 				{
-					sprn->exec0_alu0 = data_extracted;
+					sprn->exec0_alu0 = sp->data_extracted;
 					if (spro->exec0_pc == spro->exec1_pc)
 					{
 						sprn->exec1_active = 0; 
@@ -626,7 +810,7 @@ static void sp_ctl(sp_t *sp)
 				
 				if (spro->exec1_dst == spro->dec1_src1)
 				{
-					sprn->exec0_alu1 = data_extracted;
+					sprn->exec0_alu1 = sp->data_extracted;
 					if (spro->exec0_pc == spro->exec1_pc)
 					{
 						sprn->exec1_active = 0;
@@ -670,6 +854,7 @@ static void sp_ctl(sp_t *sp)
 		case OR:
 		case XOR:
 		case LHI:
+		case CNT:
 		
 			if(spro->exec1_dst >1 && spro->exec1_dst <8)
 			{
@@ -702,41 +887,347 @@ static void sp_ctl(sp_t *sp)
 		}
 
 		// Printing inst trace
-		if (pc_of_last_inst_executed != spro->exec1_pc)
+		if (sp->pc_of_last_inst_executed != spro->exec1_pc)
 		{
-			if (pc_of_last_inst_executed != -1 || spro->exec1_pc == 0)
+			if (sp->pc_of_last_inst_executed != -1 || spro->exec1_pc == 0)
 			{
-				print_all_lines(sp, spro->exec1_pc, nr_simulated_instructions);
-				nr_simulated_instructions++;
+				if (sp->inst_trace) {
+					t = llsim_host_begin();
+					print_all_lines(sp, spro->exec1_pc, sp->nr_simulated_instructions);
+					llsim_host_end(&sp->unit->host_trace, t);
+				}
+				sp->nr_simulated_instructions++;
+				sp->counters.detailed_instructions++;
+				if (sp->unit->profile)
+					llsim_profile_retire(sp->unit->profile, spro->exec1_pc);
 			}
-			pc_of_last_inst_executed = spro->exec1_pc;
+			sp->pc_of_last_inst_executed = spro->exec1_pc;
 		}
 		
 		if(spro->exec1_opcode == HLT)
 		{
 			llsim_stop();
-			end_trace(inst_trace_fp, nr_simulated_instructions, pc_of_last_inst_executed);
-			ctl_dma_state = DMA_IDLE_STATE;
-			dma_opcode_received = false;
-			fclose(inst_trace_fp);
-			fclose(cycle_trace_fp);
-			dump_sram(sp, "srami_out.txt", sp->srami);
-			dump_sram(sp, "sramd_out.txt", sp->sramd);
+			sp->ctl_dma_state = DMA_IDLE_STATE;
+			sp->dma_opcode_received = false;
+			if (sp->inst_trace) {
+				print_end_trace(sp, sp->nr_simulated_instructions, sp->pc_of_last_inst_executed);
+				trace_close(sp->inst_trace);
+				trace_close(sp->cycle_trace);
+				sp->inst_trace = sp->cycle_trace = NULL;
+			}
+			llsim_mem_dump(sp->srami, "srami_out");
+			llsim_mem_dump(sp->sramd, "sramd_out");
+			if (sp->sramd->nr_banks > 1)
+				llsim_printf("sp: sramd of %d banks: %d accesses, %d conflicts\n",
+					     sp->sramd->nr_banks, sp->sramd->bank_accesses, sp->sramd->bank_conflicts);
+			if (sp->icache)
+				llsim_cache_print(sp->icache);
+			if (sp->dcache)
+				llsim_cache_print(sp->dcache);
+			llsim_counters_dump();
+			if (sp->unit->profile)
+				llsim_profile_write(sp->unit, sp_disasm);
 		}
 
 	}
 
-	if (dma_opcode_received)
+	if (sp->dma_opcode_received)
 	{
-		perform_dma_logic(mem_available, sp);
+		perform_dma_logic(sp);
 	}
 }
 
+/*
+ * pre-decoded instruction cache of the functional simulator, one entry per
+ * srami word kept as a struct of arrays. handler[] is the interpreter label
+ * of the decoded instruction, or the decode label for words that weren't
+ * decoded yet. the operand pointers already resolve the immediate and R0
+ * sources, rd points at a scratch word for destinations that are never
+ * written. ST and DMA only write sramd, so entries stay valid for the whole
+ * fast-forward.
+ */
+typedef struct sp_decode_s {
+	void *handler[SP_SRAM_HEIGHT];
+	int *alu0[SP_SRAM_HEIGHT];
+	int *alu1[SP_SRAM_HEIGHT];
+	int *rd[SP_SRAM_HEIGHT];
+	int immediate[SP_SRAM_HEIGHT];
+	unsigned char dst[SP_SRAM_HEIGHT];
+} sp_decode_t;
+
+/*
+ * ends an instruction of the threaded interpreter: moves on to target and
+ * jumps straight to the handler of the next instruction
+ */
+#define sp_ff_next(target)						\
+	do {								\
+		pc = (target);						\
+		if (++n == count)					\
+			goto out;					\
+		llsim_assert((unsigned) pc < SP_SRAM_HEIGHT,		\
+			     "fast forward: pc %d out of range\n", pc);	\
+		goto *d->handler[pc];					\
+	} while (0)
+
+#define sp_ff_operands()						\
+	do {								\
+		alu0 = *d->alu0[pc];					\
+		alu1 = *d->alu1[pc];					\
+	} while (0)
+
+#define sp_ff_predict(taken)						\
+	do {								\
+		if ((taken) && sp->jump_predictors[pc % 40] < 2)		\
+			sp->jump_predictors[pc % 40]++;			\
+		if (!(taken) && sp->jump_predictors[pc % 40] != 0)		\
+			sp->jump_predictors[pc % 40]--;			\
+	} while (0)
+
+/*
+ * functional fast-forward: executes up to count instructions from fetch0_pc
+ * directly over the srami/sramd data arrays. instructions are decoded once
+ * into sp->decode and dispatched with computed gotos. the jump predictors
+ * are trained and branches counted on the way. the register file, memories
+ * and pc are then handed to an empty pipeline. cycle_counter is advanced by
+ * one clock per instruction. stops in front of HLT so the pipeline ends the
+ * simulation, and behind a DMA so the engine does the transfer in detail
+ * and POL sees it busy. returns the number executed.
+ */
+static int sp_fast_forward(sp_t *sp, int count)
+{
+	static void *op_handler[32] = {
+		&&op_add, &&op_sub, &&op_lsf, &&op_rsf,
+		&&op_and, &&op_or, &&op_xor, &&op_lhi,
+		&&op_ld, &&op_st, &&op_nop, &&op_nop,
+		&&op_nop, &&op_nop, &&op_nop, &&op_nop,
+		&&op_jlt, &&op_jle, &&op_jeq, &&op_jne,
+		&&op_jin, &&op_dma, &&op_pol, &&op_cnt,
+		&&op_hlt, &&op_nop, &&op_nop, &&op_nop,
+		&&op_nop, &&op_nop, &&op_nop, &&op_nop,
+	};
+	sp_registers_t *spro = sp->spro;
+	sp_registers_t *sprn = sp->sprn;
+	sp_decode_t *d = sp->decode;
+	int *imem = sp->srami->data, *dmem = sp->sramd->data, height = sp->sramd->height;
+	int r[8], r0 = R0, scratch, pc, inst, opcode, dst, src0, src1;
+	int alu0, alu1, aluout, n, i;
+
+	if (d == NULL)
+		d = sp->decode = llsim_malloc(sizeof(sp_decode_t));
+
+	// operand pointers refer to this invocation's register file
+	for (i = 0; i < SP_SRAM_HEIGHT; i++)
+		d->handler[i] = &&decode;
+
+	memcpy(r, spro->r, sizeof(r));
+	aluout = spro->exec1_aluout;
+	pc = spro->fetch0_pc;
+	n = 0;
+	if (count <= 0)
+		goto out;
+	goto *d->handler[pc];
+
+decode:
+	inst = imem[pc];
+	opcode = (inst & inst_params_opcode) >> inst_params_opcode_shift;
+	src1 = (inst & inst_params_src1) >> inst_params_src1_shift;
+	src0 = (inst & inst_params_src0) >> inst_params_src0_shift;
+	dst = (inst & inst_params_dst) >> inst_params_dst_shift;
+	d->immediate[pc] = (short) (inst & inst_params_imm);
+	d->dst[pc] = dst;
+	d->alu0[pc] = (src0 == 1) ? &d->immediate[pc] : ((src0) ? &r[src0] : &r0);
+	d->alu1[pc] = (src1 == 1) ? &d->immediate[pc] : ((src1) ? &r[src1] : &r0);
+	d->rd[pc] = (dst > 1) ? &r[dst] : &scratch;
+	d->handler[pc] = op_handler[opcode];
+	goto *d->handler[pc];
+
+op_add:
+	sp_ff_operands();
+	aluout = alu0 + alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_sub:
+	sp_ff_operands();
+	aluout = alu0 - alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_lsf:
+	sp_ff_operands();
+	aluout = alu0 << alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_rsf:
+	sp_ff_operands();
+	aluout = alu0 >> alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_and:
+	sp_ff_operands();
+	aluout = alu0 & alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_or:
+	sp_ff_operands();
+	aluout = alu0 | alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_xor:
+	sp_ff_operands();
+	aluout = alu0 ^ alu1;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_lhi:
+	sp_ff_operands();
+	if (d->dst[pc] > 1)
+		aluout = alu0 & (d->immediate[pc]) << 16;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_cnt:
+	sp_ff_operands();
+	// instructions count the ones executed so far too
+	sp->nr_simulated_instructions += n;
+	aluout = llsim_read_counter(sp->unit, alu1);
+	sp->nr_simulated_instructions -= n;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_ld:
+	alu1 = *d->alu1[pc];
+	*d->rd[pc] = ((unsigned) alu1 < height) ? dmem[alu1] : 0xBAADBAAD;
+	sp_ff_next(pc + 1);
+op_st:
+	sp_ff_operands();
+	if ((unsigned) alu1 < height) {
+		dmem[alu1] = alu0;
+		llsim_mem_dirty(sp->sramd, alu1);
+	}
+	sp_ff_next(pc + 1);
+op_jlt:
+	sp_ff_operands();
+	aluout = alu0 < alu1;
+	goto jump;
+op_jle:
+	sp_ff_operands();
+	aluout = alu0 <= alu1;
+	goto jump;
+op_jeq:
+	sp_ff_operands();
+	aluout = alu0 == alu1;
+	goto jump;
+op_jne:
+	sp_ff_operands();
+	aluout = alu0 != alu1;
+jump:
+	sp->counters.branches++;
+	sp_ff_predict(aluout);
+	if (aluout) {
+		r[7] = pc;
+		sp_ff_next(d->immediate[pc]);
+	}
+	sp_ff_next(pc + 1);
+op_jin:
+	if (*d->alu0[pc] < SP_SRAM_HEIGHT)
+		aluout = 1;
+	if (aluout)
+		r[7] = pc;
+	sp_ff_next(d->immediate[pc]);
+op_dma:
+	// source is r[dst]. the engine takes the transfer and the fast-forward
+	// stops behind it, the transfer runs in detail while the program goes on
+	alu0 = *d->alu0[pc];
+	alu1 = (d->dst[pc]) ? r[d->dst[pc]] : R0;
+	if (sp->dma_opcode_received || !validate_dma_values(alu1, alu0, d->immediate[pc]))
+		sp_ff_next(pc + 1);
+	init_dma_logic(sp, alu1, alu0, d->immediate[pc]);
+	pc++;
+	n++;
+	goto out;
+op_pol:
+	aluout = !sp->dma_opcode_received;
+	*d->rd[pc] = aluout;
+	sp_ff_next(pc + 1);
+op_nop:
+	sp_ff_next(pc + 1);
+op_hlt:
+out:
+	memcpy(sprn->r, r, sizeof(r));
+	sprn->exec1_aluout = aluout;
+	sprn->fetch0_pc = pc;
+	sprn->cycle_counter = spro->cycle_counter + 1 + n;
+	if (n)
+		sp->pc_of_last_inst_executed = pc - 1;
+	sp->nr_simulated_instructions += n;
+	return n;
+}
+
+/*
+ * sampled simulation: a clock of the parent executes a chunk of
+ * instructions functionally and has a sample forked off after it. once HLT
+ * is ahead or a DMA transfer started the parent finishes in detail.
+ */
+static void sp_sample(sp_t *sp)
+{
+	int count, n;
+
+	count = sp->fast_forward ? sp->fast_forward : llsim->sample_interval;
+	sp->fast_forward = 0;
+	n = sp_fast_forward(sp, count);
+	if (sp->start)
+		sp->sprn->fetch0_active = 1;
+	if (n == count && !sp->dma_opcode_received)
+		llsim_sample_request();
+	else
+		sp->sampling = 0;
+}
+
+/*
+ * the instruction and cycle traces, none with -n
+ */
+static void sp_open_traces(sp_t *sp)
+{
+	char path[1024];
+
+	if (llsim->no_traces)
+		return;
+	sp->inst_trace_fp = llsim_fopen("inst_trace.txt", "w");
+	sp->inst_trace = trace_attach(sp->inst_trace_fp, INST_RECORD_SIZE, write_inst_records, NULL);
+	llsim_output_path(path, sizeof(path), (llsim->trace_format == LLSIM_TRACE_BINARY) ? "cycle_trace.bin" : "cycle_trace.txt");
+	sp->cycle_trace = trace_open(path, llsim->trace_format == LLSIM_TRACE_BINARY, CYCLE_TRACE_NFIELDS, cycle_trace_names, "\n\n\n");
+	if (llsim->trace_async) {
+		trace_start_writer(sp->inst_trace);
+		trace_start_writer(sp->cycle_trace);
+	}
+}
+
+/*
+ * first clock of a forked sample. the parent's traces, with whatever they
+ * still buffer, stay with the parent, the sample writes its own
+ */
+static void sp_sample_start(sp_t *sp)
+{
+	sp_open_traces(sp);
+	sp->sample_instructions = sp->nr_simulated_instructions;
+	sp->sampling = 0;
+}
+
+static void sp_report(llsim_unit_t *unit, FILE *fp)
+{
+	sp_t *sp = (sp_t *) unit->private;
+
+	fprintf(fp, "instructions %d\n", sp->nr_simulated_instructions - sp->sample_instructions);
+	if (sp->sramd->nr_banks > 1)
+		fprintf(fp, "bank_conflicts %d\n", sp->sramd->bank_conflicts);
+	if (sp->icache)
+		llsim_cache_report(sp->icache, fp);
+	if (sp->dcache)
+		llsim_cache_report(sp->dcache, fp);
+}
+
 static void sp_run(llsim_unit_t *unit)
 {
 	sp_t *sp = (sp_t *) unit->private;
 	//	sp_registers_t *spro = sp->spro;
-	//	sp_registers_t *sprn = sp->sprn;
+	sp_registers_t *sprn = sp->sprn;
+	int n;
 
 	//	llsim_printf("-------------------------\n");
 
@@ -750,37 +1241,53 @@ static void sp_run(llsim_unit_t *unit)
 	sp->sramd->read = 0;
 	sp->sramd->write = 0;
 
+	if (sp->sampling) {
+		if (llsim->sample_clock < 0) {
+			sp_sample(sp);
+			return;
+		}
+		sp_sample_start(sp);
+	}
+
+	if (sp->fast_forward) {
+		n = sp_fast_forward(sp, sp->fast_forward);
+		sp_printf("fast forward: %d instructions executed functionally\n", n);
+		sp->fast_forward = 0;
+		if (sp->start)
+			sprn->fetch0_active = 1;
+		return;
+	}
+
 	sp_ctl(sp);
 }
 
 static void sp_generate_sram_memory_image(sp_t *sp, char *program_name)
 {
-        FILE *fp;
-        int addr, i;
-
-        fp = fopen(program_name, "r");
-        if (fp == NULL) {
-                printf("couldn't open file %s\n", program_name);
-                exit(1);
-        }
-        addr = 0;
-        while (addr < SP_SRAM_HEIGHT) {
-                fscanf(fp, "%08x\n", &sp->memory_image[addr]);
-                //              printf("addr %x: %08x\n", addr, sp->memory_image[addr]);
-                addr++;
-                if (feof(fp))
-                        break;
-        }
-	sp->memory_image_size = addr;
-
-        fprintf(inst_trace_fp, "program %s loaded, %d lines\n", program_name, addr);
-
-	for (i = 0; i < sp->memory_image_size; i++) {
-		llsim_mem_inject(sp->srami, i, sp->memory_image[i], 31, 0);
-		llsim_mem_inject(sp->sramd, i, sp->memory_image[i], 31, 0);
-	}
+	image_t *image;
+
+	image = image_open(program_name, SP_SRAM_HEIGHT);
+	if (sp->inst_trace_fp)
+		fprintf(sp->inst_trace_fp, "program %s loaded, %d lines\n", program_name, image->nr_words);
+	llsim_mem_load(sp->srami, 0, image->words, image->nr_words);
+	llsim_mem_load(sp->sramd, 0, image->words, image->nr_words);
+	image_close(image);
 }
 
+static void sp_destroy(llsim_unit_t *unit)
+{
+	sp_t *sp = (sp_t *) unit->private;
+
+	// still open when the simulation didn't reach HLT
+	if (sp->inst_trace)
+		trace_close(sp->inst_trace);
+	if (sp->cycle_trace)
+		trace_close(sp->cycle_trace);
+	free(sp->decode);
+	free(sp);
+}
+
+char *sp_options = "bapk";
+
 void sp_init(char *program_name)
 {
 	llsim_unit_t *llsim_sp_unit;
@@ -789,30 +1296,70 @@ void sp_init(char *program_name)
 
 	llsim_printf("initializing sp unit\n");
 
-	inst_trace_fp = fopen("inst_trace.txt", "w");
-	if (inst_trace_fp == NULL) {
-		printf("couldn't open file inst_trace.txt\n");
-		exit(1);
-	}
-
-	cycle_trace_fp = fopen("cycle_trace.txt", "w");
-	if (cycle_trace_fp == NULL) {
-		printf("couldn't open file cycle_trace.txt\n");
-		exit(1);
-	}
-
 	llsim_sp_unit = llsim_register_unit("sp", sp_run);
+	llsim_sp_unit->destroy = sp_destroy;
+	llsim_sp_unit->report = sp_report;
 	llsim_ur = llsim_allocate_registers(llsim_sp_unit, "sp_registers", sizeof(sp_registers_t));
 	sp = llsim_malloc(sizeof(sp_t));
 	llsim_sp_unit->private = sp;
+	sp->unit = llsim_sp_unit;
 	sp->spro = llsim_ur->old;
 	sp->sprn = llsim_ur->new;
 
+	sp_open_traces(sp);
+
 	sp->srami = llsim_allocate_memory(llsim_sp_unit, "srami", 32, SP_SRAM_HEIGHT, 0);
-	sp->sramd = llsim_allocate_memory(llsim_sp_unit, "sramd", 32, SP_SRAM_HEIGHT, 0);
+	if (llsim->nr_banks > 1)
+		sp->sramd = llsim_allocate_banked_memory(llsim_sp_unit, "sramd", 32, 1 << llsim->addr_bits, 1, llsim->nr_banks);
+	else
+		sp->sramd = llsim_allocate_memory(llsim_sp_unit, "sramd", 32, 1 << llsim->addr_bits, llsim->dma_port);
 	sp_generate_sram_memory_image(sp, program_name);
+	if (llsim->icache.size)
+		sp->icache = llsim_allocate_cache(llsim_sp_unit, "icache", &llsim->icache);
+	if (llsim->dcache.size)
+		sp->dcache = llsim_allocate_cache(llsim_sp_unit, "dcache", &llsim->dcache);
+	if (sp->icache || sp->dcache) {
+		// clocks stalled on cache fills are skipped
+		llsim_sp_unit->horizon = sp_horizon;
+		llsim_sp_unit->skip = sp_skip;
+	}
+	if (llsim->profile)
+		llsim_allocate_profile(llsim_sp_unit, SP_SRAM_HEIGHT);
 
 	sp->start = 1;
+	sp->fast_forward = llsim->fast_forward;
+	sp->read_into_reg3 = true;
+	sp->write_reg3 = true;
+	sp->mem_available = true;
+	sp->pc_of_last_inst_executed = -1;
+	sp->sampling = llsim->sample_interval > 0;
+
+	// kept in checkpoints with the registers and memories
+	llsim_register_state(llsim_sp_unit, "start", &sp->start, sizeof(sp->start));
+	llsim_register_state(llsim_sp_unit, "fast_forward", &sp->fast_forward, sizeof(sp->fast_forward));
+	llsim_register_state(llsim_sp_unit, "nr_simulated_instructions", &sp->nr_simulated_instructions, sizeof(sp->nr_simulated_instructions));
+	llsim_register_state(llsim_sp_unit, "dma_regs", sp->dma_regs, sizeof(sp->dma_regs));
+	llsim_register_state(llsim_sp_unit, "read_into_reg3", &sp->read_into_reg3, sizeof(sp->read_into_reg3));
+	llsim_register_state(llsim_sp_unit, "write_reg3", &sp->write_reg3, sizeof(sp->write_reg3));
+	llsim_register_state(llsim_sp_unit, "dma_opcode_received", &sp->dma_opcode_received, sizeof(sp->dma_opcode_received));
+	llsim_register_state(llsim_sp_unit, "ctl_dma_state", &sp->ctl_dma_state, sizeof(sp->ctl_dma_state));
+	llsim_register_state(llsim_sp_unit, "mem_available", &sp->mem_available, sizeof(sp->mem_available));
+	llsim_register_state(llsim_sp_unit, "jump_predictors", sp->jump_predictors, sizeof(sp->jump_predictors));
+	llsim_register_state(llsim_sp_unit, "data_extracted", &sp->data_extracted, sizeof(sp->data_extracted));
+	llsim_register_state(llsim_sp_unit, "raw_hazard", &sp->raw_hazard, sizeof(sp->raw_hazard));
+	llsim_register_state(llsim_sp_unit, "pc_of_last_inst_executed", &sp->pc_of_last_inst_executed, sizeof(sp->pc_of_last_inst_executed));
+	llsim_register_state(llsim_sp_unit, "inst_fetched", &sp->inst_fetched, sizeof(sp->inst_fetched));
+	llsim_register_state(llsim_sp_unit, "counters", &sp->counters, sizeof(sp->counters));
+
+	llsim_register_counter(llsim_sp_unit, "cycles", &sp->counters.cycles);
+	llsim_register_counter(llsim_sp_unit, "instructions", &sp->nr_simulated_instructions);
+	llsim_register_counter(llsim_sp_unit, "branches", &sp->counters.branches);
+	llsim_register_counter(llsim_sp_unit, "mispredictions", &sp->counters.mispredictions);
+	llsim_register_counter(llsim_sp_unit, "flushes", &sp->counters.flushes);
+	llsim_register_counter(llsim_sp_unit, "raw_stalls", &sp->counters.raw_stalls);
+	llsim_register_counter(llsim_sp_unit, "dma_words", &sp->counters.dma_words);
+	llsim_register_counter(llsim_sp_unit, "dma_stalls", &sp->counters.dma_stalls);
+	llsim_register_counter(llsim_sp_unit, "detailed_instructions", &sp->counters.detailed_instructions);
 	
 	// c2v_translate_end
 }
@@ -938,7 +1485,7 @@ int print_line4(FILE* file, sp_registers_t* inst_regs)
 	return return_value;
 }
 
-int print_line5(FILE* file, sp_t* sp)
+int print_line5(FILE* file, sp_registers_t* spro, sp_registers_t* sprn)
 {
 	int return_value = SUCCESS;
 
@@ -946,7 +1493,7 @@ int print_line5(FILE* file, sp_t* sp)
 	char line_to_print[MAX_STR_LEN];
 	int jump_dst;
 
-	switch (sp->spro->exec1_opcode)
+	switch (spro->exec1_opcode)
 	{
 		case ADD:
 		case SUB:
@@ -957,36 +1504,36 @@ int print_line5(FILE* file, sp_t* sp)
 		case XOR:
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: R[%d] = %d %s %d <<<<\n\n",
-				sp->spro->exec1_dst,
-				sp->spro->exec1_alu0,
-				opcode_name[sp->spro->exec1_opcode],
-				sp->spro->exec1_alu1
+				spro->exec1_dst,
+				spro->exec1_alu0,
+				opcode_name[spro->exec1_opcode],
+				spro->exec1_alu1
 			);
 			break;
 
 		case LHI:
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: R[%d] %s %d <<<<\n\n",
-				sp->spro->exec1_dst,
-				opcode_name[sp->spro->exec1_opcode],
-				sp->spro->exec1_immediate
+				spro->exec1_dst,
+				opcode_name[spro->exec1_opcode],
+				spro->exec1_immediate
 			);
 			break;
 		case LD:
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: R[%d] = MEM[%d] = %08x <<<<\n\n",
-				sp->spro->exec1_dst,
-				sp->spro->exec1_alu1,// the value of the memory address
-				sp->sprn->r[sp->spro->exec1_dst] //the value in the memory address
+				spro->exec1_dst,
+				spro->exec1_alu1,// the value of the memory address
+				sprn->r[spro->exec1_dst] //the value in the memory address
 			);
 			break;
 
 		case ST:
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: MEM[%d] = R[%d] = %08x <<<<\n\n",
-				sp->spro->exec1_alu1,// the value of the memory address
-				sp->spro->exec1_src0, // the register whose value we save 
-				sp->spro->exec1_alu0 //the value in the memory address
+				spro->exec1_alu1,// the value of the memory address
+				spro->exec1_src0, // the register whose value we save 
+				spro->exec1_alu0 //the value in the memory address
 			);
 			break;
 
@@ -994,12 +1541,12 @@ int print_line5(FILE* file, sp_t* sp)
 		case JLE:
 		case JEQ:
 		case JNE:
-			jump_dst = sp->spro->exec1_aluout ? sp->spro->exec1_immediate : sp->spro->exec1_pc + 1;
+			jump_dst = spro->exec1_aluout ? spro->exec1_immediate : spro->exec1_pc + 1;
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: %s %d, %d, %d <<<<\n\n",
-				opcode_name[sp->spro->exec1_opcode],
-				sp->spro->exec1_alu0,
-				sp->spro->exec1_alu1,
+				opcode_name[spro->exec1_opcode],
+				spro->exec1_alu0,
+				spro->exec1_alu1,
 				jump_dst
 			);
 			break;
@@ -1007,31 +1554,40 @@ int print_line5(FILE* file, sp_t* sp)
 		case JIN:
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: %s %d <<<<\n\n",
-				opcode_name[sp->spro->exec1_opcode],
-				sp->sprn->exec1_pc
+				opcode_name[spro->exec1_opcode],
+				sprn->exec1_pc
 			);
 			break;
 
 		case HLT:
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: HALT at PC %04x <<<<\n",
-				sp->spro->exec1_pc
+				spro->exec1_pc
 			);
 			break;
 		case DMA:
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: %s %d, %d, %d <<<<\n\n",
-				opcode_name[sp->spro->exec1_opcode],
-				sp->spro->exec1_alu1,
-				sp->spro->exec1_alu0,
-				sp->spro->exec1_immediate
+				opcode_name[spro->exec1_opcode],
+				spro->exec1_alu1,
+				spro->exec1_alu0,
+				spro->exec1_immediate
+			);
+			break;
+		case CNT:
+			check_ret = sprintf(line_to_print,
+				">>>> EXEC: R[%d] = %s[%d] = %d <<<<\n\n",
+				spro->exec1_dst,
+				opcode_name[spro->exec1_opcode],
+				spro->exec1_alu1,
+				spro->exec1_aluout
 			);
 			break;
 		case POL:
 			check_ret = sprintf(line_to_print,
 				">>>> EXEC: %s %d <<<<\n\n",
-				opcode_name[sp->spro->exec1_opcode],
-				sp->spro->exec1_dst
+				opcode_name[spro->exec1_opcode],
+				spro->exec1_dst
 			);
 			break;
 		default:
@@ -1054,12 +1610,46 @@ int print_line5(FILE* file, sp_t* sp)
 
 void print_all_lines(sp_t* sp, int pc_of_inst, int nr_sim_inst)
 {
-	print_line1(inst_trace_fp, nr_sim_inst, pc_of_inst);
-	print_line2(inst_trace_fp, sp->spro);
-	print_line3(inst_trace_fp, sp->spro);
-	print_line4(inst_trace_fp, sp->spro);
-	print_line5(inst_trace_fp, sp);
-	fflush(inst_trace_fp);
+	inst_record_t *rec = (inst_record_t *) trace_next(sp->inst_trace);
+
+	rec->kind = INST_RECORD_EXEC;
+	rec->cnt = nr_sim_inst;
+	rec->pc = pc_of_inst;
+	rec->spro = *sp->spro;
+	rec->sprn = *sp->sprn;
+	trace_commit(sp->inst_trace);
+}
+
+void print_end_trace(sp_t *sp, int cnt, int pc)
+{
+	inst_record_t *rec = (inst_record_t *) trace_next(sp->inst_trace);
+
+	rec->kind = INST_RECORD_END;
+	rec->cnt = cnt;
+	rec->pc = pc;
+	trace_commit(sp->inst_trace);
+}
+
+/*
+ * trace writer callback, formats inst trace records
+ */
+static void write_inst_records(trace_t *trace, int *recs, int count)
+{
+	inst_record_t *rec;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		rec = (inst_record_t *) (recs + i * INST_RECORD_SIZE);
+		if (rec->kind == INST_RECORD_END) {
+			end_trace(trace->fp, rec->cnt, rec->pc);
+			continue;
+		}
+		print_line1(trace->fp, rec->cnt, rec->pc);
+		print_line2(trace->fp, &rec->spro);
+		print_line3(trace->fp, &rec->spro);
+		print_line4(trace->fp, &rec->spro);
+		print_line5(trace->fp, &rec->spro, &rec->sprn);
+	}
 }
 
 int end_trace(FILE* file, int cnt, int pc)
@@ -1089,149 +1679,175 @@ int end_trace(FILE* file, int cnt, int pc)
 	return return_value;
 }
 
-void init_dma_logic(int source, int dest, int amount)
+void init_dma_logic(sp_t *sp, int source, int dest, int amount)
+{
+	sp->dma_regs[0] = source;
+	sp->dma_regs[1] = dest;
+	sp->dma_regs[2] = amount;
+	sp->dma_opcode_received = true;
+}
+
+/*
+ * whether the DMA engine gets sramd for an access to addr this clock. on
+ * a port of its own it never waits for the core, with banks only when
+ * both hit the same bank.
+ */
+static bool sp_dma_mem_available(sp_t *sp, int addr)
 {
-	dma_regs[0] = source;
-	dma_regs[1] = dest;
-	dma_regs[2] = amount;
-	dma_opcode_received = true;
+	bool available;
+
+	if (sp->sramd->nr_banks > 1)
+		available = llsim_mem_claim_bank(sp->sramd, addr);
+	else
+		available = sp->mem_available || sp->sramd->nr_ports > 1;
+	if (!available)
+		sp->counters.dma_stalls++;
+	return available;
 }
 
-void perform_dma_logic(bool mem_available, sp_t* sp)
+void perform_dma_logic(sp_t *sp)
 {
+	int port = (sp->sramd->nr_ports > 1) ? 1 : 0;
+
+	dma_printf("state %d, src %d, dst %d, len %d, mem_available %d\n",
+		   sp->ctl_dma_state, sp->dma_regs[0], sp->dma_regs[1], sp->dma_regs[2], sp->mem_available);
+
 	// 3 bit control state machine of DMA
-	switch (ctl_dma_state)
+	switch (sp->ctl_dma_state)
 	{
 	case(NO_READ_WRITE):
-		if (dma_regs[2] == 0)
+		if (sp->dma_regs[2] == 0)
 		{
-			dma_opcode_received = false;
-			ctl_dma_state = DMA_IDLE_STATE;
+			sp->dma_opcode_received = false;
+			sp->ctl_dma_state = DMA_IDLE_STATE;
 		}
 
-		else if (mem_available)
+		else if (sp_dma_mem_available(sp, sp->dma_regs[0]))
 		{
-			llsim_mem_read(sp->sramd, dma_regs[0]); //fetch MEM[dma_regs[0]]
-			dma_regs[0]++;
-			ctl_dma_state = ONE_READ_NO_WRITE;
+			llsim_mem_read_port(sp->sramd, port, sp->dma_regs[0]); //fetch MEM[dma_regs[0]]
+			sp->dma_regs[0]++;
+			sp->ctl_dma_state = ONE_READ_NO_WRITE;
 		}
 		else
 		{
-			ctl_dma_state = NO_READ_WRITE;
+			sp->ctl_dma_state = NO_READ_WRITE;
 		}
 		break;
 
 	case(ONE_READ_NO_WRITE):
-		if (read_into_reg3)
+		if (sp->read_into_reg3)
 		{
-			dma_regs[3] = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+			sp->dma_regs[3] = llsim_mem_extract_dataout_port(sp->sramd, port, 31, 0);
 		}
 		else
 		{
-			dma_regs[4] = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+			sp->dma_regs[4] = llsim_mem_extract_dataout_port(sp->sramd, port, 31, 0);
 		}
-		read_into_reg3 = !read_into_reg3; //next, data will be loaded to other register
-		dma_regs[2]--;
+		sp->read_into_reg3 = !sp->read_into_reg3; //next, data will be loaded to other register
+		sp->dma_regs[2]--;
 
-		if (dma_regs[2] == 0)  //if length remaining is 0, then no need to keep reading.
+		if (sp->dma_regs[2] == 0)  //if length remaining is 0, then no need to keep reading.
 		{
-			ctl_dma_state = ONE_WRITE_READY;
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
-		else if (mem_available)
+		else if (sp_dma_mem_available(sp, sp->dma_regs[0]))
 		{
-			llsim_mem_read(sp->sramd, dma_regs[0]);
-			dma_regs[0]++;
-			ctl_dma_state = ONE_READ_ONE_WRITE;
+			llsim_mem_read_port(sp->sramd, port, sp->dma_regs[0]);
+			sp->dma_regs[0]++;
+			sp->ctl_dma_state = ONE_READ_ONE_WRITE;
 		}
 		else
 		{
-			ctl_dma_state = ONE_WRITE_READY;
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 
 		break;
 
 	case(ONE_READ_ONE_WRITE):
-		if (read_into_reg3)
+		if (sp->read_into_reg3)
 		{
-			dma_regs[3] = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+			sp->dma_regs[3] = llsim_mem_extract_dataout_port(sp->sramd, port, 31, 0);
 		}
 		else
 		{
-			dma_regs[4] = llsim_mem_extract_dataout(sp->sramd, 31, 0);
+			sp->dma_regs[4] = llsim_mem_extract_dataout_port(sp->sramd, port, 31, 0);
 		}
-		read_into_reg3 = !read_into_reg3; //next, data will be loaded to other register
-		dma_regs[2]--;
+		sp->read_into_reg3 = !sp->read_into_reg3; //next, data will be loaded to other register
+		sp->dma_regs[2]--;
 
-		if (mem_available)
+		if (sp_dma_mem_available(sp, sp->dma_regs[1]))
 		{
 			int temp_reg; //simulate mux choosing which register to write
-			if (write_reg3)
+			if (sp->write_reg3)
 			{
-				temp_reg = dma_regs[3];
+				temp_reg = sp->dma_regs[3];
 			}
 			else
 			{
-				temp_reg = dma_regs[4];
+				temp_reg = sp->dma_regs[4];
 			}
-			llsim_mem_set_datain(sp->sramd, temp_reg, 31, 0);
-			llsim_mem_write(sp->sramd, dma_regs[1]);
-			dma_regs[1]++;
-			write_reg3 = !write_reg3; //next, data will be loaded to other register
-			ctl_dma_state = ONE_WRITE_READY;
+			llsim_mem_set_datain_port(sp->sramd, port, temp_reg, 31, 0);
+			llsim_mem_write_port(sp->sramd, port, sp->dma_regs[1]);
+			sp->dma_regs[1]++;
+			sp->counters.dma_words++;
+			sp->write_reg3 = !sp->write_reg3; //next, data will be loaded to other register
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 		else
 		{
-			ctl_dma_state = TWO_WRITE_READY;
+			sp->ctl_dma_state = TWO_WRITE_READY;
 		}
 		break;
 
 	case(TWO_WRITE_READY):
-		if (mem_available)
+		if (sp_dma_mem_available(sp, sp->dma_regs[1]))
 		{
 			int temp_reg; //simulate mux choosing which register to write
-			if (write_reg3)
+			if (sp->write_reg3)
 			{
-				temp_reg = dma_regs[3];
+				temp_reg = sp->dma_regs[3];
 			}
 			else
 			{
-				temp_reg = dma_regs[4];
+				temp_reg = sp->dma_regs[4];
 			}
-			llsim_mem_set_datain(sp->sramd, temp_reg, 31, 0);
-			llsim_mem_write(sp->sramd, dma_regs[1]);
-			dma_regs[1]++;
-			write_reg3 = !write_reg3; //next, data will be loaded to other register
-			ctl_dma_state = ONE_WRITE_READY;
+			llsim_mem_set_datain_port(sp->sramd, port, temp_reg, 31, 0);
+			llsim_mem_write_port(sp->sramd, port, sp->dma_regs[1]);
+			sp->dma_regs[1]++;
+			sp->counters.dma_words++;
+			sp->write_reg3 = !sp->write_reg3; //next, data will be loaded to other register
+			sp->ctl_dma_state = ONE_WRITE_READY;
 		}
 		break;
 	case(ONE_WRITE_READY):
-		if (mem_available)
+		if (sp_dma_mem_available(sp, sp->dma_regs[1]))
 		{
 			int temp_reg; //simulate mux choosing which register to write
-			if (write_reg3)
+			if (sp->write_reg3)
 			{
-				temp_reg = dma_regs[3];
+				temp_reg = sp->dma_regs[3];
 			}
 			else
 			{
-				temp_reg = dma_regs[4];
+				temp_reg = sp->dma_regs[4];
 			}
-			llsim_mem_set_datain(sp->sramd, temp_reg, 31, 0);
-			llsim_mem_write(sp->sramd, dma_regs[1]);
-			dma_regs[1]++;
-			write_reg3 = !write_reg3; //next, data will be loaded to other register
-			if (dma_regs[2] == 0)
+			llsim_mem_set_datain_port(sp->sramd, port, temp_reg, 31, 0);
+			llsim_mem_write_port(sp->sramd, port, sp->dma_regs[1]);
+			sp->dma_regs[1]++;
+			sp->counters.dma_words++;
+			sp->write_reg3 = !sp->write_reg3; //next, data will be loaded to other register
+			if (sp->dma_regs[2] == 0)
 			{
-				dma_opcode_received = false;
-				ctl_dma_state = DMA_IDLE_STATE;
+				sp->dma_opcode_received = false;
+				sp->ctl_dma_state = DMA_IDLE_STATE;
 			}
-			ctl_dma_state = NO_READ_WRITE;
+			sp->ctl_dma_state = NO_READ_WRITE;
 		}
 		break;
 	case(DMA_IDLE_STATE):
-		if (dma_opcode_received)
+		if (sp->dma_opcode_received)
 		{
-			ctl_dma_state = NO_READ_WRITE;
+			sp->ctl_dma_state = NO_READ_WRITE;
 		}
 		break;
 
@@ -1240,9 +1856,9 @@ void perform_dma_logic(bool mem_available, sp_t* sp)
 
 }
 
-int predict_jump(int current_pc)
+int predict_jump(sp_t *sp, int current_pc)
 {
-	int table_value = jump_predictors[(current_pc % 40)]; //check what's the current pc prediction
+	int table_value = sp->jump_predictors[(current_pc % 40)]; //check what's the current pc prediction
 	return table_value > 1; //simulate 2 bit prediction
 }
 
@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "trace.h"
+
+// open traces, closed (and drained) at exit
+static trace_t *open_traces;
+static pthread_mutex_t open_traces_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *trace_malloc(int len)
+{
+	void *p;
+
+	p = malloc(len);
+	if (p == NULL) {
+		printf("trace: out of memory\n");
+		exit(1);
+	}
+	memset(p, 0, len);
+	return p;
+}
+
+static void trace_close_all(void)
+{
+	while (open_traces)
+		trace_close(open_traces);
+}
+
+trace_t *trace_attach(FILE *fp, int rec_size, trace_write_t write, void *private)
+{
+	static int atexit_done;
+	trace_t *trace;
+
+	trace = trace_malloc(sizeof(trace_t));
+	trace->fp = fp;
+	trace->rec_size = rec_size;
+	trace->write = write;
+	trace->private = private;
+	trace->ring_size = TRACE_RING_RECORDS;
+	trace->ring = trace_malloc(trace->ring_size * rec_size * sizeof(int));
+
+	if (fp) {
+		pthread_mutex_lock(&open_traces_lock);
+		if (!atexit_done) {
+			atexit(trace_close_all);
+			atexit_done = 1;
+		}
+		trace->next = open_traces;
+		open_traces = trace;
+		pthread_mutex_unlock(&open_traces_lock);
+	}
+	return trace;
+}
+
+static void trace_write_cycles(trace_t *trace, int *rec, int count)
+{
+	char *p;
+	int i;
+
+	if (trace->binary) {
+		fwrite(rec, sizeof(int) * trace->rec_size, count, trace->fp);
+		return;
+	}
+	p = trace->text;
+	for (i = 0; i < count; i++)
+		p += trace_format_text(trace, p, rec + i * trace->rec_size);
+	fwrite(trace->text, 1, p - trace->text, trace->fp);
+}
+
+static trace_t *trace_alloc_cycles(FILE *fp, int binary, int nfields, char **names, char *terminator)
+{
+	trace_t *trace;
+	int i, line_len;
+
+	trace = trace_attach(fp, nfields, trace_write_cycles, NULL);
+	trace->binary = binary;
+	trace->names = names;
+	trace->terminator = terminator;
+
+	// worst case text size of one record
+	line_len = strlen("cycle -2147483648\n") + strlen(terminator);
+	for (i = 0; i < nfields; i++)
+		line_len += strlen(names[i]) + 10;
+	trace->text_size = line_len * trace->ring_size;
+	trace->text = trace_malloc(trace->text_size);
+	return trace;
+}
+
+static void trace_write_header(trace_t *trace)
+{
+	int hdr[3], len, i;
+
+	hdr[0] = TRACE_MAGIC;
+	hdr[1] = TRACE_VERSION;
+	hdr[2] = trace->rec_size;
+	fwrite(hdr, sizeof(int), 3, trace->fp);
+	len = strlen(trace->terminator);
+	fwrite(&len, sizeof(int), 1, trace->fp);
+	fwrite(trace->terminator, 1, len, trace->fp);
+	for (i = 0; i < trace->rec_size; i++) {
+		len = strlen(trace->names[i]);
+		fwrite(&len, sizeof(int), 1, trace->fp);
+		fwrite(trace->names[i], 1, len, trace->fp);
+	}
+}
+
+trace_t *trace_open(char *path, int binary, int nfields, char **names, char *terminator)
+{
+	trace_t *trace;
+	FILE *fp;
+
+	fp = fopen(path, binary ? "wb" : "w");
+	if (fp == NULL) {
+		printf("couldn't open file %s\n", path);
+		exit(1);
+	}
+	trace = trace_alloc_cycles(fp, binary, nfields, names, terminator);
+	if (binary)
+		trace_write_header(trace);
+	return trace;
+}
+
+static char *trace_read_string(FILE *fp)
+{
+	char *s;
+	int len;
+
+	if (fread(&len, sizeof(int), 1, fp) != 1 || len < 0 || len > 1024)
+		return NULL;
+	s = trace_malloc(len + 1);
+	if (fread(s, 1, len, fp) != len)
+		return NULL;
+	return s;
+}
+
+/*
+ * parses the header of a binary trace, the returned trace has no output file
+ */
+trace_t *trace_open_reader(FILE *fp)
+{
+	char **names, *terminator;
+	int hdr[3], i;
+
+	if (fread(hdr, sizeof(int), 3, fp) != 3 || hdr[0] != TRACE_MAGIC) {
+		printf("trace: not a binary cycle trace\n");
+		return NULL;
+	}
+	if (hdr[1] != TRACE_VERSION) {
+		printf("trace: unsupported version %d\n", hdr[1]);
+		return NULL;
+	}
+	terminator = trace_read_string(fp);
+	names = trace_malloc(hdr[2] * sizeof(char *));
+	for (i = 0; i < hdr[2]; i++)
+		names[i] = trace_read_string(fp);
+	if (terminator == NULL || (hdr[2] && names[hdr[2] - 1] == NULL)) {
+		printf("trace: truncated header\n");
+		return NULL;
+	}
+	return trace_alloc_cycles(NULL, 0, hdr[2], names, terminator);
+}
+
+static char *trace_put_str(char *p, char *s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+static char *trace_put_hex(char *p, unsigned int val)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		p[7 - i] = hex[(val >> (i * 4)) & 0xf];
+	return p + 8;
+}
+
+/*
+ * formats one record exactly as the legacy fprintf based trace did,
+ * returns the number of characters written
+ */
+int trace_format_text(trace_t *trace, char *buf, int *rec)
+{
+	char *p = buf;
+	int i;
+
+	p += sprintf(p, "cycle %d\n", rec[0]);
+	for (i = 0; i < trace->rec_size; i++) {
+		p = trace_put_str(p, trace->names[i]);
+		*p++ = ' ';
+		p = trace_put_hex(p, rec[i]);
+		*p++ = '\n';
+	}
+	p = trace_put_str(p, trace->terminator);
+	return p - buf;
+}
+
+/*
+ * hands all committed records to the write callback, returns how many
+ */
+static int trace_consume(trace_t *trace)
+{
+	unsigned int head, tail;
+	int pos, count, done;
+
+	head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	tail = trace->tail;
+	done = 0;
+	while (tail != head) {
+		// up to the end of the ring in one go
+		pos = tail & (trace->ring_size - 1);
+		count = head - tail;
+		if (count > trace->ring_size - pos)
+			count = trace->ring_size - pos;
+		trace->write(trace, trace->ring + pos * trace->rec_size, count);
+		tail += count;
+		done += count;
+		__atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+	}
+	return done;
+}
+
+void trace_flush(trace_t *trace)
+{
+	trace_consume(trace);
+}
+
+static void *trace_writer(void *arg)
+{
+	trace_t *trace = arg;
+	struct timespec ts;
+
+	for (;;) {
+		if (trace_consume(trace))
+			continue;
+		if (__atomic_load_n(&trace->stop, __ATOMIC_SEQ_CST)) {
+			// pick up whatever was committed before the stop
+			trace_consume(trace);
+			break;
+		}
+		pthread_mutex_lock(&trace->lock);
+		__atomic_store_n(&trace->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&trace->head, __ATOMIC_SEQ_CST) == trace->tail &&
+		    !__atomic_load_n(&trace->stop, __ATOMIC_SEQ_CST)) {
+			// the producer only wakes us every TRACE_WAKE_BATCH records
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 10 * 1000 * 1000;
+			if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+				ts.tv_nsec -= 1000 * 1000 * 1000;
+				ts.tv_sec++;
+			}
+			pthread_cond_timedwait(&trace->cond, &trace->lock, &ts);
+		}
+		__atomic_store_n(&trace->sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&trace->lock);
+	}
+	return NULL;
+}
+
+/*
+ * from here on records are written by a background thread
+ */
+void trace_start_writer(trace_t *trace)
+{
+	pthread_mutex_init(&trace->lock, NULL);
+	pthread_cond_init(&trace->cond, NULL);
+	trace->async = 1;
+	if (pthread_create(&trace->thread, NULL, trace_writer, trace) != 0) {
+		printf("trace: couldn't start writer thread\n");
+		exit(1);
+	}
+}
+
+void trace_wake(trace_t *trace)
+{
+	trace->woken = trace->head;
+	if (__atomic_load_n(&trace->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&trace->lock);
+		pthread_cond_signal(&trace->cond);
+		pthread_mutex_unlock(&trace->lock);
+	}
+}
+
+/*
+ * ring is full, let the writer catch up
+ */
+void trace_wait_space(trace_t *trace)
+{
+	while (trace->head - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) == trace->ring_size) {
+		trace_wake(trace);
+		sched_yield();
+	}
+}
+
+/*
+ * drains all committed records and closes the file
+ */
+void trace_close(trace_t *trace)
+{
+	trace_t **pp;
+
+	if (trace->async) {
+		__atomic_store_n(&trace->stop, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&trace->lock);
+		pthread_cond_signal(&trace->cond);
+		pthread_mutex_unlock(&trace->lock);
+		pthread_join(trace->thread, NULL);
+		pthread_mutex_destroy(&trace->lock);
+		pthread_cond_destroy(&trace->cond);
+	} else {
+		trace_flush(trace);
+	}
+
+	pthread_mutex_lock(&open_traces_lock);
+	for (pp = &open_traces; *pp; pp = &(*pp)->next) {
+		if (*pp == trace) {
+			*pp = trace->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&open_traces_lock);
+
+	fclose(trace->fp);
+	free(trace->text);
+	free(trace->ring);
+	free(trace);
+}
@@ -0,0 +1,100 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * trace writer
+ *
+ * the simulation fills fixed size records (trace_next/trace_commit) into a
+ * large single producer / single consumer ring. records are written out in
+ * big chunks by a write callback, either from the simulation thread when
+ * the ring fills up or, after trace_start_writer(), from a background
+ * writer thread so formatting and file I/O overlap the simulation.
+ *
+ * trace_open() creates a cycle trace: records of 32 bit fields, formatted
+ * as the legacy cycle_trace.txt text or written raw to a binary file which
+ * trace2txt converts back to text offline.
+ */
+#define TRACE_MAGIC		0x5443534c	// "LSCT"
+#define TRACE_VERSION		1
+#define TRACE_RING_RECORDS	4096		// power of 2
+#define TRACE_WAKE_BATCH	(TRACE_RING_RECORDS / 8)
+
+typedef struct trace_s trace_t;
+
+// writes count consecutive records to trace->fp
+typedef void (*trace_write_t)(trace_t *trace, int *rec, int count);
+
+struct trace_s {
+	FILE *fp;
+	int rec_size;		// ints per record
+	trace_write_t write;
+	void *private;
+
+	// cycle trace layout: field 0 is also printed as the "cycle %d" header
+	int binary;
+	char **names;
+	char *terminator;
+
+	// ring of rec_size * ring_size ints, head is written by the producer
+	// and tail by the consumer only
+	int *ring;
+	int ring_size;
+	unsigned int head;
+	unsigned int tail;
+
+	// text formatting buffer
+	char *text;
+	int text_size;
+
+	// background writer
+	int async;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int woken;
+	int sleeping;
+	int stop;
+
+	trace_t *next;
+};
+
+trace_t *trace_attach(FILE *fp, int rec_size, trace_write_t write, void *private);
+trace_t *trace_open(char *path, int binary, int nfields, char **names, char *terminator);
+trace_t *trace_open_reader(FILE *fp);
+void trace_start_writer(trace_t *trace);
+void trace_flush(trace_t *trace);
+void trace_wait_space(trace_t *trace);
+void trace_wake(trace_t *trace);
+void trace_close(trace_t *trace);
+int trace_format_text(trace_t *trace, char *buf, int *rec);
+
+/*
+ * returns the next record to fill, the record is handed to the writer by
+ * trace_commit()
+ */
+static inline int *trace_next(trace_t *trace)
+{
+	if (trace->head - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) == trace->ring_size) {
+		if (trace->async)
+			trace_wait_space(trace);
+		else
+			trace_flush(trace);
+	}
+	return trace->ring + (trace->head & (trace->ring_size - 1)) * trace->rec_size;
+}
+
+static inline void trace_commit(trace_t *trace)
+{
+	unsigned int head = trace->head + 1;
+
+	if (!trace->async) {
+		trace->head = head;
+		return;
+	}
+	__atomic_store_n(&trace->head, head, __ATOMIC_SEQ_CST);
+	if (head - trace->woken >= TRACE_WAKE_BATCH)
+		trace_wake(trace);
+}
+#endif
@@ -0,0 +1,47 @@
+/*
+ * trace2txt - convert a binary cycle trace (llsim -b) to cycle_trace.txt text
+ *
+ * usage: trace2txt cycle_trace.bin [cycle_trace.txt]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include "trace.h"
+
+int main(int argc, char **argv)
+{
+	trace_t *trace;
+	FILE *in, *out;
+	int n;
+
+	if (argc < 2 || argc > 3) {
+		printf("usage: %s cycle_trace.bin [cycle_trace.txt]\n", argv[0]);
+		exit(1);
+	}
+	in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		printf("couldn't open file %s\n", argv[1]);
+		exit(1);
+	}
+	out = stdout;
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			printf("couldn't open file %s\n", argv[2]);
+			exit(1);
+		}
+	}
+
+	trace = trace_open_reader(in);
+	if (trace == NULL)
+		exit(1);
+	trace->fp = out;
+	while ((n = fread(trace->ring, sizeof(int) * trace->rec_size, trace->ring_size, in)) > 0) {
+		trace->tail = 0;
+		trace->head = n;
+		trace_flush(trace);
+	}
+
+	fclose(in);
+	trace_close(trace);
+	return 0;
+}